@@ -0,0 +1,194 @@
+/*****************************************************************************/
+/*  bandwidth.c - bandwidth limits that are shared between file transfers    */
+/*  Copyright (C) 1998-2008 Brian Masney <masneyb@gftp.org>                  */
+/*                                                                           */
+/*  This program is free software; you can redistribute it and/or modify     */
+/*  it under the terms of the GNU General Public License as published by     */
+/*  the Free Software Foundation; either version 2 of the License, or        */
+/*  (at your option) any later version.                                      */
+/*                                                                           */
+/*  This program is distributed in the hope that it will be useful,          */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of           */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            */
+/*  GNU General Public License for more details.                             */
+/*                                                                           */
+/*  You should have received a copy of the GNU General Public License        */
+/*  along with this program; if not, write to the Free Software              */
+/*  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA      */
+/*****************************************************************************/
+
+#include "gftp.h"
+static const char cvsid[] = "$Id$";
+
+/* Each limit is a token bucket that fills up at the configured rate and
+   holds at most one second worth of data. Every chunk that is transferred
+   takes its size out of the bucket for the transfer, the bucket for each
+   remote host and the global bucket. A bucket is allowed to go negative;
+   the transfer then sleeps until the bucket it overdrew is paid back.
+   Since the transfers that share a bucket queue up behind each other in
+   the order that they used it, each one gets an even share of the limit,
+   and the share of a transfer that finishes or stalls is picked up by the
+   others right away. */
+
+static GStaticMutex bandwidth_mutex = G_STATIC_MUTEX_INIT;
+static gftp_bandwidth_bucket global_bucket;
+static GHashTable * host_buckets = NULL;
+
+
+static double
+_gftp_bandwidth_take (gftp_bandwidth_bucket * bucket, float maxkbs,
+                      ssize_t num_bytes, struct timeval * tv)
+{
+  double rate, elapsed;
+
+  if (maxkbs <= 0)
+    {
+      bucket->rate = 0;
+      return (0);
+    }
+
+  rate = maxkbs * 1024.0;
+  if (bucket->rate == 0 || bucket->lastfill.tv_sec == 0)
+    {
+      bucket->rate = rate;
+      bucket->tokens = rate;
+      memcpy (&bucket->rateset, tv, sizeof (bucket->rateset));
+    }
+  else
+    {
+      elapsed = (tv->tv_sec - bucket->lastfill.tv_sec) + ((double) (tv->tv_usec - bucket->lastfill.tv_usec) / 1000000.0);
+      if (elapsed > 0)
+        bucket->tokens += elapsed * bucket->rate;
+
+      /* The transfers that share a host bucket can have different limits.
+         The lowest limit that was asked for in the last second is used, and
+         a change of the limit never fills the bucket back up */
+      elapsed = (tv->tv_sec - bucket->rateset.tv_sec) + ((double) (tv->tv_usec - bucket->rateset.tv_usec) / 1000000.0);
+      if (rate <= bucket->rate || elapsed > 1.0)
+        {
+          bucket->rate = rate;
+          memcpy (&bucket->rateset, tv, sizeof (bucket->rateset));
+        }
+
+      if (bucket->tokens > bucket->rate)
+        bucket->tokens = bucket->rate;
+    }
+
+  memcpy (&bucket->lastfill, tv, sizeof (bucket->lastfill));
+
+  bucket->tokens -= num_bytes;
+  if (bucket->tokens >= 0)
+    return (0);
+
+  return (-bucket->tokens / bucket->rate);
+}
+
+
+static double
+_gftp_bandwidth_take_host (gftp_request * request, ssize_t num_bytes,
+                           struct timeval * tv)
+{
+  union { intptr_t i; float f; } host_maxkbs;
+  gftp_bandwidth_bucket * bucket;
+
+  if (request == NULL || request->protonum == GFTP_LOCAL_NUM ||
+      request->hostname == NULL)
+    return (0);
+
+  gftp_lookup_request_option (request, "host_maxkbs", &host_maxkbs.f);
+  if (host_maxkbs.f <= 0)
+    return (0);
+
+  if (host_buckets == NULL)
+    host_buckets = g_hash_table_new (string_hash_function,
+                                     string_hash_compare);
+
+  if ((bucket = g_hash_table_lookup (host_buckets, request->hostname)) == NULL)
+    {
+      bucket = g_malloc0 (sizeof (*bucket));
+      g_hash_table_insert (host_buckets, g_strdup (request->hostname), bucket);
+    }
+
+  return (_gftp_bandwidth_take (bucket, host_maxkbs.f, num_bytes, tv));
+}
+
+
+/* Charges num_bytes against the maxkbs, host_maxkbs and global_maxkbs
+   limits and sleeps for as long as the most overdrawn one needs. Returns 1
+   if it slept. */
+
+int
+gftp_bandwidth_limit (gftp_transfer * tdata, ssize_t num_bytes)
+{
+  /* Needed for systems that size(float) < size(void *) */
+  union { intptr_t i; float f; } maxkbs, host_maxkbs, global_maxkbs;
+  double waitsecs, tmpwait;
+  gftp_transfer * stats;
+  struct timeval tv;
+
+  g_return_val_if_fail (tdata != NULL, 0);
+
+  if (num_bytes <= 0)
+    return (0);
+
+  gftp_lookup_request_option (tdata->fromreq, "maxkbs", &maxkbs.f);
+  gftp_lookup_global_option ("global_maxkbs", &global_maxkbs.f);
+
+  if (maxkbs.f <= 0 && global_maxkbs.f <= 0)
+    {
+      gftp_lookup_request_option (tdata->fromreq, "host_maxkbs",
+                                  &host_maxkbs.f);
+      if (host_maxkbs.f <= 0)
+        {
+          gftp_lookup_request_option (tdata->toreq, "host_maxkbs",
+                                      &host_maxkbs.f);
+          if (host_maxkbs.f <= 0)
+            return (0);
+        }
+    }
+
+  /* The per transfer limit covers all of the connections of a transfer */
+  stats = tdata->parent != NULL ? tdata->parent : tdata;
+
+  if (g_thread_supported ())
+    g_static_mutex_lock (&bandwidth_mutex);
+
+  gettimeofday (&tv, NULL);
+
+  waitsecs = _gftp_bandwidth_take (&stats->bandwidth, maxkbs.f, num_bytes,
+                                   &tv);
+
+  tmpwait = _gftp_bandwidth_take_host (tdata->fromreq, num_bytes, &tv);
+  if (tmpwait > waitsecs)
+    waitsecs = tmpwait;
+
+  if (tdata->toreq != NULL && (tdata->fromreq->hostname == NULL ||
+      tdata->toreq->hostname == NULL ||
+      strcmp (tdata->fromreq->hostname, tdata->toreq->hostname) != 0))
+    {
+      tmpwait = _gftp_bandwidth_take_host (tdata->toreq, num_bytes, &tv);
+      if (tmpwait > waitsecs)
+        waitsecs = tmpwait;
+    }
+
+  tmpwait = _gftp_bandwidth_take (&global_bucket, global_maxkbs.f, num_bytes,
+                                  &tv);
+  if (tmpwait > waitsecs)
+    waitsecs = tmpwait;
+
+  if (g_thread_supported ())
+    g_static_mutex_unlock (&bandwidth_mutex);
+
+  if (waitsecs <= 0)
+    return (0);
+
+  /* Sleep in small steps so that a cancelled transfer stops right away */
+  while (waitsecs > 0 && !tdata->cancel && !stats->cancel)
+    {
+      tmpwait = waitsecs > 0.5 ? 0.5 : waitsecs;
+      usleep ((unsigned long) (tmpwait * 1000000.0));
+      waitsecs -= tmpwait;
+    }
+
+  return (1);
+}
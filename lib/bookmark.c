@@ -82,6 +82,10 @@ bookmark_init (gftp_request * request)
   request->chmod = NULL;
   request->set_file_time = NULL;
   request->site = NULL;
+  request->exec_command = NULL;
+  request->check_connection = NULL;
+  request->prefetch_file = NULL;
+  request->prefetch_listings = NULL;
   request->parse_url = bookmark_parse_url;
   request->url_prefix = "bookmark";
   request->need_hostport = 0;
@@ -0,0 +1,727 @@
+/*****************************************************************************/
+/*  bulk-transfer.c - copies whole directory trees with a remote shell       */
+/*  Copyright (C) 1998-2008 Brian Masney <masneyb@gftp.org>                  */
+/*                                                                           */
+/*  This program is free software; you can redistribute it and/or modify     */
+/*  it under the terms of the GNU General Public License as published by     */
+/*  the Free Software Foundation; either version 2 of the License, or        */
+/*  (at your option) any later version.                                      */
+/*                                                                           */
+/*  This program is distributed in the hope that it will be useful,          */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of           */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            */
+/*  GNU General Public License for more details.                             */
+/*                                                                           */
+/*  You should have received a copy of the GNU General Public License        */
+/*  along with this program; if not, write to the Free Software              */
+/*  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA      */
+/*****************************************************************************/
+
+#include "gftp.h"
+static const char cvsid[] = "$Id$";
+
+/* When both sides of a transfer can run shell commands (see the
+   exec_command function of the request), a directory that does not exist on
+   the destination yet is copied by piping tar c on the source into tar x on
+   the destination instead of opening every file in it on its own. The same
+   way, a directory tree is removed with rm -rf and sized with du.
+
+   Every command prints GFTP_BULK_READY first so that anything the shell
+   prints while it starts up can be skipped. The exit status of the command
+   is not available since the children are reaped by the SIGCHLD handler, so
+   the commands that have to succeed print GFTP_BULK_DONE when they are
+   finished. tar c prints its exit status after the archive as GFTP_BULK_RC
+   followed by the number, and that is taken off the end of the stream
+   before it gets to tar x. */
+
+#define GFTP_BULK_READY		"gftp-bulk-ready"
+#define GFTP_BULK_DONE		"gftp-bulk-done"
+#define GFTP_BULK_RC		"gftp-bulk-rc="
+
+/* The most bytes at the end of the tar stream that can be the exit status */
+#define GFTP_BULK_TAIL_SIZE	64
+
+/* The most directories that are passed to one du */
+#define GFTP_BULK_MAX_DU_PATHS	256
+
+typedef struct gftp_bulk_channel_tag
+{
+  gftp_request * request;
+  pid_t pid;
+  int fd,			/* stdin and stdout of the command */
+      errfd;			/* stderr of the command. -1 once it is
+                                   closed */
+} gftp_bulk_channel;
+
+
+static int
+_gftp_bulk_enabled (gftp_request * request)
+{
+  intptr_t ssh_bulk_transfers;
+
+  if (request->exec_command == NULL)
+    return (0);
+  else if (request->protonum == GFTP_LOCAL_NUM)
+    return (1);
+
+  gftp_lookup_request_option (request, "ssh_bulk_transfers",
+                              &ssh_bulk_transfers);
+  return (ssh_bulk_transfers != 0);
+}
+
+
+/* Returns 1 if the directories can be copied from fromreq to toreq with
+   gftp_bulk_transfer_dir(). If toreq is NULL, then this checks if the
+   directories on fromreq can be removed and sized in one go. At least one of
+   the sides has to be remote. */
+
+int
+gftp_bulk_supported (gftp_request * fromreq, gftp_request * toreq)
+{
+  g_return_val_if_fail (fromreq != NULL, 0);
+
+  if (!_gftp_bulk_enabled (fromreq))
+    return (0);
+  else if (toreq == NULL)
+    return (fromreq->protonum != GFTP_LOCAL_NUM);
+  else if (!_gftp_bulk_enabled (toreq))
+    return (0);
+
+  return (fromreq->protonum != GFTP_LOCAL_NUM ||
+          toreq->protonum != GFTP_LOCAL_NUM);
+}
+
+
+static const char *
+_gftp_bulk_hostname (gftp_request * request)
+{
+  return (request->hostname != NULL ? request->hostname : "localhost");
+}
+
+
+static char *
+_gftp_bulk_abs_path (gftp_request * request, const char *path)
+{
+  if (*path != '/' && request->directory != NULL)
+    return (gftp_build_path (request, request->directory, path, NULL));
+  else
+    return (g_strdup (path));
+}
+
+
+/* Returns the absolute path in single quotes for the shell. Each ' inside of
+   the path turns into '\'' */
+
+static char *
+_gftp_bulk_quote_path (gftp_request * request, const char *path)
+{
+  char *abspath, *ret, *pos;
+  const char *src;
+  size_t len;
+
+  abspath = _gftp_bulk_abs_path (request, path);
+
+  len = 3;
+  for (src = abspath; *src != '\0'; src++)
+    len += *src == '\'' ? 4 : 1;
+
+  ret = pos = g_malloc0 ((gulong) len);
+  *pos++ = '\'';
+  for (src = abspath; *src != '\0'; src++)
+    {
+      if (*src == '\'')
+        {
+          memcpy (pos, "'\\''", 4);
+          pos += 4;
+        }
+      else
+        *pos++ = *src;
+    }
+  *pos = '\'';
+
+  g_free (abspath);
+  return (ret);
+}
+
+
+static void
+_gftp_bulk_log_stderr (gftp_bulk_channel * chan)
+{
+  char buf[512];
+  ssize_t num_read;
+
+  num_read = read (chan->errfd, buf, sizeof (buf) - 1);
+  if (num_read < 0 && (errno == EINTR || errno == EAGAIN))
+    return;
+  else if (num_read <= 0)
+    {
+      /* The pty returns an error once the command exits */
+      close (chan->errfd);
+      chan->errfd = -1;
+      return;
+    }
+
+  buf[num_read] = '\0';
+  chan->request->logging_function (gftp_logging_error, chan->request, "%s",
+                                   buf);
+}
+
+
+/* Waits until the command can be read from or written to. Anything that it
+   writes to stderr in the meantime is logged. timeout is the number of
+   seconds that the command can be quiet for, or 0 to wait for as long as it
+   takes. rm and du do not print anything until they are done. */
+
+static int
+_gftp_bulk_wait (gftp_bulk_channel * chan, int for_write, int timeout)
+{
+  fd_set rset, wset;
+  struct timeval tv;
+  int maxfd, ret, idle;
+
+  idle = 0;
+  while (1)
+    {
+      FD_ZERO (&rset);
+      FD_ZERO (&wset);
+      FD_SET (chan->fd, for_write ? &wset : &rset);
+      maxfd = chan->fd;
+
+      if (chan->errfd >= 0)
+        {
+          FD_SET (chan->errfd, &rset);
+          if (chan->errfd > maxfd)
+            maxfd = chan->errfd;
+        }
+
+      tv.tv_sec = 1;
+      tv.tv_usec = 0;
+      ret = select (maxfd + 1, &rset, &wset, NULL, &tv);
+
+      if (chan->request->cancel)
+        return (GFTP_ERETRYABLE);
+      else if (ret < 0)
+        {
+          if (errno == EINTR || errno == EAGAIN)
+            continue;
+
+          chan->request->logging_function (gftp_logging_error, chan->request,
+                               _("Error: Could not read from socket: %s\n"),
+                               g_strerror (errno));
+          return (GFTP_ERETRYABLE);
+        }
+      else if (ret == 0)
+        {
+          if (timeout > 0 && ++idle >= timeout)
+            {
+              chan->request->logging_function (gftp_logging_error,
+                                         chan->request,
+                                         _("Connection to %s timed out\n"),
+                                         _gftp_bulk_hostname (chan->request));
+              return (GFTP_ERETRYABLE);
+            }
+
+          continue;
+        }
+
+      idle = 0;
+      if (chan->errfd >= 0 && FD_ISSET (chan->errfd, &rset))
+        _gftp_bulk_log_stderr (chan);
+
+      if (FD_ISSET (chan->fd, for_write ? &wset : &rset))
+        return (0);
+    }
+}
+
+
+static ssize_t
+_gftp_bulk_read (gftp_bulk_channel * chan, char *buf, size_t size,
+                 int timeout)
+{
+  ssize_t ret;
+
+  while (1)
+    {
+      if ((ret = _gftp_bulk_wait (chan, 0, timeout)) < 0)
+        return (ret);
+
+      if ((ret = read (chan->fd, buf, size)) >= 0)
+        return (ret);
+      else if (errno == EINTR || errno == EAGAIN)
+        continue;
+
+      chan->request->logging_function (gftp_logging_error, chan->request,
+                               _("Error: Could not read from socket: %s\n"),
+                               g_strerror (errno));
+      return (GFTP_ERETRYABLE);
+    }
+}
+
+
+static int
+_gftp_bulk_write (gftp_bulk_channel * chan, const char *buf, size_t size,
+                  int timeout)
+{
+  ssize_t ret;
+
+  while (size > 0)
+    {
+      if ((ret = _gftp_bulk_wait (chan, 1, timeout)) < 0)
+        return (ret);
+
+      if ((ret = write (chan->fd, buf, size)) < 0)
+        {
+          if (errno == EINTR || errno == EAGAIN)
+            continue;
+
+          chan->request->logging_function (gftp_logging_error, chan->request,
+                               _("Error: Could not write to socket: %s\n"),
+                               g_strerror (errno));
+          return (GFTP_ERETRYABLE);
+        }
+
+      buf += ret;
+      size -= ret;
+    }
+
+  return (0);
+}
+
+
+static void
+_gftp_bulk_close (gftp_bulk_channel * chan, int kill_command)
+{
+  if (chan->fd >= 0)
+    close (chan->fd);
+
+  if (chan->errfd >= 0)
+    close (chan->errfd);
+
+  if (kill_command && chan->pid > 0)
+    kill (chan->pid, SIGTERM);
+
+  chan->fd = chan->errfd = -1;
+  chan->pid = 0;
+}
+
+
+static int
+_gftp_bulk_open (gftp_bulk_channel * chan, gftp_request * request,
+                 const char *command)
+{
+  char line[128], *tempstr;
+  intptr_t network_timeout;
+  ssize_t ret;
+  size_t len;
+
+  memset (chan, 0, sizeof (*chan));
+  chan->request = request;
+  chan->fd = chan->errfd = -1;
+
+  tempstr = g_strconcat ("echo ", GFTP_BULK_READY, " && ", command, NULL);
+  chan->pid = request->exec_command (request, tempstr, &chan->fd,
+                                     &chan->errfd);
+  g_free (tempstr);
+
+  if (chan->pid < 0)
+    {
+      ret = chan->pid;
+      chan->fd = chan->errfd = -1;
+      chan->pid = 0;
+      return (ret);
+    }
+
+  gftp_lookup_request_option (request, "network_timeout", &network_timeout);
+
+  /* Skip over anything that the login scripts print */
+  len = 0;
+  while (1)
+    {
+      ret = _gftp_bulk_read (chan, line + len, 1, network_timeout);
+      if (ret == 0)
+        {
+          request->logging_function (gftp_logging_error, request,
+                                     _("Error: Could not run %s on %s\n"),
+                                     command, _gftp_bulk_hostname (request));
+          ret = GFTP_ERETRYABLE;
+        }
+
+      if (ret < 0)
+        {
+          _gftp_bulk_close (chan, 1);
+          return (ret);
+        }
+
+      if (line[len] != '\n' && len < sizeof (line) - 1)
+        {
+          len++;
+          continue;
+        }
+
+      line[len] = '\0';
+      if (strcmp (line, GFTP_BULK_READY) == 0)
+        break;
+
+      len = 0;
+    }
+
+  return (0);
+}
+
+
+/* Reads everything that the command prints until it exits */
+
+static char *
+_gftp_bulk_read_output (gftp_bulk_channel * chan, int timeout)
+{
+  char buf[1024], *ret;
+  ssize_t num_read;
+  size_t len;
+
+  len = 0;
+  ret = g_malloc0 (1);
+  while ((num_read = _gftp_bulk_read (chan, buf, sizeof (buf), timeout)) > 0)
+    {
+      ret = g_realloc (ret, (gulong) len + num_read + 1);
+      memcpy (ret + len, buf, num_read);
+      len += num_read;
+      ret[len] = '\0';
+    }
+
+  if (num_read < 0)
+    {
+      g_free (ret);
+      return (NULL);
+    }
+
+  return (ret);
+}
+
+
+/* Runs command and returns 0 if it printed GFTP_BULK_DONE at the end.
+   Nothing but that is expected on its stdout */
+
+static int
+_gftp_bulk_run (gftp_request * request, const char *command)
+{
+  gftp_bulk_channel chan;
+  char *output;
+  int ret;
+
+  if ((ret = _gftp_bulk_open (&chan, request, command)) < 0)
+    return (ret);
+
+  output = _gftp_bulk_read_output (&chan, 0);
+  ret = output != NULL && strstr (output, GFTP_BULK_DONE) != NULL ?
+        0 : GFTP_ERETRYABLE;
+
+  _gftp_bulk_close (&chan, output == NULL);
+  if (output != NULL)
+    g_free (output);
+
+  return (ret);
+}
+
+
+static void
+_gftp_bulk_free_key (gpointer key, gpointer value, gpointer user_data)
+{
+  g_free (key);
+}
+
+
+/* Runs one du for the directories in files, starting with the first one,
+   until GFTP_BULK_MAX_DU_PATHS of them have been added. Returns the list
+   item to continue with */
+
+static GList *
+_gftp_bulk_size_trees (gftp_request * request, GList * files)
+{
+  char *qpath, *output, *line, *endpos, *tabpos;
+  gftp_bulk_channel chan;
+  GHashTable * dirs;
+  gftp_file * curfle;
+  GString * command;
+  int num, ret;
+
+  dirs = g_hash_table_new (string_hash_function, string_hash_compare);
+  command = g_string_new ("du -sk");
+
+  for (num = 0; files != NULL && num < GFTP_BULK_MAX_DU_PATHS;
+       files = files->next)
+    {
+      curfle = files->data;
+      if (!S_ISDIR (curfle->st_mode) || curfle->exists_other_side ||
+          curfle->bulk_transfer ||
+          curfle->transfer_action == GFTP_TRANS_ACTION_SKIP ||
+          curfle->transfer_action == GFTP_TRANS_ACTION_DELETE)
+        continue;
+
+      g_hash_table_insert (dirs, _gftp_bulk_abs_path (request, curfle->file),
+                           curfle);
+
+      qpath = _gftp_bulk_quote_path (request, curfle->file);
+      g_string_append_c (command, ' ');
+      g_string_append (command, qpath);
+      g_free (qpath);
+      num++;
+    }
+
+  output = NULL;
+  if (num > 0 &&
+      (ret = _gftp_bulk_open (&chan, request, command->str)) == 0)
+    {
+      output = _gftp_bulk_read_output (&chan, 0);
+      _gftp_bulk_close (&chan, output == NULL);
+    }
+
+  /* Each line is the size in KB, a tab and the path as it was passed. The
+     directories that du could not read are not in there */
+  for (line = output; line != NULL && *line != '\0'; line = endpos)
+    {
+      if ((endpos = strchr (line, '\n')) != NULL)
+        *endpos++ = '\0';
+
+      if ((tabpos = strchr (line, '\t')) == NULL || !isdigit ((int) *line))
+        continue;
+
+      *tabpos++ = '\0';
+      if (tabpos[strlen (tabpos) - 1] == '\r')
+        tabpos[strlen (tabpos) - 1] = '\0';
+
+      if ((curfle = g_hash_table_lookup (dirs, tabpos)) != NULL)
+        {
+          curfle->size = gftp_parse_file_size (line) * 1024;
+          curfle->bulk_transfer = 1;
+        }
+    }
+
+  if (output != NULL)
+    g_free (output);
+
+  g_string_free (command, TRUE);
+  g_hash_table_foreach (dirs, _gftp_bulk_free_key, NULL);
+  g_hash_table_destroy (dirs);
+
+  return (files);
+}
+
+
+/* Finds the directories in files that can be copied with
+   gftp_bulk_transfer_dir(), which are the ones that do not exist on the
+   other side yet, and marks them as bulk transfers. Their size is set to the
+   size of the whole tree. This is only used for the progress of the
+   transfer, so the disk usage that du reports is close enough. All of them
+   are sized with one du, so that there is only one login for the whole
+   selection. A directory that du cannot read is left alone and is
+   transferred one file at a time. */
+
+void
+gftp_bulk_get_tree_sizes (gftp_request * request, GList * files)
+{
+  g_return_if_fail (request != NULL);
+  g_return_if_fail (request->exec_command != NULL);
+
+  while (files != NULL && !request->cancel)
+    files = _gftp_bulk_size_trees (request, files);
+}
+
+
+int
+gftp_bulk_remove_tree (gftp_request * request, const char *path)
+{
+  char *command, *qpath;
+  int ret;
+
+  g_return_val_if_fail (request != NULL, GFTP_EFATAL);
+  g_return_val_if_fail (path != NULL, GFTP_EFATAL);
+  g_return_val_if_fail (request->exec_command != NULL, GFTP_EFATAL);
+
+  qpath = _gftp_bulk_quote_path (request, path);
+  command = g_strdup_printf ("rm -rf %s && echo %s", qpath, GFTP_BULK_DONE);
+  g_free (qpath);
+
+  ret = _gftp_bulk_run (request, command);
+  g_free (command);
+
+  if (ret == 0)
+    request->logging_function (gftp_logging_misc, request,
+                               _("Successfully removed %s\n"), path);
+  else
+    request->logging_function (gftp_logging_error, request,
+                               _("Error: Could not remove directory %s\n"),
+                               path);
+
+  if (request->use_cache)
+    gftp_delete_cache_entry (request, NULL, 0);
+
+  return (ret);
+}
+
+
+/* Takes the exit status of tar c off of the end of the stream in tail and
+   sends the rest of the archive to tochan. Returns an error if tar c did
+   not exit with 0, since the archive is then missing the files that it
+   could not read */
+
+static int
+_gftp_bulk_finish_stream (gftp_transfer * tdata, gftp_file * curfle,
+                          gftp_bulk_channel * tochan, char *tail,
+                          size_t tail_len, int timeout)
+{
+  size_t rclen, pos;
+  int ret, status;
+
+  rclen = strlen (GFTP_BULK_RC);
+  status = -1;
+  for (pos = tail_len >= rclen ? tail_len - rclen + 1 : 0; pos > 0; pos--)
+    {
+      if (memcmp (tail + pos - 1, GFTP_BULK_RC, rclen) == 0)
+        {
+          tail[tail_len] = '\0';
+          status = strtol (tail + pos - 1 + rclen, NULL, 10);
+          tail_len = pos - 1;
+          break;
+        }
+    }
+
+  if (status != 0)
+    {
+      tdata->fromreq->logging_function (gftp_logging_error, tdata->fromreq,
+                                        _("Error: Could not pack %s on %s\n"),
+                                        curfle->file,
+                                        _gftp_bulk_hostname (tdata->fromreq));
+      return (GFTP_ERETRYABLE);
+    }
+
+  if (tail_len == 0)
+    return (0);
+
+  if ((ret = _gftp_bulk_write (tochan, tail, tail_len, timeout)) < 0)
+    return (ret);
+
+  gftp_calc_kbs (tdata, tail_len);
+  return (0);
+}
+
+
+/* Copies the contents of the directory curfle->file on the source into
+   curfle->destfile on the destination. The bytes of the tar stream are
+   counted as the bytes of the transfer, and update_func is called about
+   once a second while it goes. */
+
+int
+gftp_bulk_transfer_dir (gftp_transfer * tdata, gftp_file * curfle,
+                        void (*update_func) (gftp_transfer * tdata))
+{
+  gftp_bulk_channel fromchan, tochan;
+  char *command, *qpath, *buf, *output;
+  size_t bufsize, tail_len, len;
+  struct timeval updatetime;
+  intptr_t network_timeout;
+  ssize_t num_read;
+  int ret;
+
+  g_return_val_if_fail (tdata != NULL, GFTP_EFATAL);
+  g_return_val_if_fail (tdata->toreq != NULL, GFTP_EFATAL);
+  g_return_val_if_fail (curfle != NULL, GFTP_EFATAL);
+
+  qpath = _gftp_bulk_quote_path (tdata->fromreq, curfle->file);
+  command = g_strdup_printf ("cd %s && tar cf - .; echo %s$?", qpath,
+                             GFTP_BULK_RC);
+  g_free (qpath);
+
+  ret = _gftp_bulk_open (&fromchan, tdata->fromreq, command);
+  g_free (command);
+  if (ret < 0)
+    return (ret);
+
+  qpath = _gftp_bulk_quote_path (tdata->toreq, curfle->destfile);
+  command = g_strdup_printf ("mkdir -p %s && cd %s && tar xf - && echo %s",
+                             qpath, qpath, GFTP_BULK_DONE);
+  g_free (qpath);
+
+  ret = _gftp_bulk_open (&tochan, tdata->toreq, command);
+  g_free (command);
+  if (ret < 0)
+    {
+      _gftp_bulk_close (&fromchan, 1);
+      return (ret);
+    }
+
+  gftp_lookup_request_option (tdata->fromreq, "network_timeout",
+                              &network_timeout);
+
+  bufsize = gftp_get_trans_blksize (tdata);
+  buf = g_malloc0 ((gulong) bufsize + GFTP_BULK_TAIL_SIZE + 1);
+  memset (&updatetime, 0, sizeof (updatetime));
+
+  /* The last GFTP_BULK_TAIL_SIZE bytes that were read are held back at the
+     start of buf, since they can be the exit status of tar c */
+  tail_len = 0;
+  num_read = 0;
+  while (!tdata->cancel)
+    {
+      num_read = _gftp_bulk_read (&fromchan, buf + tail_len, bufsize,
+                                  network_timeout);
+      if (num_read <= 0)
+        break;
+
+      len = tail_len + num_read;
+      tail_len = len < GFTP_BULK_TAIL_SIZE ? len : GFTP_BULK_TAIL_SIZE;
+      if (len == tail_len)
+        continue;
+
+      if ((ret = _gftp_bulk_write (&tochan, buf, len - tail_len,
+                                   network_timeout)) < 0)
+        {
+          num_read = ret;
+          break;
+        }
+
+      memmove (buf, buf + len - tail_len, tail_len);
+      gftp_calc_kbs (tdata, len - tail_len);
+
+      if (update_func != NULL &&
+          tdata->lasttime.tv_sec - updatetime.tv_sec >= 1)
+        {
+          update_func (tdata);
+          memcpy (&updatetime, &tdata->lasttime, sizeof (updatetime));
+        }
+    }
+
+  if (num_read == 0 && !tdata->cancel &&
+      (ret = _gftp_bulk_finish_stream (tdata, curfle, &tochan, buf,
+                                       tail_len, network_timeout)) < 0)
+    num_read = ret;
+
+  g_free (buf);
+
+  if (num_read != 0 || tdata->cancel)
+    {
+      _gftp_bulk_close (&fromchan, 1);
+      _gftp_bulk_close (&tochan, 1);
+      return (num_read < 0 ? (int) num_read : GFTP_ERETRYABLE);
+    }
+
+  _gftp_bulk_close (&fromchan, 0);
+
+  /* tar x finishes once it sees the end of its input */
+  shutdown (tochan.fd, SHUT_WR);
+
+  output = _gftp_bulk_read_output (&tochan, network_timeout);
+  ret = output != NULL && strstr (output, GFTP_BULK_DONE) != NULL ?
+        0 : GFTP_ERETRYABLE;
+
+  _gftp_bulk_close (&tochan, ret < 0);
+  if (output != NULL)
+    g_free (output);
+
+  if (ret < 0)
+    tdata->toreq->logging_function (gftp_logging_error, tdata->toreq,
+                                    _("Error: Could not unpack %s on %s\n"),
+                                    curfle->destfile,
+                                    _gftp_bulk_hostname (tdata->toreq));
+
+  return (ret);
+}
@@ -626,6 +626,10 @@ fsp_init (gftp_request * request)
   request->parse_url = NULL;
   request->set_config_options = NULL;
   request->swap_socks = NULL;
+  request->exec_command = NULL;
+  request->check_connection = NULL;
+  request->prefetch_file = NULL;
+  request->prefetch_listings = NULL;
   request->url_prefix = "fsp";
   request->need_hostport = 1;
   request->need_username = 0;
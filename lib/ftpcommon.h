@@ -26,9 +26,31 @@ struct rfc959_params_tag
   gftp_getline_buffer * datafd_rbuf,
                       * dataconn_rbuf;
   int data_connection;
+  unsigned int block_remaining;	/* Data bytes left in the current MODE B
+                                   block */
+  GList * response_lines;	/* Continuation lines of the last response */
+  GString * queued_commands;	/* Pipelined commands not written yet */
+  unsigned int queued_responses;	/* Replies owed for pipelined commands */
   unsigned int is_ascii_transfer : 1,
-               is_fxp_transfer : 1;
+               is_fxp_transfer : 1,
+               keep_response_lines : 1,
+               has_feat : 1,	/* The server answered FEAT */
+               has_size : 1,
+               use_mlst : 1,	/* Use MLSD and MLST instead of LIST */
+               no_pipelining : 1,	/* The server mixed up our pipelined
+                                           commands */
+               block_mode : 1,		/* The server is in MODE B */
+               no_block_mode : 1,	/* The server refused MODE B */
+               block_eof : 1,		/* The EOF block of this transfer was
+                                           read or written */
+               block_sending : 1;	/* This transfer is an upload */
+#ifdef USE_SSL
+  SSL * data_ssl;		/* SSL on the data connection with PROT P */
+#endif
   int (*auth_tls_start) (gftp_request * request);
+  int (*data_conn_setup) (gftp_request * request);	/* Called once the
+                                                           data connection
+                                                           is open */
   ssize_t (*data_conn_read) (gftp_request * request, void *ptr, size_t size,
                              int fd);
   ssize_t (*data_conn_write) (gftp_request * request, const char *ptr,
@@ -52,6 +52,57 @@ ftps_get_next_file (gftp_request * request, gftp_file * fle, int fd)
 }
 
 
+/* With PROT P each data connection gets its own SSL session */
+
+static ssize_t
+ftps_data_conn_read (gftp_request * request, void *ptr, size_t size, int fd)
+{
+  rfc959_parms * params;
+  int ret;
+
+  params = request->protocol_data;
+  if (params->data_ssl == NULL &&
+      (ret = gftp_ssl_data_session_setup (request, fd, &params->data_ssl)) < 0)
+    return (ret);
+
+  return (gftp_ssl_session_read (request, params->data_ssl, ptr, size));
+}
+
+
+static ssize_t
+ftps_data_conn_write (gftp_request * request, const char *ptr, size_t size,
+                      int fd)
+{
+  rfc959_parms * params;
+  int ret;
+
+  params = request->protocol_data;
+  if (params->data_ssl == NULL &&
+      (ret = gftp_ssl_data_session_setup (request, fd, &params->data_ssl)) < 0)
+    return (ret);
+
+  return (gftp_ssl_session_write (request, params->data_ssl, ptr, size));
+}
+
+
+/* The handshake is done once the server has accepted the transfer command,
+   so that rfc959_get_plain_data_fd() can tell whether kernel TLS is in
+   use */
+
+static int
+ftps_data_conn_setup (gftp_request * request)
+{
+  rfc959_parms * params;
+
+  params = request->protocol_data;
+  if (params->data_ssl != NULL || params->data_conn_read != ftps_data_conn_read)
+    return (0);
+
+  return (gftp_ssl_data_session_setup (request, params->data_connection,
+                                       &params->data_ssl));
+}
+
+
 static int 
 ftps_auth_tls_start (gftp_request * request)
 {
@@ -81,8 +132,8 @@ ftps_auth_tls_start (gftp_request * request)
     return (ret);
   else if (ret == '2')
     {
-      params->data_conn_read = gftp_ssl_read;
-      params->data_conn_write = gftp_ssl_write;
+      params->data_conn_read = ftps_data_conn_read;
+      params->data_conn_write = ftps_data_conn_write;
     }
   else
     {
@@ -143,6 +194,7 @@ ftps_init (gftp_request * request)
   request->init = ftps_init;
   request->connect = ftps_connect;
   params->auth_tls_start = ftps_auth_tls_start;
+  params->data_conn_setup = ftps_data_conn_setup;
   request->get_next_file = ftps_get_next_file;
   request->post_connect = NULL;
   request->url_prefix = g_strdup ("ftps");
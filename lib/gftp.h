@@ -43,6 +43,7 @@
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #ifndef TIOCGWINSZ
 #include <sys/ioctl.h>
 #endif
@@ -110,6 +111,13 @@
 #include <sys/mkdev.h>
 #endif
 
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#else
+/* The BSD sendfile() takes different arguments, only the Linux one is used */
+#undef HAVE_SENDFILE
+#endif
+
 /* We need the major() and minor() macros in the user interface. If they aren't
    defined by the system, we'll just define them here. */
 #ifndef major
@@ -201,6 +209,7 @@
 #define BASE_CONF_DIR		"~/.gftp"
 #define CONFIG_FILE		BASE_CONF_DIR "/gftprc"
 #define BOOKMARKS_FILE		BASE_CONF_DIR "/bookmarks"
+#define TRANSFER_QUEUE_FILE	BASE_CONF_DIR "/transfer_queue"
 #define LOG_FILE		BASE_CONF_DIR "/gftp.log"
 #define MAX_HIST_LEN		10
 #define GFTP_URL_USAGE		"[[protocol://][user[:pass]@]site[:port][/directory]]"
@@ -219,6 +228,17 @@ typedef struct gftp_file_tag gftp_file;
 #define GFTP_TRANS_ACTION_OVERWRITE		1
 #define GFTP_TRANS_ACTION_RESUME		2
 #define GFTP_TRANS_ACTION_SKIP			3
+#define GFTP_TRANS_ACTION_DELETE		4 /* Remove destfile, it is not
+                                                     in the source directory */
+
+#define GFTP_MIN_TRANS_BLKSIZE			4096
+#define GFTP_MAX_TRANS_BLKSIZE			(1024 * 1024)
+
+/* Most idle logins that are kept in the session pool at once */
+#define GFTP_SESSION_POOL_MAX			8
+
+/* Most hosts whose SSL sessions are kept for resuming */
+#define GFTP_SSL_SESSION_CACHE_MAX		16
 
 #define GFTP_SORT_COL_FILE			1
 #define GFTP_SORT_COL_SIZE			2
@@ -240,7 +260,9 @@ struct gftp_file_tag
   int fd;			/* Already open fd for this file */
   /* FIXME - add fd_open function */
 
-  time_t datetime;		/* File date and time */
+  time_t datetime,		/* File date and time */
+         dest_datetime;		/* Date and time of the file on the other
+                                   side if exists_other_side is set */
   off_t size,			/* Size of the file */
         startsize;		/* Size to start the transfer at */
   mode_t st_mode;		/* File attributes */
@@ -259,10 +281,19 @@ struct gftp_file_tag
                retry_transfer : 1, /* Is current file transfer done? */
                exists_other_side : 1, /* The file exists on the other side
                                          during the file transfer */
-               filename_utf8_encoded : 1; /* Is the filename properly UTF8
+               filename_utf8_encoded : 1, /* Is the filename properly UTF8
                                              encoded? */
+               exact_size : 1,	/* The size came from a machine readable
+                                   listing, so 0 really means empty */
+               bulk_transfer : 1; /* Directory that is copied in one piece
+                                     by gftp_bulk_transfer_dir(). The size
+                                     is the size of its whole tree */
 
   char transfer_action;		/* See the GFTP_TRANS_ACTION_* vars above */
+  long journal_index;		/* Position in the transfer journal */
+  unsigned int list_pending : 1; /* Directory whose contents still have to
+                                    be added to the transfer. Only changed
+                                    with the transfer's structmutex held */
   /*@null@*/ void *user_data;
 };
 
@@ -404,9 +435,16 @@ struct gftp_request_tag
 					   we cancel this operation */
                stopable : 1,
                refreshing : 1,
-               use_local_encoding : 1;
+               use_local_encoding : 1,
+               ranged_get : 1;		/* Can get_file() start at any offset
+                                           in the file? */
 
   off_t gotbytes;
+
+  size_t max_trans_blksize;	/* Largest chunk that can be passed to
+                                   get_next_file_chunk() or
+                                   put_next_file_chunk(). 0 if there is no
+                                   limit */
  
   void *protocol_data;
    
@@ -488,6 +526,17 @@ struct gftp_request_tag
   int (*set_config_options)		( gftp_request * request );
   void (*swap_socks)			( gftp_request * dest,
 					  gftp_request * source );
+  pid_t (*exec_command)			( gftp_request * request,
+					  const char *command,
+					  int *fd,
+					  int *errfd );
+  int (*check_connection)		( gftp_request * request,
+					  int probe );
+  int (*prefetch_file)			( gftp_request * request,
+					  const char *filename,
+					  int need_size );
+  int (*prefetch_listings)		( gftp_request * request,
+					  const char *directory );
 
   gftp_config_vars * local_options_vars;
   int num_local_options_vars;
@@ -505,6 +554,16 @@ struct gftp_request_tag
 };
 
 
+typedef struct gftp_bandwidth_bucket_tag
+{
+  double tokens,		/* Bytes that can be sent right now. This is
+                                   negative while transfers are waiting */
+         rate;			/* Bytes per second. 0 if there is no limit */
+  struct timeval lastfill,
+                 rateset;	/* When rate was last asked for */
+} gftp_bandwidth_bucket;
+
+
 typedef struct gftp_transfer_tag
 {
   gftp_request * fromreq,
@@ -518,7 +577,8 @@ typedef struct gftp_transfer_tag
                stalled : 1,
                conn_error_no_timeout : 1,
                next_file : 1,
-               skip_file : 1;
+               skip_file : 1,
+               walking : 1;	/* The walker is still adding files */
 
   struct timeval starttime,
                  lasttime;
@@ -527,7 +587,24 @@ typedef struct gftp_transfer_tag
   
   GList * files,
         * curfle,
-        * updfle;
+        * updfle,
+        * nextfle,		/* Next file that will be handed out to one of
+                                   the worker connections */
+        * workers;		/* The per connection transfers when
+                                   transfer_connections is > 1 */
+
+  struct gftp_transfer_tag * parent; /* Set on a worker connection. All of
+                                        the byte counts are rolled up into
+                                        this transfer */
+
+  struct gftp_transfer_tag * walker; /* Lists the subdirectories over its
+                                        own connections while the files are
+                                        being transferred */
+  GList * walkfle;		/* First file that the walker added that the
+                                   UI has not shown yet */
+  GCond * walkcond;		/* Broadcast with the structmutex held when
+                                   the walker adds files or stops, and when
+                                   a file is done, skipped or cancelled */
 
   long numfiles,
        numdirs,
@@ -547,6 +624,25 @@ typedef struct gftp_transfer_tag
   void * fromwdata,
        * towdata;
 
+  int splice_pipe[2];		/* Used to splice() between two sockets */
+
+  size_t trans_blksize,		/* Current block size. This is adjusted as
+                                   the transfer goes along if
+                                   adaptive_trans_blksize is enabled */
+         min_blksize,
+         max_blksize,
+         prev_blksize,		/* Block size before the last increase. 0
+                                   if the last change was not an increase */
+         tune_bytes;		/* Bytes moved in this tuning interval */
+  long tune_chunks;		/* Chunks moved in this tuning interval */
+  double tune_rate;		/* Bytes/sec from the last tuning interval */
+  struct timeval tunetime;	/* Start of this tuning interval */
+
+  gftp_bandwidth_bucket bandwidth; /* For the maxkbs option */
+
+  long journal_id,		/* 0 if the transfer is not journaled */
+       journal_files;		/* Number of files written to the journal */
+
   GStaticMutex statmutex,
                structmutex;
 
@@ -652,6 +748,25 @@ extern int gftp_configuration_changed;
 
 extern gftp_option_type_var gftp_option_types[];
 
+/* bandwidth.c */
+int gftp_bandwidth_limit 		( gftp_transfer * tdata,
+					  ssize_t num_bytes );
+
+/* bulk-transfer.c */
+int gftp_bulk_supported 		( gftp_request * fromreq,
+					  gftp_request * toreq );
+
+void gftp_bulk_get_tree_sizes 		( gftp_request * request,
+					  GList * files );
+
+int gftp_bulk_remove_tree 		( gftp_request * request,
+					  const char *path );
+
+int gftp_bulk_transfer_dir 		( gftp_transfer * tdata,
+					  gftp_file * curfle,
+					  void (*update_func) 
+						( gftp_transfer * tdata ) );
+
 /* cache.c */
 void gftp_generate_cache_description 	( gftp_request * request, 
 					  /*@out@*/ char *description,
@@ -869,6 +984,11 @@ int rfc959_get_next_file 		( gftp_request * request,
 
 int rfc959_connect 			( gftp_request * request );
 
+unsigned int rfc959_is_ascii_transfer 	( gftp_request * request,
+					  const char *filename );
+
+int rfc959_get_plain_data_fd 		( gftp_request * request );
+
 int ftps_init 				( gftp_request * request );
 
 void ftps_register_module		( void );
@@ -938,6 +1058,11 @@ ssize_t gftp_put_next_file_chunk 	( gftp_request * request,
 					  char *buf, 
 					  size_t size );
 
+int gftp_can_splice_transfer 		( gftp_transfer * tdata );
+
+ssize_t gftp_splice_file_chunk 		( gftp_transfer * tdata,
+					  size_t size );
+
 int gftp_list_files 			( gftp_request * request );
 
 int gftp_parse_bookmark 		( gftp_request * request, 
@@ -985,6 +1110,10 @@ int gftp_remove_directory 		( gftp_request * request,
 int gftp_remove_file 			( gftp_request * request, 
 					  const char *file );
 
+int gftp_remove_tree 			( gftp_request * request,
+					  const char *path,
+					  mode_t st_mode );
+
 int gftp_make_directory 		( gftp_request * request, 
 					  const char *directory );
 
@@ -1007,6 +1136,13 @@ int gftp_site_cmd 			( gftp_request * request,
 off_t gftp_get_file_size 		( gftp_request * request, 
 					  const char *filename );
 
+int gftp_prefetch_file 		( gftp_request * request, 
+					  const char *filename,
+					  int need_size );
+
+int gftp_prefetch_listings 		( gftp_request * request, 
+					  const char *directory );
+
 void gftp_calc_kbs 			( gftp_transfer * tdata, 
 				 	  ssize_t num_read );
 
@@ -1014,6 +1150,8 @@ int gftp_get_all_subdirs 		( gftp_transfer * transfer,
 					  void (*update_func) 
 						( gftp_transfer * transfer ));
 
+int gftp_walk_subdirs 			( gftp_transfer * walker );
+
 int gftp_set_config_options 		( gftp_request * request );
 
 void print_file_list 			( GList * list );
@@ -1024,6 +1162,11 @@ void gftp_swap_socks 			( gftp_request * dest,
 void gftp_calc_kbs 			( gftp_transfer * tdata, 
 					  ssize_t num_read );
 
+size_t gftp_get_trans_blksize 		( gftp_transfer * tdata );
+
+void gftp_tune_trans_blksize 		( gftp_transfer * tdata,
+					  ssize_t num_trans );
+
 int gftp_get_transfer_status 		( gftp_transfer * tdata, 
 					  ssize_t num_read );
 
@@ -1056,8 +1199,24 @@ int gftp_ssl_startup 			( gftp_request * request );
 
 int gftp_ssl_session_setup 		( gftp_request * request );
 
+int gftp_ssl_data_session_setup 	( gftp_request * request,
+					  int fd,
+					  SSL ** ssl );
+
 void gftp_ssl_free 			( gftp_request * request );
 
+int gftp_ssl_get_ktls_send_fd 		( SSL * ssl );
+
+ssize_t gftp_ssl_session_read 		( gftp_request * request,
+					  SSL * ssl,
+					  void *ptr,
+					  size_t size );
+
+ssize_t gftp_ssl_session_write 		( gftp_request * request,
+					  SSL * ssl,
+					  const char *ptr,
+					  size_t size );
+
 ssize_t gftp_ssl_read 			( gftp_request * request, 
 					  void *ptr, 
 					  size_t size, 
@@ -1083,6 +1242,13 @@ void gftpui_protocol_update_timeout 	( gftp_request * request );
 
 #endif
 
+/* session-pool.c */
+void gftp_session_pool_expire 		( void );
+
+void gftp_session_pool_checkin 		( gftp_request * request );
+
+int gftp_session_pool_checkout 		( gftp_request * request );
+
 /* socket-connect.c */
 int gftp_connect_server 		( gftp_request * request, 
 					  char *service,
@@ -1131,6 +1297,17 @@ ssize_t gftp_fd_write 			( gftp_request * request,
 					  size_t size, 
 					  int fd );
 
+ssize_t gftp_fd_writev 			( gftp_request * request, 
+					  struct iovec * iov,
+					  int iovcnt,
+					  int fd );
+
+ssize_t gftp_fd_splice 			( gftp_request * request, 
+					  int fromfd,
+					  int tofd,
+					  int *pipefds,
+					  size_t size );
+
 ssize_t gftp_writefmt 			( gftp_request * request, 
 					  int fd, 
 					  const char *fmt, 
@@ -1145,3 +1322,21 @@ struct servent * r_getservbyname	( const char *name,
 					  struct servent *result_buf,
 					  int *h_errnop );
 
+/* transfer-journal.c */
+void gftp_journal_add_files 		( gftp_transfer * tdata,
+					  GList * files );
+
+void gftp_journal_file_progress 	( gftp_transfer * tdata,
+					  gftp_file * fle,
+					  off_t offset );
+
+void gftp_journal_file_done 		( gftp_transfer * tdata,
+					  gftp_file * fle );
+
+void gftp_journal_dir_listed 		( gftp_transfer * tdata,
+					  gftp_file * fle );
+
+void gftp_journal_remove_transfer 	( gftp_transfer * tdata );
+
+GList * gftp_journal_load 		( gftp_logging_func logging_function );
+
@@ -19,22 +19,56 @@
 
 /* $Id$ */
 
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+
 typedef struct rfc2068_params_tag
 {
-  gftp_getline_buffer * rbuf;
+  gftp_getline_buffer * rbuf,
+                      * next_rbuf;	/* What was read past the end of the
+					   last response */
+  GList * pipeline;			/* The requests that were sent ahead,
+					   oldest first */
   unsigned long read_bytes;
   off_t chunk_size,
         content_length;
   unsigned int chunked_transfer : 1,
-               eof : 1;
+               eof : 1,
+               keep_alive : 1,		/* The server will take another request
+					   on this connection */
+               response_pending : 1,	/* The body of the last response has
+					   not been read to the end yet */
+               encoding_accepted : 1,	/* The request sent Accept-Encoding */
+               content_encoded : 1,	/* The body is compressed with gzip
+					   or deflate */
+               no_webdav : 1,		/* The server does not answer PROPFIND */
+               no_depth_infinity : 1,	/* ...with Depth: infinity */
+               dav_listing : 1;		/* The listing is in dav_entries */
   ssize_t (*real_read_function) ( gftp_request * request,
                                   void *ptr,
                                   size_t size,
                                   int fd );
   int read_ref_cnt;
 
+  GList * dav_entries;			/* The lines of the WebDAV listing that
+					   have not been returned yet */
+  GHashTable * dav_tree;		/* Directory -> lines, from the last
+					   Depth: infinity PROPFIND */
+  time_t dav_tree_time;
+
   char * extra_read_buffer;
   size_t extra_read_buffer_len;
+
+#ifdef USE_ZLIB
+  z_stream zstream;
+  char * zbuf;				/* Compressed bytes for inflate() */
+  size_t zbuf_size;
+  off_t encoded_bytes,			/* What the body took on the wire */
+        decoded_bytes;			/* ...and what it decompressed to */
+  unsigned int inflating : 1,
+               inflate_eof : 1;
+#endif
 } rfc2068_params;
 
 int rfc2068_get_next_file 			( gftp_request * request,
@@ -687,6 +687,30 @@ local_set_file_time (gftp_request * request, const char *file,
 }
 
 
+static pid_t
+local_exec_command (gftp_request * request, const char *command, int *fd,
+                    int *errfd)
+{
+  char *args[4];
+  pid_t child;
+
+  g_return_val_if_fail (request != NULL, GFTP_EFATAL);
+  g_return_val_if_fail (request->protonum == GFTP_LOCAL_NUM, GFTP_EFATAL);
+  g_return_val_if_fail (command != NULL, GFTP_EFATAL);
+
+  args[0] = "/bin/sh";
+  args[1] = "-c";
+  args[2] = (char *) command;
+  args[3] = NULL;
+
+  child = gftp_exec (request, fd, errfd, args);
+  if (child < 0)
+    return (GFTP_ERETRYABLE);
+
+  return (child);
+}
+
+
 void 
 local_register_module (void)
 {
@@ -732,6 +756,10 @@ local_init (gftp_request * request)
   request->parse_url = NULL;
   request->set_config_options = NULL;
   request->swap_socks = NULL;
+  request->exec_command = local_exec_command;
+  request->check_connection = NULL;
+  request->prefetch_file = NULL;
+  request->prefetch_listings = NULL;
   request->url_prefix = "file";
   request->need_hostport = 0;
   request->need_username = 0;
@@ -559,6 +559,8 @@ gftp_tdata_new (void)
   g_static_mutex_init (&tdata->structmutex);
 #endif
 
+  tdata->splice_pipe[0] = tdata->splice_pipe[1] = -1;
+
   return (tdata);
 }
 
@@ -566,6 +568,8 @@ gftp_tdata_new (void)
 void
 free_tdata (gftp_transfer * tdata)
 {
+  if (tdata->journal_id != 0)
+    gftp_journal_remove_transfer (tdata);
   if (tdata->fromreq != NULL)
     gftp_request_destroy (tdata->fromreq, 1);
   if (tdata->toreq != NULL)
@@ -573,6 +577,11 @@ free_tdata (gftp_transfer * tdata)
   free_file_list (tdata->files);
   if (tdata->thread_id != NULL)
     g_free (tdata->thread_id);
+  if (tdata->splice_pipe[0] >= 0)
+    {
+      close (tdata->splice_pipe[0]);
+      close (tdata->splice_pipe[1]);
+    }
   g_free (tdata);
 }
 
@@ -1256,15 +1265,21 @@ gftp_descramble_password (const char *password)
 int
 gftp_get_transfer_action (gftp_request * request, gftp_file * fle)
 {
-  intptr_t overwrite_default;
+  intptr_t overwrite_default, mirror_transfers;
 
   gftp_lookup_request_option (request, "overwrite_default", &overwrite_default);
+  gftp_lookup_request_option (request, "mirror_transfers", &mirror_transfers);
 
-  /* FIXME - add code to compare the file times and make a decision based
-     on that. Also if overwrite_default is enabled and the file sizes/dates are
-     the same, then skip the file */
-
-  if (overwrite_default)
+  /* When mirroring, a file is unchanged if it has the same size and the copy
+     on the other side is not older than it. Anything else is sent again */
+  if (mirror_transfers)
+    {
+      if (fle->startsize == fle->size && fle->dest_datetime >= fle->datetime)
+        fle->transfer_action = GFTP_TRANS_ACTION_SKIP;
+      else
+        fle->transfer_action = GFTP_TRANS_ACTION_OVERWRITE;
+    }
+  else if (overwrite_default)
     fle->transfer_action = GFTP_TRANS_ACTION_OVERWRITE;
   else if (fle->startsize == fle->size)
     fle->transfer_action = GFTP_TRANS_ACTION_SKIP;
@@ -34,6 +34,8 @@ static gftp_sort_direction_tag gftp_sort_direction[] = { N_("descending"),
                                                          NULL };
 
 static float gftp_maxkbs = 0.0;
+static float gftp_host_maxkbs = 0.0;
+static float gftp_global_maxkbs = 0.0;
 
 gftp_config_vars gftp_global_config_vars[] =
 {
@@ -74,6 +76,16 @@ gftp_config_vars gftp_global_config_vars[] =
    GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
    N_("Overwrite files by default or set to resume file transfers"), 
    GFTP_PORT_GTK, NULL},
+  {"mirror_transfers", N_("Only transfer new and changed files"),
+   gftp_option_type_checkbox, GINT_TO_POINTER(0), NULL,
+   GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
+   N_("Skip the files that are already on the other side with the same size and a time that is not older. Every other file is overwritten without asking."),
+   GFTP_PORT_ALL, NULL},
+  {"mirror_delete", N_("Delete files that are not in the source"),
+   gftp_option_type_checkbox, GINT_TO_POINTER(0), NULL,
+   GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
+   N_("When only transferring new and changed files, remove the files inside of the transferred directories that are not in the source directory"),
+   GFTP_PORT_ALL, NULL},
   {"preserve_permissions", N_("Preserve file permissions"), 
    gftp_option_type_checkbox, GINT_TO_POINTER(1), NULL, 
    GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
@@ -138,11 +150,49 @@ gftp_config_vars gftp_global_config_vars[] =
    GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
    N_("The maximum KB/s a file transfer can get. (Set to 0 to disable)"),  
    GFTP_PORT_ALL, NULL},
+  {"host_maxkbs", N_("Max KB/S per host:"),
+   gftp_option_type_float, &gftp_host_maxkbs, NULL,
+   GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
+   N_("The maximum KB/s that all of the file transfers to or from the same host can get together. (Set to 0 to disable)"),
+   GFTP_PORT_ALL, NULL},
+  {"global_maxkbs", N_("Max KB/S for all transfers:"),
+   gftp_option_type_float, &gftp_global_maxkbs, NULL, 0,
+   N_("The maximum KB/s that all of the file transfers together can get. (Set to 0 to disable)"),
+   GFTP_PORT_ALL, NULL},
   {"trans_blksize", N_("Transfer Block Size:"), 
    gftp_option_type_int, GINT_TO_POINTER(20480), NULL, 
    GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
    N_("The block size that is used when transfering files. This should be a multiple of 1024."),  
    GFTP_PORT_ALL, NULL},
+  {"adaptive_trans_blksize", N_("Adapt the transfer block size"),
+   gftp_option_type_checkbox, GINT_TO_POINTER(0), NULL,
+   GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
+   N_("Grow or shrink the transfer block size during a transfer depending on how fast the connection is. The transfer block size is used as the starting point."),
+   GFTP_PORT_ALL, NULL},
+  {"transfer_connections", N_("Connections per transfer:"),
+   gftp_option_type_int, GINT_TO_POINTER(1), NULL,
+   GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
+   N_("The number of connections that are opened to the server for each file transfer. The files in the transfer are split between these connections."),
+   GFTP_PORT_ALL, NULL},
+  {"transfer_segments", N_("Segments per download:"),
+   gftp_option_type_int, GINT_TO_POINTER(1), NULL,
+   GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
+   N_("Large files that are downloaded to the local computer are split into this many pieces. Each piece is downloaded over its own connection."),
+   GFTP_PORT_ALL, NULL},
+  {"stream_subdirs", N_("Start transfers before all subdirectories are read"),
+   gftp_option_type_checkbox, GINT_TO_POINTER(0), NULL,
+   GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
+   N_("Start transferring the files right away and read the contents of the subdirectories over another connection while the transfer is going. You are not asked what to do with the files in those subdirectories that already exist on the other side"),
+   GFTP_PORT_ALL, NULL},
+  {"journal_transfers", N_("Save the transfer queue"),
+   gftp_option_type_checkbox, GINT_TO_POINTER(1), NULL, 0,
+   N_("Keep a journal of the file transfers so that the ones that did not finish are started again where they left off the next time gFTP is started"),
+   GFTP_PORT_ALL, NULL},
+  {"session_pool_timeout", N_("Keep idle logins for (secs):"),
+   gftp_option_type_int, GINT_TO_POINTER(60), NULL,
+   GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
+   N_("When a transfer or a directory listing is done with an FTP login, it is kept open for this many seconds so that the next one to the same server does not have to log in again. Set this to 0 to disable"),
+   GFTP_PORT_ALL, NULL},
 
   {"default_protocol", N_("Default Protocol:"),
    gftp_option_type_textcombo, "FTP", NULL, 0,
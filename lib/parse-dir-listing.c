@@ -579,6 +579,154 @@ gftp_parse_ls_novell (char *str, gftp_file * fle)
 }
 
 
+static time_t
+parse_mlsx_time (char *str)
+{
+  int year, month, day, hour, min, sec;
+  long days;
+
+  /* YYYYMMDDHHMMSS[.sss], always in UTC */
+  if (sscanf (str, "%4d%2d%2d%2d%2d%2d", &year, &month, &day, &hour, &min,
+              &sec) != 6 || month < 1 || month > 12)
+    return (0);
+
+  /* Count the months from March so that the leap day is at the end of
+     the year */
+  if (month > 2)
+    month -= 3;
+  else
+    {
+      month += 9;
+      year--;
+    }
+
+  days = 365L * year + year / 4 - year / 100 + year / 400 +
+         (153 * month + 2) / 5 + day - 1 - 719468;
+
+  return ((time_t) days * 86400 + hour * 3600 + min * 60 + sec);
+}
+
+
+static int
+gftp_is_mlsx_line (char *str)
+{
+  char *endpos;
+
+  /* The facts are all in the first token and each one ends with a ; */
+  if ((endpos = strchr (str, ' ')) == NULL || endpos == str ||
+      *(endpos - 1) != ';')
+    return (0);
+
+  return (memchr (str, '=', endpos - str) != NULL);
+}
+
+
+static int
+gftp_parse_ls_mlsx (char *str, gftp_file * fle)
+{
+  char *fact, *value, *endpos, *perm;
+  mode_t type, mode;
+  int have_mode;
+
+  /* type=file;size=2048;modify=20080124233126;UNIX.mode=0644; README */
+  /* type=dir;modify=20071118013405;perm=flcdmpe; pub */
+
+  if ((endpos = strchr (str, ' ')) == NULL)
+    return (GFTP_EFATAL);
+
+  *endpos = '\0';
+  fle->file = g_strdup (endpos + 1);
+
+  type = 0;
+  mode = 0;
+  have_mode = 0;
+  perm = NULL;
+
+  for (fact = str; fact != NULL && *fact != '\0'; fact = endpos)
+    {
+      if ((endpos = strchr (fact, ';')) != NULL)
+        *endpos++ = '\0';
+
+      if ((value = strchr (fact, '=')) == NULL)
+        continue;
+      *value++ = '\0';
+
+      if (strcasecmp (fact, "type") == 0)
+        {
+          if (strcasecmp (value, "dir") == 0)
+            type = S_IFDIR;
+          else if (strcasecmp (value, "cdir") == 0)
+            {
+              /* The callers already know how to skip these */
+              g_free (fle->file);
+              fle->file = g_strdup (".");
+              type = S_IFDIR;
+            }
+          else if (strcasecmp (value, "pdir") == 0)
+            {
+              g_free (fle->file);
+              fle->file = g_strdup ("..");
+              type = S_IFDIR;
+            }
+          else if (strncasecmp (value, "OS.unix=slink", 13) == 0 ||
+                   strncasecmp (value, "OS.unix=symlink", 15) == 0)
+            type = S_IFLNK;
+        }
+      else if (strcasecmp (fact, "size") == 0 ||
+               strcasecmp (fact, "sizd") == 0)
+        {
+          fle->size = gftp_parse_file_size (value);
+          fle->exact_size = 1;
+        }
+      else if (strcasecmp (fact, "modify") == 0)
+        fle->datetime = parse_mlsx_time (value);
+      else if (strcasecmp (fact, "UNIX.mode") == 0)
+        {
+          mode = strtol (value, NULL, 8) & 07777;
+          have_mode = 1;
+        }
+      else if (strcasecmp (fact, "perm") == 0)
+        perm = value;
+      else if (strcasecmp (fact, "UNIX.ownername") == 0 ||
+               (strcasecmp (fact, "UNIX.owner") == 0 && fle->user == NULL))
+        {
+          if (fle->user != NULL)
+            g_free (fle->user);
+          fle->user = g_strdup (value);
+        }
+      else if (strcasecmp (fact, "UNIX.groupname") == 0 ||
+               (strcasecmp (fact, "UNIX.group") == 0 && fle->group == NULL))
+        {
+          if (fle->group != NULL)
+            g_free (fle->group);
+          fle->group = g_strdup (value);
+        }
+    }
+
+  if (!have_mode)
+    {
+      /* Make up some permissions from what the server lets us do */
+      if (S_ISDIR (type))
+        mode = S_IRUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+      else
+        mode = S_IRUSR | S_IRGRP | S_IROTH;
+
+      if (perm == NULL ||
+          strpbrk (perm, S_ISDIR (type) ? "cmp" : "aw") != NULL)
+        mode |= S_IWUSR;
+    }
+
+  fle->st_mode = type | mode;
+
+  if (fle->user == NULL)
+    fle->user = g_strdup (_("unknown"));
+  if (fle->group == NULL)
+    fle->group = g_strdup (_("unknown"));
+
+  return (0);
+}
+
+
 int
 gftp_parse_ls (gftp_request * request, const char *lsoutput, gftp_file * fle,
                int fd)
@@ -599,6 +747,14 @@ gftp_parse_ls (gftp_request * request, const char *lsoutput, gftp_file * fle,
   if (len > 0 && str[len - 1] == '\r')
     str[--len] = '\0';
 
+  /* MLSD and MLST listings look the same no matter what the server runs */
+  if (gftp_is_mlsx_line (str))
+    {
+      result = gftp_parse_ls_mlsx (str, fle);
+      g_free (str);
+      return (result);
+    }
+
   switch (request->server_type)
     {
       case GFTP_DIRTYPE_CRAY:
@@ -39,6 +39,9 @@ gftp_request_destroy (gftp_request * request, int free_request)
 {
   g_return_if_fail (request != NULL);
 
+  /* A login that is still good is kept for the next request to the same
+     server instead of being closed */
+  gftp_session_pool_checkin (request);
   gftp_disconnect (request);
 
   if (request->destroy != NULL)
@@ -136,7 +139,10 @@ gftp_connect (gftp_request * request)
   if ((ret = gftp_set_config_options (request)) < 0)
     return (ret);
 
-  ret=request->connect (request);
+  if (request->datafd < 0 && gftp_session_pool_checkout (request) > 0)
+    ret = 0;
+  else
+    ret=request->connect (request);
   if(ret==0 && request->directory && request->directory[0] && request->homedir == NULL)
       request->homedir=g_strdup(request->directory);
 
@@ -150,11 +156,7 @@ gftp_disconnect (gftp_request * request)
   g_return_if_fail (request != NULL);
 
 #ifdef USE_SSL
-  if (request->ssl != NULL)
-    {
-      SSL_free (request->ssl);
-      request->ssl = NULL;
-    }
+  gftp_ssl_free (request);
 #endif
 
 #if GLIB_MAJOR_VERSION > 1
@@ -312,6 +314,80 @@ gftp_put_next_file_chunk (gftp_request * request, char *buf, size_t size)
 }
 
 
+static int
+_gftp_get_splice_fd (gftp_request * request)
+{
+  if (request->protonum == GFTP_LOCAL_NUM)
+    return (request->datafd);
+  else if (request->protonum == GFTP_FTP_NUM ||
+           request->protonum == GFTP_FTPS_NUM)
+    return (rfc959_get_plain_data_fd (request));
+  else
+    return (-1);
+}
+
+
+/* Checks whether the file that is currently open in tdata can be moved with
+   gftp_splice_file_chunk() instead of being read into a buffer */
+
+int
+gftp_can_splice_transfer (gftp_transfer * tdata)
+{
+#if defined (HAVE_SENDFILE) || defined (HAVE_SPLICE)
+  int fromfd, tofd, flags;
+
+  g_return_val_if_fail (tdata != NULL, 0);
+
+  if ((fromfd = _gftp_get_splice_fd (tdata->fromreq)) < 0 ||
+      (tofd = _gftp_get_splice_fd (tdata->toreq)) < 0)
+    return (0);
+
+  /* Neither sendfile() nor splice() will write to an O_APPEND file */
+  if ((flags = fcntl (tofd, F_GETFL)) == -1 || (flags & O_APPEND))
+    return (0);
+
+#ifndef HAVE_SENDFILE
+  if (tdata->fromreq->protonum == GFTP_LOCAL_NUM)
+    return (0);
+#endif
+
+#ifndef HAVE_SPLICE
+  if (tdata->fromreq->protonum != GFTP_LOCAL_NUM)
+    return (0);
+#endif
+
+  return (1);
+#else
+  return (0);
+#endif
+}
+
+
+ssize_t
+gftp_splice_file_chunk (gftp_transfer * tdata, size_t size)
+{
+  int fromfd, tofd;
+
+  g_return_val_if_fail (tdata != NULL, GFTP_EFATAL);
+
+  if ((fromfd = _gftp_get_splice_fd (tdata->fromreq)) < 0 ||
+      (tofd = _gftp_get_splice_fd (tdata->toreq)) < 0)
+    return (GFTP_ENOTRANS);
+
+  if (tdata->fromreq->protonum == GFTP_LOCAL_NUM)
+    return (gftp_fd_splice (tdata->toreq, fromfd, tofd, NULL, size));
+
+  if (tdata->splice_pipe[0] < 0 && pipe (tdata->splice_pipe) == -1)
+    {
+      tdata->splice_pipe[0] = tdata->splice_pipe[1] = -1;
+      return (GFTP_ENOTRANS);
+    }
+
+  return (gftp_fd_splice (tdata->fromreq, fromfd, tofd, tdata->splice_pipe,
+                          size));
+}
+
+
 int
 gftp_end_transfer (gftp_request * request)
 {
@@ -877,6 +953,77 @@ gftp_remove_file (gftp_request * request, const char *file)
 }
 
 
+/* Removes a file, or a directory along with everything inside of it */
+
+int
+gftp_remove_tree (gftp_request * request, const char *path, mode_t st_mode)
+{
+  GList * files, * templist;
+  char *olddir, *newpath;
+  gftp_file * fle;
+  int ret;
+
+  g_return_val_if_fail (request != NULL, GFTP_EFATAL);
+  g_return_val_if_fail (path != NULL, GFTP_EFATAL);
+
+  if (!S_ISDIR (st_mode))
+    return (gftp_remove_file (request, path));
+  else if (gftp_bulk_supported (request, NULL))
+    return (gftp_bulk_remove_tree (request, path));
+
+  olddir = request->directory != NULL ? g_strdup (request->directory) : NULL;
+
+  files = NULL;
+  if ((ret = gftp_set_directory (request, path)) == 0 &&
+      (ret = gftp_list_files (request)) == 0)
+    {
+      fle = g_malloc0 (sizeof (*fle));
+      while (gftp_get_next_file (request, NULL, fle) > 0)
+        {
+          if (strcmp (fle->file, ".") == 0 || strcmp (fle->file, "..") == 0)
+            {
+              gftp_file_destroy (fle, 0);
+              continue;
+            }
+
+          files = g_list_prepend (files, fle);
+          fle = g_malloc0 (sizeof (*fle));
+        }
+      gftp_end_transfer (request);
+      gftp_file_destroy (fle, 1);
+
+      /* The listing is about to be out of date */
+      if (request->use_cache)
+        gftp_delete_cache_entry (request, NULL, 0);
+    }
+
+  for (templist = files; templist != NULL; templist = templist->next)
+    {
+      fle = templist->data;
+      newpath = gftp_build_path (request, path, fle->file, NULL);
+      ret = gftp_remove_tree (request, newpath, fle->st_mode);
+      g_free (newpath);
+
+      if (ret == GFTP_EFATAL || !GFTP_IS_CONNECTED (request))
+        break;
+    }
+
+  free_file_list (files);
+
+  if (olddir != NULL)
+    {
+      if (GFTP_IS_CONNECTED (request))
+        gftp_set_directory (request, olddir);
+      g_free (olddir);
+    }
+
+  if (ret >= 0 && GFTP_IS_CONNECTED (request))
+    ret = gftp_remove_directory (request, path);
+
+  return (ret);
+}
+
+
 int
 gftp_make_directory (gftp_request * request, const char *directory)
 {
@@ -948,12 +1095,58 @@ gftp_get_file_size (gftp_request * request, const char *filename)
 }
 
 
+/* Lets the protocol ask the server for a file before get_file() is called for
+   it. The files have to be passed in the same order that get_file() will be
+   called for them, starting with the next one. need_size is set if
+   get_file_size() will be called for the file first. Returns 1 if the
+   protocol has asked for the file and 0 if the caller should pass it again
+   later. */
+
+int
+gftp_prefetch_file (gftp_request * request, const char *filename,
+                    int need_size)
+{
+  g_return_val_if_fail (request != NULL, GFTP_EFATAL);
+  g_return_val_if_fail (filename != NULL, GFTP_EFATAL);
+
+  if (request->prefetch_file == NULL)
+    return (0);
+  return (request->prefetch_file (request, filename, need_size));
+}
+
+
+/* Lets the protocol read the listings of directory and of all of the
+   directories under it in one go, before gftp_list_files() is called for
+   each of them. This is only a hint, the directories still have to be
+   listed with gftp_list_files() afterwards. */
+
+int
+gftp_prefetch_listings (gftp_request * request, const char *directory)
+{
+  g_return_val_if_fail (request != NULL, GFTP_EFATAL);
+  g_return_val_if_fail (directory != NULL, GFTP_EFATAL);
+
+  if (request->prefetch_listings == NULL)
+    return (0);
+  return (request->prefetch_listings (request, directory));
+}
+
+
+typedef struct gftp_dir_hash_entry_tag
+{
+  off_t size;
+  time_t datetime;
+  mode_t st_mode;
+  unsigned int seen : 1;	/* The file is also in the source directory */
+} gftp_dir_hash_entry;
+
+
 static GHashTable *
 gftp_gen_dir_hash (gftp_request * request, int *ret)
 {
+  gftp_dir_hash_entry * entry;
   GHashTable * dirhash;
   gftp_file * fle;
-  off_t *newsize;
 
   dirhash = g_hash_table_new (string_hash_function, string_hash_compare);
   *ret = gftp_list_files (request);
@@ -962,9 +1155,17 @@ gftp_gen_dir_hash (gftp_request * request, int *ret)
       fle = g_malloc0 (sizeof (*fle));
       while (gftp_get_next_file (request, NULL, fle) > 0)
         {
-          newsize = g_malloc0 (sizeof (*newsize));
-          *newsize = fle->size;
-          g_hash_table_insert (dirhash, fle->file, newsize);
+          if (strcmp (fle->file, ".") == 0 || strcmp (fle->file, "..") == 0)
+            {
+              gftp_file_destroy (fle, 0);
+              continue;
+            }
+
+          entry = g_malloc0 (sizeof (*entry));
+          entry->size = fle->size;
+          entry->datetime = fle->datetime;
+          entry->st_mode = fle->st_mode;
+          g_hash_table_insert (dirhash, fle->file, entry);
           fle->file = NULL;
           gftp_file_destroy (fle, 0);
         }
@@ -1001,14 +1202,113 @@ gftp_destroy_dir_hash (GHashTable * dirhash)
 }
 
 
+/* Compares a file against the file with the same name on the other side.
+   With mirror_transfers enabled, this already decides whether the file
+   needs to be sent */
+
+static void
+_gftp_lookup_other_side (gftp_transfer * transfer, GHashTable * dirhash,
+                         gftp_file * fle, const char *name)
+{
+  gftp_dir_hash_entry * entry;
+  intptr_t mirror_transfers;
+
+  if (dirhash == NULL ||
+      (entry = g_hash_table_lookup (dirhash, name)) == NULL)
+    {
+      fle->exists_other_side = 0;
+      return;
+    }
+
+  fle->exists_other_side = 1;
+  fle->startsize = entry->size;
+  fle->dest_datetime = entry->datetime;
+  entry->seen = 1;
+
+  gftp_lookup_request_option (transfer->fromreq, "mirror_transfers",
+                              &mirror_transfers);
+  if (mirror_transfers && !S_ISDIR (fle->st_mode))
+    gftp_get_transfer_action (transfer->fromreq, fle);
+}
+
+
+typedef struct gftp_extraneous_data_tag
+{
+  gftp_transfer * transfer;
+  GList * files;
+  int skip_hidden;		/* The source listing leaves out dotfiles */
+} gftp_extraneous_data;
+
+
+static void
+_gftp_add_extraneous_file (gpointer key, gpointer value, gpointer user_data)
+{
+  gftp_extraneous_data * edata;
+  gftp_dir_hash_entry * entry;
+  gftp_transfer * transfer;
+  gftp_file * fle;
+
+  entry = value;
+  edata = user_data;
+  if (entry->seen || (edata->skip_hidden && *(char *) key == '.'))
+    return;
+
+  transfer = edata->transfer;
+
+  fle = g_malloc0 (sizeof (*fle));
+  fle->destfile = gftp_build_path (transfer->toreq, transfer->toreq->directory,
+                                   key, NULL);
+  fle->file = g_strdup (fle->destfile);
+  fle->st_mode = entry->st_mode;
+  fle->datetime = entry->datetime;
+  fle->transfer_action = GFTP_TRANS_ACTION_DELETE;
+  edata->files = g_list_prepend (edata->files, fle);
+}
+
+
+/* With mirror_delete enabled, the files in the destination directory that
+   are not in the source directory are added to the end of files so that
+   the transfer removes them. This must only be called once the whole
+   source listing has been read. Dotfiles are kept when the source listing
+   does not show them. */
+
+static GList *
+_gftp_add_extraneous_files (gftp_transfer * transfer, GHashTable * dirhash,
+                            GList * files)
+{
+  intptr_t mirror_transfers, mirror_delete, show_hidden_files;
+  gftp_extraneous_data edata;
+
+  if (dirhash == NULL)
+    return (files);
+
+  gftp_lookup_request_option (transfer->fromreq, "mirror_transfers",
+                              &mirror_transfers);
+  gftp_lookup_request_option (transfer->fromreq, "mirror_delete",
+                              &mirror_delete);
+  if (!mirror_transfers || !mirror_delete)
+    return (files);
+
+  gftp_lookup_request_option (transfer->fromreq, "show_hidden_files",
+                              &show_hidden_files);
+
+  edata.transfer = transfer;
+  edata.files = NULL;
+  edata.skip_hidden = !show_hidden_files;
+  g_hash_table_foreach (dirhash, _gftp_add_extraneous_file, &edata);
+
+  return (g_list_concat (files, edata.files));
+}
+
+
 static GList *
 gftp_get_dir_listing (gftp_transfer * transfer, int getothdir, int *ret)
 {
   GHashTable * dirhash;
   GList * templist;
   gftp_file * fle;
-  off_t *newsize;
   char *newname;
+  int end_ret;
 
   if (getothdir && transfer->toreq != NULL)
     {
@@ -1028,7 +1328,7 @@ gftp_get_dir_listing (gftp_transfer * transfer, int getothdir, int *ret)
 
   fle = g_malloc0 (sizeof (*fle));
   templist = NULL;
-  while (gftp_get_next_file (transfer->fromreq, NULL, fle) > 0)
+  while ((*ret = gftp_get_next_file (transfer->fromreq, NULL, fle)) > 0)
     {
       if (strcmp (fle->file, ".") == 0 || strcmp (fle->file, "..") == 0)
         {
@@ -1036,14 +1336,7 @@ gftp_get_dir_listing (gftp_transfer * transfer, int getothdir, int *ret)
           continue;
         }
 
-      if (dirhash && 
-          (newsize = g_hash_table_lookup (dirhash, fle->file)) != NULL)
-        {
-          fle->exists_other_side = 1;
-          fle->startsize = *newsize;
-        }
-      else
-        fle->exists_other_side = 0;
+      _gftp_lookup_other_side (transfer, dirhash, fle, fle->file);
 
       if (transfer->toreq && fle->destfile == NULL)
         fle->destfile = gftp_build_path (transfer->toreq,
@@ -1066,9 +1359,27 @@ gftp_get_dir_listing (gftp_transfer * transfer, int getothdir, int *ret)
 
       fle = g_malloc0 (sizeof (*fle));
     }
-  gftp_end_transfer (transfer->fromreq);
+  end_ret = gftp_end_transfer (transfer->fromreq);
 
   gftp_file_destroy (fle, 1);
+
+  /* A listing that was cut short would make every file after the break
+     look like it is only on the destination side */
+  if (*ret == 0 && end_ret < 0)
+    *ret = end_ret;
+
+  if (*ret < 0)
+    {
+      transfer->fromreq->logging_function (gftp_logging_error,
+                     transfer->fromreq,
+                     _("Error: The listing of %s did not complete\n"),
+                     transfer->fromreq->directory);
+      free_file_list (templist);
+      gftp_destroy_dir_hash (dirhash);
+      return (NULL);
+    }
+
+  templist = _gftp_add_extraneous_files (transfer, dirhash, templist);
   gftp_destroy_dir_hash (dirhash);
 
   return (templist);
@@ -1101,7 +1412,6 @@ _setup_current_directory_transfer (gftp_transfer * transfer, int *ret)
   char *pos, *newname;
   gftp_file * curfle;
   GList * lastlist;
-  off_t *newsize;
 
   *ret = 0;
   if (transfer->toreq != NULL)
@@ -1122,15 +1432,6 @@ _setup_current_directory_transfer (gftp_transfer * transfer, int *ret)
       else
         pos = curfle->file;
 
-      if (dirhash != NULL && 
-          (newsize = g_hash_table_lookup (dirhash, pos)) != NULL)
-        {
-          curfle->exists_other_side = 1;
-          curfle->startsize = *newsize;
-        }
-      else
-        curfle->exists_other_side = 0;
-
       if (curfle->size < 0 && GFTP_IS_CONNECTED (transfer->fromreq))
         {
           curfle->size = gftp_get_file_size (transfer->fromreq, curfle->file);
@@ -1142,6 +1443,8 @@ _setup_current_directory_transfer (gftp_transfer * transfer, int *ret)
             }
         }
 
+      _gftp_lookup_other_side (transfer, dirhash, curfle, pos);
+
       if (transfer->toreq && curfle->destfile == NULL)
         curfle->destfile = gftp_build_path (transfer->toreq,
                                             transfer->toreq->directory, 
@@ -1224,13 +1527,14 @@ int
 gftp_get_all_subdirs (gftp_transfer * transfer,
                       void (*update_func) (gftp_transfer * transfer))
 {
-  GList * templist, * lastlist;
+  GList * templist, * lastlist, * bulk_sized;
   char *oldfromdir, *oldtodir;
+  intptr_t stream_subdirs;
   GHashTable * device_hash;
-  gftp_file * curfle;
   off_t linksize;
+  gftp_file * curfle;
   mode_t st_mode;
-  int ret;
+  int ret, bulk;
 
   g_return_val_if_fail (transfer != NULL, GFTP_EFATAL);
   g_return_val_if_fail (transfer->fromreq != NULL, GFTP_EFATAL);
@@ -1244,16 +1548,44 @@ gftp_get_all_subdirs (gftp_transfer * transfer,
   if (lastlist == NULL)
     return (ret);
 
+  /* The subdirectories are only marked here if the transfer can list them
+     itself in another thread while the files are going. See
+     gftp_walk_subdirs() */
+  if (g_thread_supported () && transfer->toreq != NULL)
+    gftp_lookup_request_option (transfer->fromreq, "stream_subdirs",
+                                &stream_subdirs);
+  else
+    stream_subdirs = 0;
+
+  bulk = transfer->toreq != NULL &&
+         gftp_bulk_supported (transfer->fromreq, transfer->toreq);
+
   oldfromdir = oldtodir = NULL;
+  bulk_sized = NULL;
   device_hash = g_hash_table_new (uint_hash_function, uint_hash_compare);
 
   for (templist = transfer->files; templist != NULL; templist = templist->next)
     {
       curfle = templist->data;
 
+      /* The directories that were added since the last du are sized when
+         the first one of them is reached */
+      if (bulk_sized != NULL && templist->prev == bulk_sized)
+        bulk_sized = NULL;
+
+      /* Only on the destination side, see _gftp_add_extraneous_files() */
+      if (curfle->transfer_action == GFTP_TRANS_ACTION_DELETE)
+        {
+          transfer->numfiles++;
+          continue;
+        }
+
       if (_lookup_curfle_in_device_hash (transfer->fromreq, curfle,
                                          device_hash))
-        continue;
+        {
+          curfle->bulk_transfer = 0;
+          continue;
+        }
 
       if (S_ISLNK (curfle->st_mode) && !S_ISDIR (curfle->st_mode))
         {
@@ -1285,10 +1617,38 @@ gftp_get_all_subdirs (gftp_transfer * transfer,
       /* Got a directory... */
       transfer->numdirs++;
 
+      /* A directory that is not on the other side yet is sent as one tar
+         stream, so it does not have to be listed. The first time one is
+         found, all of them from here to the end of the list are sized with
+         one du. If du does not work, then it is transferred one file at a
+         time */
+      if (bulk && !curfle->exists_other_side &&
+          curfle->transfer_action != GFTP_TRANS_ACTION_SKIP)
+        {
+          if (bulk_sized == NULL)
+            {
+              bulk_sized = g_list_last (templist);
+              gftp_bulk_get_tree_sizes (transfer->fromreq, templist);
+            }
+
+          if (curfle->bulk_transfer)
+            continue;
+        }
+
+      if (stream_subdirs)
+        {
+          curfle->list_pending = 1;
+          continue;
+        }
+
       if (oldfromdir == NULL)
         oldfromdir = g_strdup (transfer->fromreq->directory);
 
-      ret = gftp_set_directory (transfer->fromreq, curfle->file);
+      if (gftp_prefetch_listings (transfer->fromreq,
+                                  curfle->file) == GFTP_EFATAL)
+        ret = GFTP_EFATAL;
+      else
+        ret = gftp_set_directory (transfer->fromreq, curfle->file);
       if (ret < 0)
         {
           _cleanup_get_all_subdirs (transfer, oldfromdir, oldtodir,
@@ -1373,6 +1733,258 @@ gftp_get_all_subdirs (gftp_transfer * transfer,
 }
 
 
+static int
+_gftp_walk_resolve_links (gftp_transfer * walker, GList * files)
+{
+  gftp_file * curfle;
+  off_t linksize;
+  mode_t st_mode;
+  int ret;
+
+  for (; files != NULL; files = files->next)
+    {
+      curfle = files->data;
+      if (curfle->transfer_action == GFTP_TRANS_ACTION_DELETE)
+        continue;
+
+      if (S_ISLNK (curfle->st_mode) && !S_ISDIR (curfle->st_mode))
+        {
+          st_mode = 0;
+          linksize = 0;
+          ret = gftp_stat_filename (walker->fromreq, curfle->file, &st_mode,
+                                    &linksize);
+          if (ret == GFTP_EFATAL)
+            return (ret);
+          else if (ret == 0)
+            {
+              if (S_ISDIR (st_mode))
+                curfle->st_mode = st_mode;
+              else
+                curfle->size = linksize;
+            }
+        }
+
+      if (S_ISDIR (curfle->st_mode))
+        curfle->list_pending = 1;
+      else if (curfle->exists_other_side)
+        gftp_get_transfer_action (walker->fromreq, curfle);
+    }
+
+  return (0);
+}
+
+
+static void
+_gftp_walk_add_files (gftp_transfer * walker, GList ** lastlist,
+                      gftp_file * dirfle, GList * files)
+{
+  gftp_transfer * tdata;
+  gftp_file * curfle;
+  GList * templist;
+
+  tdata = walker->parent;
+
+  if (g_thread_supported ())
+    g_static_mutex_lock (&tdata->structmutex);
+
+  /* The transfer stopped taking new files */
+  if (!tdata->walking)
+    {
+      if (g_thread_supported ())
+        g_static_mutex_unlock (&tdata->structmutex);
+
+      free_file_list (files);
+      return;
+    }
+
+  dirfle->list_pending = 0;
+
+  if (files != NULL)
+    {
+      *lastlist = g_list_last (*lastlist);
+      (*lastlist)->next = files;
+      files->prev = *lastlist;
+
+      if (g_thread_supported ())
+        g_static_mutex_lock (&tdata->statmutex);
+
+      for (templist = files; templist != NULL; templist = templist->next)
+        {
+          curfle = templist->data;
+          if (S_ISDIR (curfle->st_mode))
+            tdata->numdirs++;
+          else
+            tdata->numfiles++;
+
+          if (curfle->transfer_action != GFTP_TRANS_ACTION_SKIP)
+            tdata->total_bytes += curfle->size;
+        }
+
+      if (g_thread_supported ())
+        g_static_mutex_unlock (&tdata->statmutex);
+
+      /* Pick the transfer back up if it already got to the end of the
+         files that it had */
+      if (tdata->curfle == NULL)
+        tdata->curfle = files;
+      if (tdata->nextfle == NULL)
+        tdata->nextfle = files;
+      if (tdata->updfle == NULL)
+        tdata->updfle = files;
+      if (tdata->walkfle == NULL)
+        tdata->walkfle = files;
+
+      if (tdata->journal_id != 0)
+        gftp_journal_add_files (tdata, files);
+    }
+
+  if (tdata->journal_id != 0)
+    gftp_journal_dir_listed (tdata, dirfle);
+
+  if (tdata->walkcond != NULL)
+    g_cond_broadcast (tdata->walkcond);
+
+  if (g_thread_supported ())
+    g_static_mutex_unlock (&tdata->structmutex);
+}
+
+
+static int
+_gftp_walk_dir (gftp_transfer * walker, GList ** lastlist, gftp_file * dirfle)
+{
+  GList * files;
+  int ret;
+
+  if ((ret = gftp_connect (walker->fromreq)) < 0)
+    return (ret);
+
+  if (gftp_prefetch_listings (walker->fromreq, dirfle->file) == GFTP_EFATAL)
+    return (GFTP_EFATAL);
+
+  ret = gftp_set_directory (walker->fromreq, dirfle->file);
+  if (ret < 0)
+    return (ret);
+
+  if (walker->toreq != NULL)
+    {
+      if (dirfle->exists_other_side)
+        {
+          if ((ret = gftp_connect (walker->toreq)) < 0)
+            return (ret);
+
+          ret = gftp_set_directory (walker->toreq, dirfle->destfile);
+          if (ret < 0)
+            return (ret);
+        }
+      else
+        {
+          if (walker->toreq->directory != NULL)
+            g_free (walker->toreq->directory);
+
+          walker->toreq->directory = g_strdup (dirfle->destfile);
+        }
+    }
+
+  ret = 0;
+  files = gftp_get_dir_listing (walker, dirfle->exists_other_side, &ret);
+  if (ret < 0)
+    {
+      free_file_list (files);
+      return (ret);
+    }
+
+  if ((ret = _gftp_walk_resolve_links (walker, files)) < 0)
+    {
+      free_file_list (files);
+      return (ret);
+    }
+
+  _gftp_walk_add_files (walker, lastlist, dirfle, files);
+  return (0);
+}
+
+
+/* Lists the directories that gftp_get_all_subdirs() marked as list_pending
+   while the files are being transferred. walker is a copy of the transfer
+   with its own connections and its parent set to the transfer. The contents
+   of each directory are added to the end of the transfer as soon as they
+   are read, and the directories in there are walked in turn. The transfer's
+   walking flag must be set; the files are thrown away once it is cleared.
+   A directory that cannot be read is logged and skipped. Connects on its
+   own and stops when the walker is cancelled */
+
+int
+gftp_walk_subdirs (gftp_transfer * walker)
+{
+  GList * templist, * lastlist;
+  GHashTable * device_hash;
+  gftp_transfer * tdata;
+  gftp_file * curfle;
+  int ret, list_dir;
+
+  g_return_val_if_fail (walker != NULL, GFTP_EFATAL);
+  g_return_val_if_fail (walker->parent != NULL, GFTP_EFATAL);
+  g_return_val_if_fail (walker->fromreq != NULL, GFTP_EFATAL);
+
+  tdata = walker->parent;
+  device_hash = g_hash_table_new (uint_hash_function, uint_hash_compare);
+  ret = 0;
+
+  if (g_thread_supported ())
+    g_static_mutex_lock (&tdata->structmutex);
+
+  templist = tdata->files;
+  lastlist = g_list_last (tdata->files);
+
+  if (g_thread_supported ())
+    g_static_mutex_unlock (&tdata->structmutex);
+
+  while (templist != NULL && !walker->cancel)
+    {
+      curfle = templist->data;
+
+      if (g_thread_supported ())
+        g_static_mutex_lock (&tdata->structmutex);
+
+      list_dir = curfle->list_pending;
+      if (list_dir && _lookup_curfle_in_device_hash (walker->fromreq, curfle,
+                                                     device_hash))
+        {
+          curfle->list_pending = 0;
+          list_dir = 0;
+        }
+
+      if (g_thread_supported ())
+        g_static_mutex_unlock (&tdata->structmutex);
+
+      if (list_dir)
+        {
+          ret = _gftp_walk_dir (walker, &lastlist, curfle);
+          if (ret == GFTP_EFATAL || walker->cancel)
+            break;
+          else if (ret < 0)
+            walker->fromreq->logging_function (gftp_logging_error,
+                                   walker->fromreq,
+                                   _("Could not get the contents of directory %s\n"),
+                                   curfle->file);
+          ret = 0;
+        }
+
+      if (g_thread_supported ())
+        g_static_mutex_lock (&tdata->structmutex);
+
+      templist = templist->next;
+
+      if (g_thread_supported ())
+        g_static_mutex_unlock (&tdata->structmutex);
+    }
+
+  _free_device_hash (device_hash);
+
+  return (ret);
+}
+
+
 int
 gftp_set_config_options (gftp_request * request)
 {
@@ -1452,17 +2064,49 @@ gftp_swap_socks (gftp_request * dest, gftp_request * source)
 }
 
 
+static void
+_gftp_calc_parent_kbs (gftp_transfer * tdata, ssize_t num_read,
+                       struct timeval * tv)
+{
+  gftp_transfer * parent;
+  double start_difftime;
+
+  parent = tdata->parent;
+
+  if (g_thread_supported ())
+    g_static_mutex_lock (&parent->statmutex);
+
+  parent->trans_bytes += num_read;
+  parent->stalled = 0;
+
+  /* The UI only shows the progress of the oldest file that is still being
+     transferred, so mirror the counters from the worker that has it */
+  if (parent->curfle == tdata->curfle)
+    {
+      parent->curtrans = tdata->curtrans;
+      parent->curresumed = tdata->curresumed;
+      parent->tot_file_trans = tdata->tot_file_trans;
+    }
+
+  start_difftime = (tv->tv_sec - parent->starttime.tv_sec) + ((double) (tv->tv_usec - parent->starttime.tv_usec) / 1000000.0);
+
+  if (start_difftime <= 0)
+    parent->kbs = parent->trans_bytes / 1024.0;
+  else
+    parent->kbs = parent->trans_bytes / 1024.0 / start_difftime;
+
+  memcpy (&parent->lasttime, tv, sizeof (parent->lasttime));
+
+  if (g_thread_supported ())
+    g_static_mutex_unlock (&parent->statmutex);
+}
+
+
 void
 gftp_calc_kbs (gftp_transfer * tdata, ssize_t num_read)
 {
-  /* Needed for systems that size(float) < size(void *) */
-  union { intptr_t i; float f; } maxkbs;
-  unsigned long waitusecs;
   double start_difftime;
   struct timeval tv;
-  int waited;
-
-  gftp_lookup_request_option (tdata->fromreq, "maxkbs", &maxkbs.f);
 
   if (g_thread_supported ())
     g_static_mutex_lock (&tdata->statmutex);
@@ -1480,29 +2124,168 @@ gftp_calc_kbs (gftp_transfer * tdata, ssize_t num_read)
   else
     tdata->kbs = tdata->trans_bytes / 1024.0 / start_difftime;
 
-  waited = 0;
-  if (maxkbs.f > 0 && tdata->kbs > maxkbs.f)
+  if (tdata->parent != NULL)
+    _gftp_calc_parent_kbs (tdata, num_read, &tv);
+
+  memcpy (&tdata->lasttime, &tv, sizeof (tdata->lasttime));
+
+  if (g_thread_supported ())
+    g_static_mutex_unlock (&tdata->statmutex);
+
+  /* This may sleep, so it has to be done without holding statmutex */
+  if (gftp_bandwidth_limit (tdata, num_read))
     {
-      waitusecs = num_read / 1024.0 / maxkbs.f * 1000000.0 - start_difftime;
+      if (g_thread_supported ())
+        g_static_mutex_lock (&tdata->statmutex);
 
-      if (waitusecs > 0)
-        {
-          if (g_thread_supported ())
-            g_static_mutex_unlock (&tdata->statmutex);
+      gettimeofday (&tdata->lasttime, NULL);
+
+      if (g_thread_supported ())
+        g_static_mutex_unlock (&tdata->statmutex);
+    }
+}
 
-          waited = 1;
-          usleep (waitusecs);
 
-          if (g_thread_supported ())
-            g_static_mutex_lock (&tdata->statmutex);
+/* Returns the number of bytes that should be read from the source at a
+   time. The first call sets up the bounds from the trans_blksize and
+   adaptive_trans_blksize options and from the limits of the protocols on
+   either side. */
+
+size_t
+gftp_get_trans_blksize (gftp_transfer * tdata)
+{
+  intptr_t trans_blksize, adaptive_trans_blksize;
+  size_t max_blksize, blksize;
+
+  g_return_val_if_fail (tdata != NULL, GFTP_MIN_TRANS_BLKSIZE);
+
+  if (g_thread_supported ())
+    g_static_mutex_lock (&tdata->statmutex);
+
+  if (tdata->trans_blksize == 0)
+    {
+      gftp_lookup_request_option (tdata->fromreq, "trans_blksize",
+                                  &trans_blksize);
+      gftp_lookup_request_option (tdata->fromreq, "adaptive_trans_blksize",
+                                  &adaptive_trans_blksize);
+
+      max_blksize = GFTP_MAX_TRANS_BLKSIZE;
+      if (tdata->fromreq->max_trans_blksize > 0 &&
+          tdata->fromreq->max_trans_blksize < max_blksize)
+        max_blksize = tdata->fromreq->max_trans_blksize;
+      if (tdata->toreq != NULL && tdata->toreq->max_trans_blksize > 0 &&
+          tdata->toreq->max_trans_blksize < max_blksize)
+        max_blksize = tdata->toreq->max_trans_blksize;
+
+      if (trans_blksize <= 0)
+        tdata->trans_blksize = GFTP_MIN_TRANS_BLKSIZE;
+      else if ((size_t) trans_blksize > max_blksize)
+        tdata->trans_blksize = max_blksize;
+      else
+        tdata->trans_blksize = trans_blksize;
+
+      if (adaptive_trans_blksize)
+        {
+          tdata->min_blksize = GFTP_MIN_TRANS_BLKSIZE;
+          tdata->max_blksize = max_blksize;
+          if (tdata->min_blksize > tdata->trans_blksize)
+            tdata->min_blksize = tdata->trans_blksize;
         }
+      else
+        tdata->min_blksize = tdata->max_blksize = tdata->trans_blksize;
+    }
+
+  blksize = tdata->trans_blksize;
+
+  if (g_thread_supported ())
+    g_static_mutex_unlock (&tdata->statmutex);
+
+  return (blksize);
+}
+
+
+/* Called after each chunk is moved. About once a second, the block size is
+   doubled if the reads are filling the buffer and there are a lot of them,
+   or halved if each read is taking a long time. If a larger block size made
+   the transfer slower, the previous size is restored and used as the
+   upper limit for the rest of the transfer. Call this with num_trans set
+   to 0 when a file is started so that the time in between files is not
+   counted. */
+
+void
+gftp_tune_trans_blksize (gftp_transfer * tdata, ssize_t num_trans)
+{
+  double difftime, rate, chunks_per_sec;
+  struct timeval tv;
 
+  g_return_if_fail (tdata != NULL);
+
+  if (g_thread_supported ())
+    g_static_mutex_lock (&tdata->statmutex);
+
+  if (tdata->trans_blksize == 0 || tdata->min_blksize == tdata->max_blksize)
+    {
+      if (g_thread_supported ())
+        g_static_mutex_unlock (&tdata->statmutex);
+      return;
+    }
+
+  if (num_trans <= 0)
+    {
+      tdata->tunetime.tv_sec = 0;
+      tdata->tune_bytes = 0;
+      tdata->tune_chunks = 0;
+
+      if (g_thread_supported ())
+        g_static_mutex_unlock (&tdata->statmutex);
+      return;
+    }
+
+  gettimeofday (&tv, NULL);
+  if (tdata->tunetime.tv_sec == 0)
+    memcpy (&tdata->tunetime, &tv, sizeof (tdata->tunetime));
+
+  tdata->tune_bytes += num_trans;
+  tdata->tune_chunks++;
+
+  difftime = (tv.tv_sec - tdata->tunetime.tv_sec) + ((double) (tv.tv_usec - tdata->tunetime.tv_usec) / 1000000.0);
+  if (difftime < 1.0)
+    {
+      if (g_thread_supported ())
+        g_static_mutex_unlock (&tdata->statmutex);
+      return;
     }
 
-  if (waited)
-    gettimeofday (&tdata->lasttime, NULL);
+  rate = tdata->tune_bytes / difftime;
+  chunks_per_sec = tdata->tune_chunks / difftime;
+
+  if (tdata->prev_blksize > 0 && rate < tdata->tune_rate * 0.9)
+    {
+      tdata->trans_blksize = tdata->max_blksize = tdata->prev_blksize;
+      tdata->prev_blksize = 0;
+    }
+  else if (chunks_per_sec > 50 && tdata->trans_blksize < tdata->max_blksize &&
+           tdata->tune_bytes / tdata->tune_chunks >= tdata->trans_blksize * 3 / 4)
+    {
+      tdata->prev_blksize = tdata->trans_blksize;
+      tdata->trans_blksize *= 2;
+      if (tdata->trans_blksize > tdata->max_blksize)
+        tdata->trans_blksize = tdata->max_blksize;
+    }
+  else if (chunks_per_sec < 2 && tdata->trans_blksize > tdata->min_blksize)
+    {
+      tdata->prev_blksize = 0;
+      tdata->trans_blksize /= 2;
+      if (tdata->trans_blksize < tdata->min_blksize)
+        tdata->trans_blksize = tdata->min_blksize;
+    }
   else
-    memcpy (&tdata->lasttime, &tv, sizeof (tdata->lasttime));
+    tdata->prev_blksize = 0;
+
+  tdata->tune_rate = rate;
+  tdata->tune_bytes = 0;
+  tdata->tune_chunks = 0;
+  memcpy (&tdata->tunetime, &tv, sizeof (tdata->tunetime));
 
   if (g_thread_supported ())
     g_static_mutex_unlock (&tdata->statmutex);
@@ -335,7 +335,7 @@ gftp_exec (gftp_request * request, int *fdm, int *ptymfd, char **args)
 
       execvp (args[0], args);
 
-      printf (_("Error: Cannot execute ssh: %s\n"), g_strerror (errno));
+      printf (_("Error: Cannot execute %s: %s\n"), args[0], g_strerror (errno));
       _exit (1);
     }
   else if (child > 0)
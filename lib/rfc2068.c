@@ -22,6 +22,17 @@
 
 static const char cvsid[] = "$Id$";
 
+/* The most bytes of an unread response body that are read and thrown away so
+   that the connection can be kept open */
+#define RFC2068_DRAIN_MAX	65536
+
+/* Size of the buffer that compressed bytes are read into before they are
+   passed to inflate() */
+#define RFC2068_ZBUF_SIZE	16384
+
+/* Seconds that the listings from a Depth: infinity PROPFIND are used for */
+#define RFC2068_DAV_TREE_TIMEOUT	60
+
 static gftp_config_vars config_vars[] =
 {
   {"", N_("HTTP"), gftp_option_type_notebook, NULL, NULL, 
@@ -44,6 +55,25 @@ static gftp_config_vars config_vars[] =
    gftp_option_type_checkbox, GINT_TO_POINTER(1), NULL, 
    GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
    N_("Do you want to use HTTP/1.1 or HTTP/1.0"), GFTP_PORT_ALL, NULL},
+  {"http_pipeline_depth", N_("Pipelined requests:"), 
+   gftp_option_type_int, GINT_TO_POINTER(4), NULL, 
+   GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
+   N_("The number of requests for the next files in a transfer that are sent before the file that is being downloaded is done. Set this to 0 to disable"),
+   GFTP_PORT_ALL, NULL},
+#ifdef USE_ZLIB
+  {"http_compression", N_("Ask for compressed listings"), 
+   gftp_option_type_checkbox, GINT_TO_POINTER(0), NULL, 
+   GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
+   N_("Ask the server to compress the directory listings with gzip or deflate. They are decompressed as they are read. Files are always downloaded as they are stored on the server"),
+   GFTP_PORT_ALL, NULL},
+#endif
+#if GLIB_MAJOR_VERSION > 1
+  {"http_webdav", N_("Use WebDAV listings"), 
+   gftp_option_type_checkbox, GINT_TO_POINTER(0), NULL, 
+   GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
+   N_("List directories with the WebDAV PROPFIND method, which gives the sizes and the modification times of the files. Whole trees are listed at once when the server allows it. Servers that do not support WebDAV are listed from their HTML pages"),
+   GFTP_PORT_ALL, NULL},
+#endif
 
   {NULL, NULL, 0, NULL, NULL, 0, NULL, 0, NULL}
 };
@@ -89,20 +119,227 @@ rfc2068_connect (gftp_request * request)
 }
 
 
+/* Returns the Accept-Encoding header that is sent with the requests for
+   listings, or an empty string. Files are never asked for compressed: a
+   Range would apply to the compressed bytes, and a file that is itself
+   compressed (a .tar.gz, say) could come back with a Content-Encoding and
+   be saved decompressed */
+
+static const char *
+rfc2068_accept_encoding (gftp_request * request)
+{
+#ifdef USE_ZLIB
+  intptr_t http_compression;
+
+  gftp_lookup_request_option (request, "http_compression", &http_compression);
+  if (http_compression)
+    return ("Accept-Encoding: gzip, deflate\n");
+#endif
+
+  return ("");
+}
+
+
+/* Builds the request line and the headers that depend on the file */
+
+static char *
+rfc2068_build_request (gftp_request * request, const char *method,
+                       const char *filename, off_t startsize)
+{
+  char *tempstr, *oldstr, *hf;
+  intptr_t use_http11;
+
+  gftp_lookup_request_option (request, "use_http11", &use_http11);
+
+  hf = gftp_build_path (request, request->hostname, filename, NULL);
+
+  if (request->username == NULL || *request->username == '\0')
+    tempstr = g_strconcat (method, " ", request->url_prefix, "://", hf,
+                           use_http11 ? " HTTP/1.1\n" : " HTTP/1.0\n", NULL);
+  else
+    tempstr = g_strconcat (method, " ", request->url_prefix, "://", 
+                           request->username, "@", hf,
+                           use_http11 ? " HTTP/1.1\n" : " HTTP/1.0\n", NULL);
+
+  g_free (hf);
+
+  if (!use_http11 || startsize <= 0)
+    return (tempstr);
+
+  oldstr = tempstr;
+  tempstr = g_strdup_printf ("%sRange: bytes=" GFTP_OFF_T_PRINTF_MOD "-\n",
+                             oldstr, startsize);
+  g_free (oldstr);
+  return (tempstr);
+}
+
+
+#ifdef USE_ZLIB
+static void
+rfc2068_stop_inflate (rfc2068_params * params)
+{
+  if (!params->inflating)
+    return;
+
+  inflateEnd (&params->zstream);
+  params->inflating = 0;
+}
+
+
+/* Sets up the decompression of a body. The part of the body that was read
+   along with the headers is handed to inflate() first */
+
+static int
+rfc2068_start_inflate (gftp_request * request)
+{
+  rfc2068_params * params;
+  size_t len;
+
+  params = request->protocol_data;
+  rfc2068_stop_inflate (params);
+
+  len = params->rbuf != NULL ? params->rbuf->cur_bufsize : 0;
+  if (params->zbuf == NULL || params->zbuf_size < len)
+    {
+      params->zbuf_size = len > RFC2068_ZBUF_SIZE ? len : RFC2068_ZBUF_SIZE;
+      params->zbuf = g_realloc (params->zbuf, (gulong) params->zbuf_size);
+    }
+
+  memset (&params->zstream, 0, sizeof (params->zstream));
+
+  /* Adding 32 to the window bits accepts both the gzip and the zlib
+     header */
+  if (inflateInit2 (&params->zstream, 15 + 32) != Z_OK)
+    {
+      request->logging_function (gftp_logging_error, request,
+                                 _("Error: Cannot decompress the response from the server: %s\n"),
+                                 params->zstream.msg != NULL ?
+                                   params->zstream.msg : "");
+      return (GFTP_EFATAL);
+    }
+
+  params->inflating = 1;
+  params->inflate_eof = 0;
+  params->encoded_bytes = len;
+  params->decoded_bytes = 0;
+
+  if (len > 0)
+    {
+      memcpy (params->zbuf, params->rbuf->curpos, len);
+      params->zstream.next_in = (Bytef *) params->zbuf;
+      params->zstream.avail_in = len;
+    }
+
+  if (params->rbuf != NULL)
+    gftp_free_getline_buffer (&params->rbuf);
+
+  return (0);
+}
+#endif
+
+
+static void
+rfc2068_free_pipeline (rfc2068_params * params)
+{
+  GList * templist;
+
+  for (templist = params->pipeline; templist != NULL; templist = templist->next)
+    g_free (templist->data);
+
+  g_list_free (params->pipeline);
+  params->pipeline = NULL;
+}
+
+
+/* Keeps the bytes that were read past the end of a response. When requests
+   were sent ahead, the server sends their responses right after this one, so
+   the start of the next response can be read together with it. */
+
+static void
+rfc2068_keep_next_response (rfc2068_params * params, const char *data,
+                            size_t len)
+{
+  gftp_getline_buffer * rbuf;
+
+  if (len == 0)
+    return;
+
+  rbuf = g_malloc0 (sizeof (*rbuf));
+  rbuf->max_bufsize = len > 8192 ? len : 8192;
+  rbuf->buffer = g_malloc0 ((gulong) rbuf->max_bufsize + 1);
+  memcpy (rbuf->buffer, data, len);
+  rbuf->cur_bufsize = len;
+  rbuf->curpos = rbuf->buffer;
+
+  if (params->next_rbuf != NULL)
+    gftp_free_getline_buffer (&params->next_rbuf);
+  params->next_rbuf = rbuf;
+}
+
+
+/* Called when the body of a response has been read already. Whatever is
+   left in the line buffer belongs to the next response */
+
+static void
+rfc2068_keep_rest_of_buffer (rfc2068_params * params)
+{
+  if (params->rbuf == NULL)
+    return;
+
+  rfc2068_keep_next_response (params, params->rbuf->curpos,
+                              params->rbuf->cur_bufsize);
+  gftp_free_getline_buffer (&params->rbuf);
+}
+
+
+/* Returns 1 if the value of a Content-Encoding header is exactly one of the
+   codings that Accept-Encoding asks for. Anything else, such as x-gzip or a
+   list of codings, is left alone. */
+
+static int
+rfc2068_known_encoding (const char *value)
+{
+  size_t len;
+
+  while (*value == ' ' || *value == '\t')
+    value++;
+
+  len = strlen (value);
+  while (len > 0 && (value[len - 1] == ' ' || value[len - 1] == '\t' ||
+                     value[len - 1] == '\r'))
+    len--;
+
+  return ((len == 4 && strncasecmp (value, "gzip", 4) == 0) ||
+          (len == 7 && strncasecmp (value, "deflate", 7) == 0));
+}
+
+
+/* Parses the status line and the headers of a response. This also works out
+   where the body ends, so that the connection can be used for the next
+   request once it has been read. A response to HEAD never has a body. */
+
 static off_t 
-rfc2068_read_response (gftp_request * request)
+rfc2068_read_headers (gftp_request * request, int head_request)
 {
+  unsigned int chunked, have_length, no_body;
   rfc2068_params * params;
-  unsigned int chunked;
+  intptr_t use_http11;
   char tempstr[8192];
   int ret;
 
   params = request->protocol_data;
+  gftp_lookup_request_option (request, "use_http11", &use_http11);
   *tempstr = '\0';
   chunked = 0;
+  have_length = 0;
+  no_body = head_request;
   params->chunk_size = 0;
   params->content_length = 0;
+  params->read_bytes = 0;
+  params->chunked_transfer = 0;
   params->eof = 0;
+  params->keep_alive = 0;
+  params->content_encoded = 0;
 
   if (request->last_ftp_response)
     {
@@ -117,14 +354,46 @@ rfc2068_read_response (gftp_request * request)
       params->extra_read_buffer_len = 0;
     }
 
+  if (params->next_rbuf != NULL)
+    {
+      if (params->rbuf != NULL)
+        gftp_free_getline_buffer (&params->rbuf);
+
+      params->rbuf = params->next_rbuf;
+      params->next_rbuf = NULL;
+    }
+
   do
     {
       if ((ret = gftp_get_line (request, &params->rbuf, tempstr, 
                                 sizeof (tempstr), request->datafd)) < 0)
         return (ret);
+      else if (ret == 0)
+        {
+          /* The server closed the connection. This happens when a kept alive
+             connection was idle for too long */
+          gftp_disconnect (request);
+          return (GFTP_ERETRYABLE);
+        }
+
+      /* The CRLF that ends a chunked body can be left over from the last
+         response */
+      if (request->last_ftp_response == NULL && *tempstr == '\0')
+        continue;
 
       if (request->last_ftp_response == NULL)
-        request->last_ftp_response = g_strdup (tempstr);
+        {
+          request->last_ftp_response = g_strdup (tempstr);
+
+          /* HTTP/1.1 connections stay open unless the server says otherwise,
+             HTTP/1.0 connections only when it asks for it */
+          params->keep_alive = use_http11 &&
+                               strncmp (tempstr, "HTTP/1.0", 8) != 0;
+          if (strlen (tempstr) > 9 && (tempstr[9] == '1' ||
+              strncmp (tempstr + 9, "204", 3) == 0 ||
+              strncmp (tempstr + 9, "304", 3) == 0))
+            no_body = 1;
+        }
 
       if (*tempstr != '\0')
         {
@@ -132,63 +401,212 @@ rfc2068_read_response (gftp_request * request)
                                      tempstr);
 
           if (strncmp (tempstr, "Content-Length:", 15) == 0)
-            params->content_length = gftp_parse_file_size (tempstr + 16);
+            {
+              params->content_length = gftp_parse_file_size (tempstr + 16);
+              have_length = 1;
+            }
           else if (strcmp (tempstr, "Transfer-Encoding: chunked") == 0)
             chunked = 1;
+          else if (strncasecmp (tempstr, "Connection:", 11) == 0)
+            {
+              if (strstr (tempstr + 11, "close") != NULL ||
+                  strstr (tempstr + 11, "Close") != NULL)
+                params->keep_alive = 0;
+              else if (strstr (tempstr + 11, "keep-alive") != NULL ||
+                       strstr (tempstr + 11, "Keep-Alive") != NULL)
+                params->keep_alive = 1;
+            }
+          else if (strncasecmp (tempstr, "Content-Encoding:", 17) == 0)
+            params->content_encoded = params->encoding_accepted &&
+                 rfc2068_known_encoding (tempstr + 17);
         }
     }
-  while (*tempstr != '\0');
+  while (request->last_ftp_response == NULL || *tempstr != '\0');
 
-  if (chunked)
+  params->response_pending = 1;
+
+  if (no_body)
     {
-      if ((ret = gftp_get_line (request, &params->rbuf, tempstr, 
-                                sizeof (tempstr), request->datafd)) < 0)
-        return (ret);
+      /* The Content-Length of a HEAD response is the size of the file, but
+         nothing follows the headers */
+      params->eof = 1;
+      params->content_encoded = 0;
+      rfc2068_keep_rest_of_buffer (params);
+      return (params->content_length);
+    }
+  else if (!chunked)
+    {
+      /* Without a length the body ends when the server closes the
+         connection */
+      if (!have_length)
+        params->keep_alive = 0;
+      else if (params->content_length == 0)
+        {
+          params->eof = 1;
+          params->content_encoded = 0;
+        }
 
-      if (sscanf (tempstr, GFTP_OFF_T_HEX_PRINTF_MOD, &params->chunk_size) != 1)
+      /* Part of the body can already be in the line buffer */
+      if (params->rbuf != NULL)
         {
-          request->logging_function (gftp_logging_recv, request,
-                                     _("Received wrong response from server, disconnecting\nInvalid chunk size '%s' returned by the remote server\n"), 
-                                     tempstr);
-          gftp_disconnect (request);
-          return (GFTP_EFATAL);
+          if (have_length &&
+              params->rbuf->cur_bufsize > params->content_length)
+            {
+              rfc2068_keep_next_response (params,
+                     params->rbuf->curpos + params->content_length,
+                     params->rbuf->cur_bufsize - params->content_length);
+              params->rbuf->cur_bufsize = params->content_length;
+              params->rbuf->curpos[params->rbuf->cur_bufsize] = '\0';
+            }
+
+          params->read_bytes = params->rbuf->cur_bufsize;
+          if (params->rbuf->cur_bufsize == 0)
+            gftp_free_getline_buffer (&params->rbuf);
         }
 
-      if (params->chunk_size == 0)
-        return (0);
+      return (params->content_length);
+    }
+
+  if ((ret = gftp_get_line (request, &params->rbuf, tempstr, 
+                            sizeof (tempstr), request->datafd)) < 0)
+    return (ret);
+
+  if (sscanf (tempstr, GFTP_OFF_T_HEX_PRINTF_MOD, &params->chunk_size) != 1)
+    {
+      request->logging_function (gftp_logging_recv, request,
+                                 _("Received wrong response from server, disconnecting\nInvalid chunk size '%s' returned by the remote server\n"), 
+                                 tempstr);
+      gftp_disconnect (request);
+      return (GFTP_EFATAL);
+    }
+
+  params->chunked_transfer = 1;
+  if (params->chunk_size == 0)
+    {
+      params->eof = 1;
+      params->content_encoded = 0;
+      rfc2068_keep_rest_of_buffer (params);
+      return (0);
+    }
+
+  if (params->rbuf != NULL)
+    params->chunk_size -= params->rbuf->cur_bufsize;
+
+  if (params->chunk_size < 0)
+    {
+      params->extra_read_buffer_len = params->chunk_size * -1;
+      params->chunk_size = 0;
+      params->extra_read_buffer = g_malloc0 ((gulong) params->extra_read_buffer_len + 1);
+      memcpy (params->extra_read_buffer, params->rbuf->curpos + (params->rbuf->cur_bufsize - params->extra_read_buffer_len), params->extra_read_buffer_len);
+      params->extra_read_buffer[params->extra_read_buffer_len] = '\0';
+      params->rbuf->cur_bufsize -= params->extra_read_buffer_len;
+      params->rbuf->curpos[params->rbuf->cur_bufsize] = '\0';
+    }
+
+  return (params->chunk_size);
+}
+
+
+static off_t 
+rfc2068_read_response (gftp_request * request, int head_request)
+{
+  rfc2068_params * params;
+  off_t ret;
+
+  params = request->protocol_data;
+#ifdef USE_ZLIB
+  rfc2068_stop_inflate (params);
+#endif
+
+  if ((ret = rfc2068_read_headers (request, head_request)) < 0 ||
+      !params->content_encoded)
+    return (ret);
+
+#ifdef USE_ZLIB
+  /* The size of the decompressed body is not known */
+  if ((ret = rfc2068_start_inflate (request)) < 0)
+    {
+      gftp_disconnect (request);
+      return (ret);
+    }
+
+  return (0);
+#else
+  return (ret);
+#endif
+}
+
+
+/* Reads what is left of the body of the last response, so that the server
+   can be sent the next request on the same connection. The connection is
+   closed instead when the server won't keep it open, or when too much of
+   the body is left to be worth reading. */
+
+static void
+rfc2068_finish_response (gftp_request * request)
+{
+  rfc2068_params * params;
+  char buf[8192];
+  ssize_t ret;
+  off_t left;
+
+  params = request->protocol_data;
+  if (!params->response_pending)
+    return;
+
+  params->response_pending = 0;
+  if (request->datafd < 0)
+    return;
+
+  /* The rest of the body is thrown away without decompressing it */
+#ifdef USE_ZLIB
+  rfc2068_stop_inflate (params);
+#endif
+
+  if (params->rbuf != NULL)
+    gftp_free_getline_buffer (&params->rbuf);
+
+  if (!params->keep_alive)
+    {
+      gftp_disconnect (request);
+      return;
+    }
 
-      params->chunk_size -= params->rbuf->cur_bufsize;
-      if (params->chunk_size < 0)
+  if (!params->chunked_transfer && params->content_length > 0)
+    {
+      left = params->content_length - params->read_bytes;
+      if (left > RFC2068_DRAIN_MAX)
         {
-          params->extra_read_buffer_len = params->chunk_size * -1;
-          params->chunk_size = 0;
-          params->extra_read_buffer = g_malloc0 ((gulong) params->extra_read_buffer_len + 1);
-          memcpy (params->extra_read_buffer, params->rbuf->curpos + (params->rbuf->cur_bufsize - params->extra_read_buffer_len), params->extra_read_buffer_len);
-          params->extra_read_buffer[params->extra_read_buffer_len] = '\0';
-          params->rbuf->cur_bufsize -= params->extra_read_buffer_len;
-          params->rbuf->curpos[params->rbuf->cur_bufsize] = '\0';
+          gftp_disconnect (request);
+          return;
         }
     }
 
-  params->chunked_transfer = chunked;
-  return (params->content_length > 0 ? params->content_length : params->chunk_size);
+  left = RFC2068_DRAIN_MAX;
+  while ((ret = request->read_function (request, buf, sizeof (buf) - 1,
+                                        request->datafd)) > 0)
+    {
+      left -= ret;
+      if (left < 0)
+        {
+          gftp_disconnect (request);
+          return;
+        }
+    }
+
+  if (ret < 0)
+    gftp_disconnect (request);
 }
 
 
-static off_t 
-rfc2068_send_command (gftp_request * request, const char *command)
+static ssize_t
+rfc2068_send_request (gftp_request * request, const char *command,
+                      const char *body)
 {
   char *tempstr, *str, *proxy_hostname, *proxy_username, *proxy_password;
   intptr_t proxy_port;
-  int conn_ret;
   ssize_t ret;
 
-  g_return_val_if_fail (request != NULL, GFTP_EFATAL);
-  g_return_val_if_fail (command != NULL, GFTP_EFATAL);
-
-  if (request->datafd < 0 && (conn_ret = rfc2068_connect (request)) != 0)
-    return (conn_ret);
-
   tempstr = g_strdup_printf ("%sUser-Agent: %s\nHost: %s\n", (char *) command,
                              gftp_version, request->hostname);
 
@@ -237,144 +655,883 @@ rfc2068_send_command (gftp_request * request, const char *command)
         return (ret);
     }
 
-  if ((ret = request->write_function (request, "\n", 1, request->datafd)) < 0)
-    return (ret);
+  ret = request->write_function (request, "\n", 1, request->datafd);
+  if (ret < 0 || body == NULL)
+    return (ret);
+
+  return (request->write_function (request, body, strlen (body),
+                                   request->datafd));
+}
+
+
+static off_t 
+rfc2068_send_command (gftp_request * request, const char *command,
+                      const char *body)
+{
+  int conn_ret, head_request, reused;
+  rfc2068_params * params;
+  GList * templist;
+  off_t ret;
+
+  g_return_val_if_fail (request != NULL, GFTP_EFATAL);
+  g_return_val_if_fail (command != NULL, GFTP_EFATAL);
+
+  params = request->protocol_data;
+  rfc2068_finish_response (request);
+  head_request = strncmp (command, "HEAD ", 5) == 0;
+
+  /* Only a response to a request that asked for it is decompressed */
+  params->encoding_accepted = strstr (command, "\nAccept-Encoding:") != NULL;
+
+  if (params->pipeline != NULL &&
+      strcmp (params->pipeline->data, command) == 0)
+    {
+      /* This request was sent ahead already */
+      templist = params->pipeline;
+      params->pipeline = g_list_remove_link (params->pipeline, templist);
+      g_free (templist->data);
+      g_list_free_1 (templist);
+
+      reused = 1;
+      ret = rfc2068_read_response (request, head_request);
+    }
+  else
+    {
+      /* The responses to the requests that were sent ahead would come
+         before the response to this one */
+      if (params->pipeline != NULL)
+        gftp_disconnect (request);
+
+      reused = request->datafd > 0;
+      if (!reused && (conn_ret = rfc2068_connect (request)) != 0)
+        return (conn_ret);
+
+      if ((ret = rfc2068_send_request (request, command, body)) >= 0)
+        ret = rfc2068_read_response (request, head_request);
+    }
+
+  if (ret != GFTP_ERETRYABLE || !reused || request->cancel)
+    return (ret);
+
+  /* The server closed the kept alive connection before it answered the
+     request. Try it once more on a new connection */
+  if (request->datafd > 0)
+    gftp_disconnect (request);
+
+  if ((conn_ret = rfc2068_connect (request)) != 0)
+    return (conn_ret);
+
+  if ((ret = rfc2068_send_request (request, command, body)) < 0)
+    return (ret);
+
+  return (rfc2068_read_response (request, head_request));
+}
+
+
+static void
+rfc2068_disconnect (gftp_request * request)
+{
+  rfc2068_params * params;
+
+  g_return_if_fail (request != NULL);
+
+  /* Anything that is still buffered or sent ahead belongs to the old
+     connection */
+  params = request->protocol_data;
+  params->response_pending = 0;
+#ifdef USE_ZLIB
+  rfc2068_stop_inflate (params);
+#endif
+
+  if (params->rbuf != NULL)
+    gftp_free_getline_buffer (&params->rbuf);
+
+  if (params->next_rbuf != NULL)
+    gftp_free_getline_buffer (&params->next_rbuf);
+
+  rfc2068_free_pipeline (params);
+
+  if (params->extra_read_buffer != NULL)
+    {
+      g_free (params->extra_read_buffer);
+      params->extra_read_buffer = NULL;
+      params->extra_read_buffer_len = 0;
+    }
+
+  if (request->datafd > 0)
+    {
+      request->logging_function (gftp_logging_misc, request,
+				 _("Disconnecting from site %s\n"),
+				 request->hostname);
+
+      if (close (request->datafd) < 0)
+        request->logging_function (gftp_logging_error, request,
+                                   _("Error closing file descriptor: %s\n"),
+                                   g_strerror (errno));
+
+      request->datafd = -1;
+    }
+}
+
+
+static off_t
+rfc2068_get_file (gftp_request * request, const char *filename,
+                  off_t startsize)
+{
+  intptr_t use_http11;
+  char *tempstr;
+  int restarted;
+  size_t len;
+  off_t size;
+
+  g_return_val_if_fail (request != NULL, GFTP_EFATAL);
+  g_return_val_if_fail (filename != NULL, GFTP_EFATAL);
+
+  gftp_lookup_request_option (request, "use_http11", &use_http11);
+
+  if (use_http11 && startsize > 0)
+    request->logging_function (gftp_logging_misc, request,
+                            _("Starting the file transfer at offset " GFTP_OFF_T_PRINTF_MOD "\n"),
+                            startsize);
+
+  tempstr = rfc2068_build_request (request, "GET", filename, startsize);
+
+  size = rfc2068_send_command (request, tempstr, NULL);
+  g_free (tempstr);
+  if (size < 0)
+    return (size);
+
+  restarted = 0;
+  len = strlen (request->last_ftp_response);
+  if (len  > 9 && strncmp (request->last_ftp_response + 9, "206", 3) == 0)
+    restarted = 1;
+  else if (len < 9 || strncmp (request->last_ftp_response + 9, "200", 3) != 0)
+    {
+      request->logging_function (gftp_logging_error, request,
+			         _("Cannot retrieve file %s\n"), filename);
+      return (GFTP_ERETRYABLE);
+    }
+  else if (startsize > 0)
+    {
+      /* The server ignored the Range header and is sending the whole file.
+         Don't let the caller write it at the wrong offset */
+      request->logging_function (gftp_logging_error, request,
+                                 _("The remote server does not support starting the transfer of %s at offset " GFTP_OFF_T_PRINTF_MOD "\n"),
+                                 filename, startsize);
+      gftp_end_transfer (request);
+      return (GFTP_EFATAL);
+    }
+
+  return (restarted ? size + startsize : size);
+}
+
+
+static ssize_t
+rfc2068_get_next_file_chunk (gftp_request * request, char *buf, size_t size)
+{
+  rfc2068_params * params;
+  size_t len;
+
+  g_return_val_if_fail (request != NULL, GFTP_EFATAL);
+
+  params = request->protocol_data;
+  if (params->rbuf != NULL && params->rbuf->curpos != NULL)
+    {
+      len = params->rbuf->cur_bufsize > size ? size : params->rbuf->cur_bufsize;
+      memcpy (buf, params->rbuf->curpos, len);
+
+      if (len == params->rbuf->cur_bufsize)
+        gftp_free_getline_buffer (&params->rbuf);
+      else
+        {
+          params->rbuf->curpos += len;
+          params->rbuf->cur_bufsize -= len;
+        }
+
+      return (len);
+    }
+
+  return (request->read_function (request, buf, size, request->datafd));
+}
+
+
+static void
+rfc2068_dav_free_lines (GList * lines)
+{
+  GList * templist;
+
+  for (templist = lines; templist != NULL; templist = templist->next)
+    g_free (templist->data);
+
+  g_list_free (lines);
+}
+
+
+static int
+rfc2068_end_transfer (gftp_request * request)
+{
+  rfc2068_params * params;
+
+  g_return_val_if_fail (request != NULL, GFTP_EFATAL);
+
+  params = request->protocol_data;
+  if (params->dav_listing)
+    {
+      /* The response was read to the end by rfc2068_list_files() */
+      params->dav_listing = 0;
+      rfc2068_dav_free_lines (params->dav_entries);
+      params->dav_entries = NULL;
+      return (0);
+    }
+
+  if (request->datafd < 0)
+    return (GFTP_EFATAL);
+
+#ifdef USE_ZLIB
+  if (params->inflating)
+    request->logging_function (gftp_logging_misc, request,
+                               _("The listing took " GFTP_OFF_T_PRINTF_MOD " bytes compressed and " GFTP_OFF_T_PRINTF_MOD " bytes decompressed\n"),
+                               params->encoded_bytes, params->decoded_bytes);
+#endif
+
+  rfc2068_finish_response (request);
+
+  params->content_length = 0;
+  params->chunked_transfer = 0;
+  params->chunk_size = 0;
+  params->eof = 0;
+
+  return (0);
+}
+
+
+/* Builds the request line for a directory. The URL always ends with a / */
+
+static char *
+rfc2068_build_dir_request (gftp_request * request, const char *method,
+                           const char *directory)
+{
+  char *tempstr, *hd;
+  intptr_t use_http11;
+
+  gftp_lookup_request_option (request, "use_http11", &use_http11);
+
+  if (strncmp (directory, "/", strlen (directory)) == 0)
+    hd = g_strdup (request->hostname);
+  else
+    hd = gftp_build_path (request, request->hostname, directory, NULL);
+
+  if (request->username == NULL || *request->username == '\0')
+    tempstr = g_strconcat (method, " ", request->url_prefix, "://", hd,
+                           use_http11 ? "/ HTTP/1.1\n" : "/ HTTP/1.0\n", 
+                           NULL);
+  else
+    tempstr = g_strconcat (method, " ", request->url_prefix, "://", 
+                           request->username, "@", hd,
+                           use_http11 ? "/ HTTP/1.1\n" : "/ HTTP/1.0\n", 
+                           NULL);
+
+  g_free (hd);
+  return (tempstr);
+}
+
+
+#if GLIB_MAJOR_VERSION > 1
+/* WebDAV listings. A PROPFIND asks for the type, the size and the
+   modification time of everything in a directory (Depth: 1) or under it
+   (Depth: infinity), and the multistatus XML that comes back is parsed as it
+   is read. Each resource is turned into a line in the MLSx format, which
+   gftp_parse_ls() reads, and the lines are kept per directory. The same
+   lines go into the directory cache. */
+
+static const char rfc2068_propfind_body[] =
+  "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+  "<D:propfind xmlns:D=\"DAV:\"><D:prop>"
+  "<D:resourcetype/><D:getcontentlength/><D:getlastmodified/>"
+  "</D:prop></D:propfind>\n";
+
+typedef struct rfc2068_dav_parser_tag
+{
+  GHashTable * dirs;
+  const char * base;		/* The directory that was asked for */
+  GString * text;
+  char * href,
+       * size,
+       * modify;
+  unsigned int keep_text : 1,
+               is_dir : 1;
+} rfc2068_dav_parser;
+
+
+/* Returns the directory without the / at the end, which is how the
+   directories are looked up in the listings */
+
+static char *
+rfc2068_dav_dir_key (const char *directory)
+{
+  char *ret;
+  size_t len;
+
+  ret = g_strdup (*directory == '\0' ? "/" : directory);
+  len = strlen (ret);
+  while (len > 1 && ret[len - 1] == '/')
+    ret[--len] = '\0';
+
+  return (ret);
+}
+
+
+/* Turns an href, which can be a full URL, into the path on the server
+   without the %XX escapes */
+
+static char *
+rfc2068_dav_href_to_path (const char *href)
+{
+  char *decoded, *ret, *dst;
+  const char *pos;
+  unsigned int ch;
+
+  if ((pos = strstr (href, "://")) != NULL &&
+      (pos = strchr (pos + 3, '/')) == NULL)
+    pos = "/";
+  else if (pos == NULL)
+    pos = href;
+
+  decoded = dst = g_malloc ((gulong) strlen (pos) + 1);
+  for (; *pos != '\0'; pos++)
+    {
+      if (*pos == '%' && isxdigit ((int) pos[1]) && isxdigit ((int) pos[2]) &&
+          sscanf (pos + 1, "%2x", &ch) == 1 && ch != 0)
+        {
+          *dst++ = (char) ch;
+          pos += 2;
+        }
+      else
+        *dst++ = *pos;
+    }
+  *dst = '\0';
+
+  ret = rfc2068_dav_dir_key (decoded);
+  g_free (decoded);
+  return (ret);
+}
+
+
+/* Converts an RFC 1123 date such as "Sun, 06 Nov 1994 08:49:37 GMT" into the
+   YYYYMMDDHHMMSS form of the MLSx modify fact. Both are in UTC. */
+
+static char *
+rfc2068_dav_modify_fact (const char *date)
+{
+  static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  int day, year, hour, min, sec;
+  const char *pos;
+  char month[4];
+
+  if (sscanf (date, "%*[^,], %d %3s %d %d:%d:%d", &day, month, &year, &hour,
+              &min, &sec) != 6 || strlen (month) != 3 ||
+      (pos = strstr (months, month)) == NULL || (pos - months) % 3 != 0)
+    return (NULL);
+
+  return (g_strdup_printf ("%04d%02d%02d%02d%02d%02d", year,
+                           (int) (pos - months) / 3 + 1, day, hour, min, sec));
+}
+
+
+static void
+rfc2068_dav_tree_add (GHashTable * dirs, const char *directory, char *line)
+{
+  GList * lines;
+
+  lines = g_hash_table_lookup (dirs, directory);
+  if (line != NULL)
+    lines = g_list_prepend (lines, line);
+
+  g_hash_table_replace (dirs, g_strdup (directory), lines);
+}
+
+
+static void
+rfc2068_dav_free_dir (gpointer key, gpointer value, gpointer user_data)
+{
+  rfc2068_dav_free_lines (value);
+}
+
+
+static void
+rfc2068_dav_free_tree (GHashTable * dirs)
+{
+  if (dirs == NULL)
+    return;
+
+  g_hash_table_foreach (dirs, rfc2068_dav_free_dir, NULL);
+  g_hash_table_destroy (dirs);
+}
+
+
+/* Takes the lines for directory out of dirs, in the order that the server
+   sent them. Returns 0 if dirs does not have the directory */
+
+static int
+rfc2068_dav_take_lines (GHashTable * dirs, const char *directory,
+                        GList ** lines)
+{
+  gpointer key, value;
+  char *dirkey;
+
+  dirkey = rfc2068_dav_dir_key (directory);
+  if (!g_hash_table_lookup_extended (dirs, dirkey, &key, &value))
+    {
+      g_free (dirkey);
+      return (0);
+    }
+
+  g_hash_table_steal (dirs, dirkey);
+  g_free (dirkey);
+  g_free (key);
+
+  *lines = g_list_reverse (value);
+  return (1);
+}
+
+
+static void
+rfc2068_dav_reset_response (rfc2068_dav_parser * parser)
+{
+  if (parser->href != NULL)
+    {
+      g_free (parser->href);
+      parser->href = NULL;
+    }
+
+  if (parser->size != NULL)
+    {
+      g_free (parser->size);
+      parser->size = NULL;
+    }
+
+  if (parser->modify != NULL)
+    {
+      g_free (parser->modify);
+      parser->modify = NULL;
+    }
+
+  parser->keep_text = 0;
+  parser->is_dir = 0;
+}
+
+
+static void
+rfc2068_dav_add_response (rfc2068_dav_parser * parser)
+{
+  char *path, *name, *dir;
+  size_t baselen;
+  GString * line;
+
+  if (parser->href == NULL)
+    return;
+
+  /* Skip the directory itself and anything that is not under it */
+  path = rfc2068_dav_href_to_path (parser->href);
+  baselen = strlen (parser->base);
+  if (strcmp (path, parser->base) == 0 ||
+      strncmp (path, parser->base, baselen) != 0 ||
+      (path[baselen] != '/' && strcmp (parser->base, "/") != 0) ||
+      strpbrk (path, "\r\n") != NULL)
+    {
+      g_free (path);
+      return;
+    }
+
+  name = strrchr (path, '/');
+  dir = name == path ? g_strdup ("/") : g_strndup (path, name - path);
+  name++;
+
+  line = g_string_new (parser->is_dir ? "type=dir;" : "type=file;");
+  if (parser->size != NULL && !parser->is_dir)
+    g_string_append_printf (line, "size=%s;", parser->size);
+  if (parser->modify != NULL)
+    g_string_append_printf (line, "modify=%s;", parser->modify);
+  g_string_append_printf (line, " %s", name);
+
+  rfc2068_dav_tree_add (parser->dirs, dir, g_string_free (line, FALSE));
+
+  /* So that an empty directory has a listing too */
+  if (parser->is_dir)
+    rfc2068_dav_tree_add (parser->dirs, path, NULL);
+
+  g_free (dir);
+  g_free (path);
+}
+
+
+static const char *
+rfc2068_dav_local_name (const char *element_name)
+{
+  const char *pos;
+
+  if ((pos = strrchr (element_name, ':')) != NULL)
+    return (pos + 1);
+  return (element_name);
+}
+
+
+static void
+rfc2068_dav_start_element (GMarkupParseContext * context,
+                           const gchar * element_name,
+                           const gchar ** attribute_names,
+                           const gchar ** attribute_values,
+                           gpointer user_data, GError ** error)
+{
+  rfc2068_dav_parser * parser;
+  const char *name;
+
+  parser = user_data;
+  name = rfc2068_dav_local_name (element_name);
+
+  if (strcmp (name, "response") == 0)
+    rfc2068_dav_reset_response (parser);
+  else if (strcmp (name, "collection") == 0)
+    parser->is_dir = 1;
+  else if (strcmp (name, "href") == 0 ||
+           strcmp (name, "getcontentlength") == 0 ||
+           strcmp (name, "getlastmodified") == 0)
+    {
+      g_string_truncate (parser->text, 0);
+      parser->keep_text = 1;
+    }
+}
+
+
+static void
+rfc2068_dav_end_element (GMarkupParseContext * context,
+                         const gchar * element_name, gpointer user_data,
+                         GError ** error)
+{
+  rfc2068_dav_parser * parser;
+  const char *name;
+  char *value;
+
+  parser = user_data;
+  name = rfc2068_dav_local_name (element_name);
+
+  if (strcmp (name, "response") == 0)
+    {
+      rfc2068_dav_add_response (parser);
+      rfc2068_dav_reset_response (parser);
+      return;
+    }
+
+  if (!parser->keep_text)
+    return;
+
+  parser->keep_text = 0;
+  value = g_strstrip (g_strdup (parser->text->str));
+
+  /* The properties that the server does not have come back empty */
+  if (*value == '\0')
+    g_free (value);
+  else if (strcmp (name, "href") == 0 && parser->href == NULL)
+    parser->href = value;
+  else if (strcmp (name, "getcontentlength") == 0 &&
+           strspn (value, "0123456789") == strlen (value))
+    {
+      if (parser->size != NULL)
+        g_free (parser->size);
+      parser->size = value;
+    }
+  else if (strcmp (name, "getlastmodified") == 0)
+    {
+      if (parser->modify != NULL)
+        g_free (parser->modify);
+      parser->modify = rfc2068_dav_modify_fact (value);
+      g_free (value);
+    }
+  else
+    g_free (value);
+}
+
+
+static void
+rfc2068_dav_text (GMarkupParseContext * context, const gchar * text,
+                  gsize text_len, gpointer user_data, GError ** error)
+{
+  rfc2068_dav_parser * parser;
+
+  parser = user_data;
+  if (parser->keep_text)
+    g_string_append_len (parser->text, text, text_len);
+}
+
+
+static GMarkupParser rfc2068_dav_callbacks =
+{
+  rfc2068_dav_start_element,
+  rfc2068_dav_end_element,
+  rfc2068_dav_text,
+  NULL,
+  NULL
+};
+
+
+/* Reads the multistatus body of a PROPFIND response into dirs. base is the
+   directory that was asked for */
+
+static int
+rfc2068_dav_read_multistatus (gftp_request * request, const char *base,
+                              GHashTable * dirs)
+{
+  GMarkupParseContext * context;
+  rfc2068_dav_parser parser;
+  GError * error;
+  char buf[8192];
+  ssize_t ret;
+
+  memset (&parser, 0, sizeof (parser));
+  parser.dirs = dirs;
+  parser.base = base;
+  parser.text = g_string_new (NULL);
+  rfc2068_dav_tree_add (dirs, base, NULL);
+
+  context = g_markup_parse_context_new (&rfc2068_dav_callbacks, 0, &parser,
+                                        NULL);
+  error = NULL;
+
+  while ((ret = rfc2068_get_next_file_chunk (request, buf,
+                                             sizeof (buf) - 1)) > 0)
+    {
+      if (!g_markup_parse_context_parse (context, buf, ret, &error))
+        break;
+    }
+
+  if (ret == 0)
+    g_markup_parse_context_end_parse (context, &error);
+
+  g_markup_parse_context_free (context);
+  rfc2068_dav_reset_response (&parser);
+  g_string_free (parser.text, TRUE);
+
+  if (error != NULL)
+    {
+      request->logging_function (gftp_logging_error, request,
+                                 _("Invalid WebDAV response from the server: %s\n"),
+                                 error->message);
+      g_error_free (error);
+      return (GFTP_ERETRYABLE);
+    }
+
+  return (ret < 0 ? (int) ret : 0);
+}
+
 
-  return (rfc2068_read_response (request));
+/* Returns 1 if the status code of the last response is status */
+
+static int
+rfc2068_response_is (gftp_request * request, const char *status)
+{
+  return (request->last_ftp_response != NULL &&
+          strlen (request->last_ftp_response) >= 12 &&
+          strncmp (request->last_ftp_response + 9, status, 3) == 0);
 }
 
 
-static void
-rfc2068_disconnect (gftp_request * request)
+/* Sends a PROPFIND for directory and reads the response. *dirs is set to
+   the listings, keyed by directory, if the server answered with a
+   multistatus; otherwise it is left NULL and the status is in
+   last_ftp_response. The response is read to the end either way. */
+
+static int
+rfc2068_propfind (gftp_request * request, const char *directory,
+                  const char *depth, GHashTable ** dirs)
 {
-  g_return_if_fail (request != NULL);
+  char *tempstr, *command, *base;
+  off_t ret;
 
-  if (request->datafd > 0)
+  *dirs = NULL;
+  tempstr = rfc2068_build_dir_request (request, "PROPFIND", directory);
+  command = g_strdup_printf ("%sDepth: %s\nContent-Type: application/xml; charset=\"utf-8\"\nContent-Length: %d\n%s",
+                             tempstr, depth,
+                             (int) strlen (rfc2068_propfind_body),
+                             rfc2068_accept_encoding (request));
+  g_free (tempstr);
+
+  ret = rfc2068_send_command (request, command, rfc2068_propfind_body);
+  g_free (command);
+  if (ret < 0)
+    return ((int) ret);
+
+  if (strlen (request->last_ftp_response) < 12 ||
+      strncmp (request->last_ftp_response + 9, "207", 3) != 0)
     {
-      request->logging_function (gftp_logging_misc, request,
-				 _("Disconnecting from site %s\n"),
-				 request->hostname);
+      rfc2068_end_transfer (request);
+      return (0);
+    }
 
-      if (close (request->datafd) < 0)
-        request->logging_function (gftp_logging_error, request,
-                                   _("Error closing file descriptor: %s\n"),
-                                   g_strerror (errno));
+  base = rfc2068_dav_dir_key (directory);
+  *dirs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  ret = rfc2068_dav_read_multistatus (request, base, *dirs);
+  g_free (base);
 
-      request->datafd = -1;
+  rfc2068_end_transfer (request);
+  if (ret < 0)
+    {
+      rfc2068_dav_free_tree (*dirs);
+      *dirs = NULL;
+      return ((int) ret);
     }
+
+  return (0);
 }
 
 
-static off_t
-rfc2068_get_file (gftp_request * request, const char *filename,
-                  off_t startsize)
+/* Drops the listings from a Depth: infinity PROPFIND once they are too old
+   to be trusted */
+
+static void
+rfc2068_dav_expire_tree (rfc2068_params * params)
 {
-  char *tempstr, *oldstr, *hf;
-  rfc2068_params * params;
-  intptr_t use_http11;
-  int restarted;
-  size_t len;
-  off_t size;
+  if (params->dav_tree == NULL ||
+      time (NULL) - params->dav_tree_time <= RFC2068_DAV_TREE_TIMEOUT)
+    return;
 
-  g_return_val_if_fail (request != NULL, GFTP_EFATAL);
-  g_return_val_if_fail (filename != NULL, GFTP_EFATAL);
+  rfc2068_dav_free_tree (params->dav_tree);
+  params->dav_tree = NULL;
+}
 
-  params = request->protocol_data;
 
-  gftp_lookup_request_option (request, "use_http11", &use_http11);
+static gboolean
+rfc2068_dav_merge_dir (gpointer key, gpointer value, gpointer user_data)
+{
+  gpointer oldkey, oldvalue;
 
-  hf = gftp_build_path (request, request->hostname, filename, NULL);
+  if (g_hash_table_lookup_extended (user_data, key, &oldkey, &oldvalue))
+    rfc2068_dav_free_lines (oldvalue);
 
-  if (request->username == NULL || *request->username == '\0')
-    tempstr = g_strconcat ("GET ", request->url_prefix, "://", hf,
-                     use_http11 ? " HTTP/1.1\n" : " HTTP/1.0\n", NULL);
-  else 
-    tempstr = g_strconcat ("GET ", request->url_prefix, "://", 
-                     request->username, "@", hf,
-                     use_http11 ? " HTTP/1.1\n" : " HTTP/1.0\n", NULL);
+  g_hash_table_replace (user_data, key, value);
+  return (TRUE);
+}
 
-  g_free (hf);
 
-  if (use_http11 && startsize > 0)
-    {
-      request->logging_function (gftp_logging_misc, request,
-                              _("Starting the file transfer at offset " GFTP_OFF_T_PRINTF_MOD "\n"),
-                              startsize);
+/* Lists the directory with PROPFIND when http_webdav is enabled. The
+   listing is taken from the last Depth: infinity PROPFIND if it has the
+   directory. Returns 1 if the HTML listing has to be used instead. */
+
+static int
+rfc2068_dav_list_files (gftp_request * request)
+{
+  rfc2068_params * params;
+  intptr_t http_webdav;
+  GHashTable * dirs;
+  int ret;
 
-      oldstr = tempstr;
-      tempstr = g_strdup_printf ("%sRange: bytes=" GFTP_OFF_T_PRINTF_MOD "-\n",
-                                 tempstr, startsize);
-      g_free (oldstr);
+  params = request->protocol_data;
+  gftp_lookup_request_option (request, "http_webdav", &http_webdav);
+  if (!http_webdav || params->no_webdav)
+    return (1);
+
+  rfc2068_dav_expire_tree (params);
+  if (params->dav_tree != NULL &&
+      rfc2068_dav_take_lines (params->dav_tree, request->directory,
+                              &params->dav_entries))
+    {
+      params->dav_listing = 1;
+      return (0);
     }
 
-  size = rfc2068_send_command (request, tempstr);
-  g_free (tempstr);
-  if (size < 0)
-    return (size);
+  if ((ret = rfc2068_propfind (request, request->directory, "1", &dirs)) < 0)
+    return (ret);
 
-  restarted = 0;
-  len = strlen (request->last_ftp_response);
-  if (len  > 9 && strncmp (request->last_ftp_response + 9, "206", 3) == 0)
-    restarted = 1;
-  else if (len < 9 || strncmp (request->last_ftp_response + 9, "200", 3) != 0)
+  if (dirs == NULL)
     {
-      request->logging_function (gftp_logging_error, request,
-			         _("Cannot retrieve file %s\n"), filename);
-      return (GFTP_ERETRYABLE);
+      /* Anything but a refusal of the method, such as a missing directory,
+         an authentication failure or a server error, is reported like a
+         failed GET would be, and WebDAV is tried again the next time */
+      if (!rfc2068_response_is (request, "405") &&
+          !rfc2068_response_is (request, "501"))
+        return (GFTP_ERETRYABLE);
+
+      request->logging_function (gftp_logging_misc, request,
+                                 _("The server does not support WebDAV listings, using the HTML listings instead\n"));
+      params->no_webdav = 1;
+      return (1);
     }
 
-  params->read_bytes = 0;
+  rfc2068_dav_take_lines (dirs, request->directory, &params->dav_entries);
+  rfc2068_dav_free_tree (dirs);
+  params->dav_listing = 1;
 
-  return (restarted ? size + startsize : size);
+  request->logging_function (gftp_logging_misc, request,
+                             _("Retrieving directory listing...\n"));
+  return (0);
 }
+#endif
 
 
-static ssize_t
-rfc2068_get_next_file_chunk (gftp_request * request, char *buf, size_t size)
+/* Lists directory and everything under it with one Depth: infinity
+   PROPFIND. The listings are kept in dav_tree for a short while, and
+   rfc2068_list_files() takes them from there instead of asking the server
+   for each directory. A server that refuses infinite depth (Apache does by
+   default) is only asked once. */
+
+static int
+rfc2068_prefetch_listings (gftp_request * request, const char *directory)
 {
+#if GLIB_MAJOR_VERSION > 1
   rfc2068_params * params;
-  size_t len;
+  intptr_t http_webdav;
+  GHashTable * dirs;
+  gpointer key, value;
+  char *dirkey;
+  int ret;
 
   g_return_val_if_fail (request != NULL, GFTP_EFATAL);
+  g_return_val_if_fail (directory != NULL, GFTP_EFATAL);
 
   params = request->protocol_data;
-  if (params->rbuf != NULL && params->rbuf->curpos != NULL)
+  gftp_lookup_request_option (request, "http_webdav", &http_webdav);
+  if (!http_webdav || params->no_webdav || params->no_depth_infinity ||
+      *directory != '/')
+    return (0);
+
+  rfc2068_dav_expire_tree (params);
+  dirkey = rfc2068_dav_dir_key (directory);
+  if (params->dav_tree != NULL &&
+      g_hash_table_lookup_extended (params->dav_tree, dirkey, &key, &value))
     {
-      len = params->rbuf->cur_bufsize > size ? size : params->rbuf->cur_bufsize;
-      memcpy (buf, params->rbuf->curpos, len);
+      g_free (dirkey);
+      return (0);
+    }
 
-      if (len == params->rbuf->cur_bufsize)
-        gftp_free_getline_buffer (&params->rbuf);
-      else
+  ret = rfc2068_propfind (request, dirkey, "infinity", &dirs);
+  g_free (dirkey);
+  if (ret < 0)
+    return (ret);
+
+  if (dirs == NULL)
+    {
+      if (rfc2068_response_is (request, "403") ||
+          rfc2068_response_is (request, "405") ||
+          rfc2068_response_is (request, "501"))
         {
-          params->rbuf->curpos += len;
-          params->rbuf->cur_bufsize -= len;
+          request->logging_function (gftp_logging_misc, request,
+                                     _("The server does not allow a whole tree to be listed at once, the directories will be listed one at a time\n"));
+          params->no_depth_infinity = 1;
         }
 
-      return (len);
+      return (0);
     }
 
-  return (request->read_function (request, buf, size, request->datafd));
-}
-
-
-static int
-rfc2068_end_transfer (gftp_request * request)
-{
-  rfc2068_params * params;
-
-  g_return_val_if_fail (request != NULL, GFTP_EFATAL);
-
-  if (request->datafd < 0)
-    return (GFTP_EFATAL);
-
-  gftp_disconnect (request);
+  if (params->dav_tree == NULL)
+    params->dav_tree = dirs;
+  else
+    {
+      g_hash_table_foreach_steal (dirs, rfc2068_dav_merge_dir,
+                                  params->dav_tree);
+      g_hash_table_destroy (dirs);
+    }
 
-  params = request->protocol_data;
-  params->content_length = 0;
-  params->chunked_transfer = 0;
-  params->chunk_size = 0;
-  params->eof = 0;
+  params->dav_tree_time = time (NULL);
+#endif
 
   return (0);
 }
@@ -383,37 +1540,25 @@ rfc2068_end_transfer (gftp_request * request)
 static int
 rfc2068_list_files (gftp_request * request)
 {
-  rfc2068_params *params;
-  char *tempstr, *hd;
-  intptr_t use_http11;
+  char *tempstr, *oldstr;
   off_t ret;
 
   g_return_val_if_fail (request != NULL, GFTP_EFATAL);
 
-  params = request->protocol_data;
-  gftp_lookup_request_option (request, "use_http11", &use_http11);
-
-  if (strncmp (request->directory, "/", strlen (request->directory)) == 0)
-    hd = g_strdup (request->hostname);
-  else
-    hd = gftp_build_path (request, request->hostname, request->directory, NULL);
-
-  if (request->username == NULL || *request->username == '\0')
-    tempstr = g_strconcat ("GET ", request->url_prefix, "://", hd,
-                           use_http11 ? "/ HTTP/1.1\n" : "/ HTTP/1.0\n", NULL);
-  else
-    tempstr = g_strconcat ("GET ", request->url_prefix, "://", 
-                           request->username, "@", hd,
-                           use_http11 ? "/ HTTP/1.1\n" : "/ HTTP/1.0\n", NULL);
+#if GLIB_MAJOR_VERSION > 1
+  if ((ret = rfc2068_dav_list_files (request)) <= 0)
+    return ((int) ret);
+#endif
 
-  g_free (hd);
+  oldstr = rfc2068_build_dir_request (request, "GET", request->directory);
+  tempstr = g_strconcat (oldstr, rfc2068_accept_encoding (request), NULL);
+  g_free (oldstr);
 
-  ret = rfc2068_send_command (request, tempstr);
+  ret = rfc2068_send_command (request, tempstr, NULL);
   g_free (tempstr);
   if (ret < 0)
     return ((int) ret);
 
-  params->read_bytes = 0;
   if (strlen (request->last_ftp_response) > 9 &&
       strncmp (request->last_ftp_response + 9, "200", 3) == 0)
     {
@@ -431,30 +1576,103 @@ rfc2068_list_files (gftp_request * request)
 static off_t 
 rfc2068_get_file_size (gftp_request * request, const char *filename)
 {
-  char *tempstr, *hf;
-  intptr_t use_http11;
+  char *tempstr;
   off_t size;
 
   g_return_val_if_fail (request != NULL, GFTP_EFATAL);
   g_return_val_if_fail (filename != NULL, GFTP_EFATAL);
 
+  tempstr = rfc2068_build_request (request, "HEAD", filename, 0);
+  size = rfc2068_send_command (request, tempstr, NULL);
+  g_free (tempstr);
+  return (size);
+}
+
+
+static int
+rfc2068_send_ahead (gftp_request * request, char *command)
+{
+  rfc2068_params * params;
+  ssize_t ret;
+
+  params = request->protocol_data;
+  if ((ret = rfc2068_send_request (request, command, NULL)) < 0)
+    {
+      g_free (command);
+      return ((int) ret);
+    }
+
+  params->pipeline = g_list_append (params->pipeline, command);
+  return (0);
+}
+
+
+/* Sends the request for a file that get_file() will be called for later,
+   without waiting for the responses to the requests before it. When
+   get_file() or get_file_size() is called for it, rfc2068_send_command()
+   only has to read the response. Up to http_pipeline_depth requests are
+   sent ahead. */
+
+static int
+rfc2068_prefetch_file (gftp_request * request, const char *filename,
+                       int need_size)
+{
+  intptr_t pipeline_depth, use_http11;
+  rfc2068_params * params;
+  GList * templist;
+  char *command;
+  int ret;
+
+  g_return_val_if_fail (request != NULL, GFTP_EFATAL);
+  g_return_val_if_fail (filename != NULL, GFTP_EFATAL);
+
+  params = request->protocol_data;
+  gftp_lookup_request_option (request, "http_pipeline_depth", &pipeline_depth);
   gftp_lookup_request_option (request, "use_http11", &use_http11);
 
-  hf = gftp_build_path (request, request->hostname, filename, NULL);
+  if (pipeline_depth <= 0 || !use_http11)
+    return (0);
 
-  if (request->username == NULL || *request->username == '\0')
-    tempstr = g_strconcat ("HEAD ", request->url_prefix, "://", hf,
-                           use_http11 ? " HTTP/1.1\n" : " HTTP/1.0\n", NULL);
-  else
-    tempstr = g_strconcat ("HEAD ", request->url_prefix, "://", 
-                           request->username, "@", hf,
-                           use_http11 ? " HTTP/1.1\n" : " HTTP/1.0\n", NULL);
+  /* The server is going to close the connection after the response that is
+     being read */
+  if (params->response_pending && !params->keep_alive)
+    return (0);
 
-  g_free (hf);
+  command = rfc2068_build_request (request, "GET", filename, 0);
+  for (templist = params->pipeline; templist != NULL; templist = templist->next)
+    {
+      if (strcmp (templist->data, command) == 0)
+        {
+          g_free (command);
+          return (1);
+        }
+    }
 
-  size = rfc2068_send_command (request, tempstr);
-  g_free (tempstr);
-  return (size);
+  if (g_list_length (params->pipeline) + (need_size ? 2 : 1) > pipeline_depth)
+    {
+      g_free (command);
+      return (0);
+    }
+
+  if (request->datafd < 0 && (ret = rfc2068_connect (request)) != 0)
+    {
+      g_free (command);
+      return (ret);
+    }
+
+  if (need_size &&
+      (ret = rfc2068_send_ahead (request,
+                                 rfc2068_build_request (request, "HEAD",
+                                                        filename, 0))) < 0)
+    {
+      g_free (command);
+      return (ret);
+    }
+
+  if ((ret = rfc2068_send_ahead (request, command)) < 0)
+    return (ret);
+
+  return (1);
 }
 
 
@@ -590,6 +1808,7 @@ rfc2068_get_next_file (gftp_request * request, gftp_file * fle, int fd)
 {
   rfc2068_params * params;
   char tempstr[8192];
+  GList * templist;
   size_t len;
   int ret;
 
@@ -608,10 +1827,31 @@ rfc2068_get_next_file (gftp_request * request, gftp_file * fle, int fd)
 
   while (1)
     {
-      if ((ret = gftp_get_line (request, &params->rbuf, tempstr, sizeof (tempstr), fd)) <= 0)
+      if (params->dav_listing)
+        {
+          /* The WebDAV listing was read by rfc2068_list_files() */
+          if (params->dav_entries == NULL)
+            return (0);
+
+          templist = params->dav_entries;
+          params->dav_entries = g_list_remove_link (params->dav_entries,
+                                                    templist);
+
+          strncpy (tempstr, templist->data, sizeof (tempstr) - 1);
+          tempstr[sizeof (tempstr) - 1] = '\0';
+          g_free (templist->data);
+          g_list_free_1 (templist);
+        }
+      else if ((ret = gftp_get_line (request, &params->rbuf, tempstr, sizeof (tempstr), fd)) <= 0)
         return (ret);
 
-      if (parse_html_line (tempstr, fle) == 0 || fle->file == NULL)
+      /* WebDAV listings are cached in the MLSx format */
+      if (strncmp (tempstr, "type=", 5) == 0)
+        ret = gftp_parse_ls (request, tempstr, fle, fd) == 0;
+      else
+        ret = parse_html_line (tempstr, fle);
+
+      if (ret == 0 || fle->file == NULL)
 	gftp_file_destroy (fle, 0);
       else
 	break;
@@ -664,6 +1904,12 @@ rfc2068_chdir (gftp_request * request, const char *directory)
 static int
 rfc2068_set_config_options (gftp_request * request)
 {
+  intptr_t use_http11;
+
+  /* The Range header is only sent with HTTP/1.1 */
+  gftp_lookup_request_option (request, "use_http11", &use_http11);
+  request->ranged_get = use_http11 != 0;
+
   return (0);
 }
 
@@ -684,12 +1930,35 @@ rfc2068_destroy (gftp_request * request)
   if (params->rbuf != NULL)
     gftp_free_getline_buffer (&params->rbuf);
 
+  if (params->next_rbuf != NULL)
+    gftp_free_getline_buffer (&params->next_rbuf);
+
+  rfc2068_free_pipeline (params);
+
   if (params->extra_read_buffer != NULL)
     {
       g_free (params->extra_read_buffer);
       params->extra_read_buffer = NULL;
       params->extra_read_buffer_len = 0;
     }
+
+  rfc2068_dav_free_lines (params->dav_entries);
+  params->dav_entries = NULL;
+  params->dav_listing = 0;
+#if GLIB_MAJOR_VERSION > 1
+  rfc2068_dav_free_tree (params->dav_tree);
+  params->dav_tree = NULL;
+#endif
+
+#ifdef USE_ZLIB
+  rfc2068_stop_inflate (params);
+  if (params->zbuf != NULL)
+    {
+      g_free (params->zbuf);
+      params->zbuf = NULL;
+      params->zbuf_size = 0;
+    }
+#endif
 }
 
 
@@ -856,9 +2125,20 @@ rfc2068_chunked_read (gftp_request * request, void *ptr, size_t size, int fd)
               return (0);
             }
 
+          /* The last chunk. Its size line is followed by the CRLF that
+             ends the body and then by the next response */
           params->eof = 1;
+          crlfpos++;
+          if (current_size >= 2 && strncmp (crlfpos, "\r\n", 2) == 0)
+            {
+              crlfpos += 2;
+              current_size -= 2;
+            }
+
+          rfc2068_keep_next_response (params, crlfpos, current_size);
+
           params->read_ref_cnt--;
-          return (sret);
+          return (stpos - (char *) ptr);
         }
 
       memmove (stpos, crlfpos + 1, current_size + 1);
@@ -877,6 +2157,84 @@ rfc2068_chunked_read (gftp_request * request, void *ptr, size_t size, int fd)
 }
 
 
+#ifdef USE_ZLIB
+/* Decompresses a body that was sent with a Content-Encoding. The compressed
+   bytes come from rfc2068_chunked_read(), which still takes care of the
+   chunks and of where the body ends. */
+
+static ssize_t 
+rfc2068_inflate_read (gftp_request * request, void *ptr, size_t size, int fd)
+{
+  rfc2068_params * params;
+  ssize_t ret;
+  int zret;
+
+  params = request->protocol_data;
+  if (params->inflate_eof || size == 0)
+    return (0);
+
+  params->zstream.next_out = ptr;
+  params->zstream.avail_out = size;
+
+  while (params->zstream.avail_out == size)
+    {
+      if (params->zstream.avail_in == 0)
+        {
+          if ((ret = rfc2068_chunked_read (request, params->zbuf,
+                                           params->zbuf_size, fd)) < 0)
+            return (ret);
+          else if (ret == 0)
+            {
+              request->logging_function (gftp_logging_error, request,
+                                         _("Error: The compressed data from the server ended early\n"));
+              gftp_disconnect (request);
+              return (GFTP_ERETRYABLE);
+            }
+
+          params->encoded_bytes += ret;
+          params->zstream.next_in = (Bytef *) params->zbuf;
+          params->zstream.avail_in = ret;
+        }
+
+      zret = inflate (&params->zstream, Z_NO_FLUSH);
+      if (zret == Z_STREAM_END)
+        {
+          params->inflate_eof = 1;
+          break;
+        }
+      else if (zret != Z_OK &&
+               (zret != Z_BUF_ERROR || params->zstream.avail_in != 0))
+        {
+          request->logging_function (gftp_logging_error, request,
+                                     _("Error: Cannot decompress the response from the server: %s\n"),
+                                     params->zstream.msg != NULL ?
+                                       params->zstream.msg : "");
+          gftp_disconnect (request);
+          return (GFTP_EFATAL);
+        }
+    }
+
+  params->decoded_bytes += size - params->zstream.avail_out;
+  return (size - params->zstream.avail_out);
+}
+#endif
+
+
+static ssize_t 
+rfc2068_read (gftp_request * request, void *ptr, size_t size, int fd)
+{
+#ifdef USE_ZLIB
+  rfc2068_params * params;
+
+  params = request->protocol_data;
+  if (params->inflating)
+    return (rfc2068_inflate_read (request, ptr, size, fd));
+#endif
+
+  return (rfc2068_chunked_read (request, ptr, size, fd));
+}
+
+
 void 
 rfc2068_register_module (void)
 {
@@ -894,7 +2252,7 @@ rfc2068_init (gftp_request * request)
   request->protonum = GFTP_HTTP_NUM;
   request->init = rfc2068_init;
   request->copy_param_options = NULL;
-  request->read_function = rfc2068_chunked_read;
+  request->read_function = rfc2068_read;
   request->write_function = gftp_fd_write;
   request->destroy = rfc2068_destroy;
   request->connect = rfc2068_connect;
@@ -921,6 +2279,10 @@ rfc2068_init (gftp_request * request)
   request->site = NULL;
   request->parse_url = NULL;
   request->swap_socks = NULL;
+  request->exec_command = NULL;
+  request->check_connection = NULL;
+  request->prefetch_file = rfc2068_prefetch_file;
+  request->prefetch_listings = rfc2068_prefetch_listings;
   request->set_config_options = rfc2068_set_config_options;
   request->url_prefix = g_strdup ("http");
   request->need_hostport = 1;
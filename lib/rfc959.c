@@ -22,6 +22,11 @@
 
 static const char cvsid[] = "$Id$";
 
+/* Block header descriptor codes from RFC 959 section 3.4.2 */
+#define RFC959_BLOCK_EOF	64
+#define RFC959_BLOCK_RESTART	16
+#define RFC959_BLOCK_MAX	65535
+
 static gftp_textcomboedt_data gftp_proxy_type[] = {
   {N_("none"), "", 0},
   {N_("SITE command"), "USER %pu\nPASS %pp\nSITE %hh\nUSER %hu\nPASS %hp\n", 0},
@@ -81,6 +86,21 @@ static gftp_config_vars config_vars[] =
    GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
    N_("The remote FTP server will attempt to resolve symlinks in the directory listings. Generally, this is a good idea to leave enabled. The only time you will want to disable this is if the remote FTP server doesn't support the -L option to LIST"), 
    GFTP_PORT_ALL, NULL},
+  {"use_mlsd", N_("Use MLSD for directory listings"), 
+   gftp_option_type_checkbox, GINT_TO_POINTER(1), NULL, 
+   GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
+   N_("If the remote FTP server supports the MLSD and MLST commands, then they will be used instead of LIST. Their output has the exact file sizes and the modification times in UTC, so gFTP does not have to guess how the server formats its listings or ask for the size of each file separately. Disable this if the server's MLSD output is broken."), 
+   GFTP_PORT_ALL, NULL},
+  {"ftp_pipelining", N_("Pipeline FTP commands"),
+   gftp_option_type_checkbox, GINT_TO_POINTER(1), NULL,
+   GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
+   N_("If this is enabled, then gFTP will send commands that do not depend on each other's replies together, such as the login commands or the commands that set up each file transfer, and then read the replies in order. This saves a round trip to the server for each command. If the server gets the replies mixed up, then gFTP stops doing this for that server. Disable this if the server drops commands that are sent before it has answered the previous one."),
+   GFTP_PORT_ALL, NULL},
+  {"ftp_block_mode", N_("Keep the data connection open (MODE B)"),
+   gftp_option_type_checkbox, GINT_TO_POINTER(1), NULL,
+   GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
+   N_("If this is enabled and the remote FTP server supports block mode (MODE B), then the data connection is kept open from one file transfer or directory listing to the next, instead of opening a new one each time. Resumed transfers always use a new data connection. Disable this if the server's block mode is broken."),
+   GFTP_PORT_ALL, NULL},
   {"ascii_transfers", N_("Transfer files in ASCII mode"), 
    gftp_option_type_checkbox, GINT_TO_POINTER(0), NULL, 
    GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
@@ -99,7 +119,7 @@ static gftp_config_vars config_vars[] =
 static int
 rfc959_read_response (gftp_request * request, int disconnect_on_42x)
 {
-  char tempstr[255], code[4];
+  char tempstr[1024], code[4];
   rfc959_parms * parms;
   ssize_t num_read;
 
@@ -134,6 +154,11 @@ rfc959_read_response (gftp_request * request, int disconnect_on_42x)
       else
         request->logging_function (gftp_logging_recv, request,
   				   "%s\n", tempstr);
+
+      /* FEAT and MLST put their data in lines that start with a space */
+      if (parms->keep_response_lines && *tempstr == ' ')
+        parms->response_lines = g_list_append (parms->response_lines,
+                                               g_strdup (tempstr + 1));
     }
   while (strncmp (code, tempstr, 4) != 0);
 
@@ -154,17 +179,9 @@ rfc959_read_response (gftp_request * request, int disconnect_on_42x)
 }
 
 
-int
-rfc959_send_command (gftp_request * request, const char *command, 
-                     ssize_t command_len, int read_response,
-                     int dont_try_to_reconnect)
+static void
+rfc959_log_command (gftp_request * request, const char *command)
 {
-  int ret;
-
-  g_return_val_if_fail (request != NULL, GFTP_EFATAL);
-  g_return_val_if_fail (command != NULL, GFTP_EFATAL);
-  g_return_val_if_fail (request->datafd > 0, GFTP_EFATAL);
-
   if (strncmp (command, "PASS", 4) == 0)
     {
       request->logging_function (gftp_logging_send, request, 
@@ -180,6 +197,120 @@ rfc959_send_command (gftp_request * request, const char *command,
       request->logging_function (gftp_logging_send, request, "%s",
                                  command);
     }
+}
+
+
+/* Pipelined commands are collected by rfc959_queue_command() and written
+   out together right before the first of their replies is read, so that
+   they go out in as few packets as possible. */
+
+static int
+rfc959_flush_queued_commands (gftp_request * request)
+{
+  rfc959_parms * parms;
+  int ret;
+
+  parms = request->protocol_data;
+  if (parms->queued_commands == NULL || parms->queued_commands->len == 0)
+    return (0);
+
+  ret = request->write_function (request, parms->queued_commands->str,
+                                 parms->queued_commands->len,
+                                 request->datafd);
+  g_string_truncate (parms->queued_commands, 0);
+  return (ret < 0 ? ret : 0);
+}
+
+
+static void
+rfc959_disable_pipelining (gftp_request * request)
+{
+  rfc959_parms * parms;
+
+  parms = request->protocol_data;
+  if (parms->no_pipelining)
+    return;
+
+  parms->no_pipelining = 1;
+  request->logging_function (gftp_logging_error, request,
+                             _("The server did not handle the pipelined commands. The commands will be sent one at a time from now on.\n"));
+}
+
+
+static int
+rfc959_use_pipelining (gftp_request * request)
+{
+  intptr_t ftp_pipelining;
+  rfc959_parms * parms;
+
+  parms = request->protocol_data;
+  if (parms->no_pipelining)
+    return (0);
+
+  gftp_lookup_request_option (request, "ftp_pipelining", &ftp_pipelining);
+  return (ftp_pipelining);
+}
+
+
+/* Reads the reply to the oldest pipelined command */
+
+static int
+rfc959_read_queued_response (gftp_request * request)
+{
+  rfc959_parms * parms;
+  int ret;
+
+  parms = request->protocol_data;
+  g_return_val_if_fail (parms->queued_responses > 0, GFTP_EFATAL);
+
+  if ((ret = rfc959_flush_queued_commands (request)) < 0)
+    return (ret);
+
+  parms->queued_responses--;
+  ret = rfc959_read_response (request, 1);
+
+  /* A server that throws away the commands that arrive before it is done
+     with the previous one never answers them. The connection times out
+     and the retry logs in again without pipelining. */
+  if (ret < 0 && ret != GFTP_ETIMEDOUT)
+    rfc959_disable_pipelining (request);
+
+  return (ret);
+}
+
+
+static int
+rfc959_discard_queued_responses (gftp_request * request)
+{
+  rfc959_parms * parms;
+  int ret;
+
+  parms = request->protocol_data;
+  while (parms->queued_responses > 0)
+    {
+      if ((ret = rfc959_read_queued_response (request)) < 0)
+        return (ret);
+    }
+
+  return (0);
+}
+
+
+int
+rfc959_send_command (gftp_request * request, const char *command, 
+                     ssize_t command_len, int read_response,
+                     int dont_try_to_reconnect)
+{
+  int ret;
+
+  g_return_val_if_fail (request != NULL, GFTP_EFATAL);
+  g_return_val_if_fail (command != NULL, GFTP_EFATAL);
+  g_return_val_if_fail (request->datafd > 0, GFTP_EFATAL);
+
+  if ((ret = rfc959_flush_queued_commands (request)) < 0)
+    return (ret);
+
+  rfc959_log_command (request, command);
 
   if (command_len == -1)
     command_len = strlen (command);
@@ -190,6 +321,10 @@ rfc959_send_command (gftp_request * request, const char *command,
 
   if (read_response)
     {
+      /* The replies to the pipelined commands come before ours */
+      if ((ret = rfc959_discard_queued_responses (request)) < 0)
+        return (ret);
+
       ret = rfc959_read_response (request, 1);
       if (ret == GFTP_ETIMEDOUT && !dont_try_to_reconnect)
         {
@@ -206,18 +341,16 @@ rfc959_send_command (gftp_request * request, const char *command,
     return (0);
 }
 
-static int
-rfc959_generate_and_send_command (gftp_request * request, const char *command,
-                                  const char *argument, int read_response,
-                                  int dont_try_to_reconnect)
+
+static char *
+rfc959_generate_command (gftp_request * request, const char *command,
+                         const char *argument, size_t *len)
 {
   char *tempstr, *utf8;
-  size_t len;
-  int resp;
 
   if (argument != NULL)
     {
-      utf8 = gftp_filename_from_utf8 (request, argument, &len);
+      utf8 = gftp_filename_from_utf8 (request, argument, len);
       if (utf8 != NULL)
         {
           tempstr = g_strconcat (command, " ", utf8, "\r\n", NULL);
@@ -226,17 +359,31 @@ rfc959_generate_and_send_command (gftp_request * request, const char *command,
       else
         {
           tempstr = g_strconcat (command, " ", argument, "\r\n", NULL);
-          len = strlen (argument);
+          *len = strlen (argument);
         }
 
-      len += strlen (command) + 3;
+      *len += strlen (command) + 3;
     }
   else
     {
       tempstr = g_strconcat (command, "\r\n", NULL);
-      len = strlen (command) + 2;
+      *len = strlen (command) + 2;
     }
 
+  return (tempstr);
+}
+
+
+static int
+rfc959_generate_and_send_command (gftp_request * request, const char *command,
+                                  const char *argument, int read_response,
+                                  int dont_try_to_reconnect)
+{
+  char *tempstr;
+  size_t len;
+  int resp;
+
+  tempstr = rfc959_generate_command (request, command, argument, &len);
   resp = rfc959_send_command (request, tempstr, len, read_response,
                               dont_try_to_reconnect);
   g_free (tempstr);
@@ -244,6 +391,30 @@ rfc959_generate_and_send_command (gftp_request * request, const char *command,
 }
 
 
+/* Sends the command together with the other queued commands without waiting
+   for its reply. The replies have to be read in the same order with
+   rfc959_read_queued_response(). */
+
+static void
+rfc959_queue_command (gftp_request * request, const char *command,
+                      const char *argument)
+{
+  rfc959_parms * parms;
+  char *tempstr;
+  size_t len;
+
+  parms = request->protocol_data;
+  if (parms->queued_commands == NULL)
+    parms->queued_commands = g_string_new (NULL);
+
+  tempstr = rfc959_generate_command (request, command, argument, &len);
+  rfc959_log_command (request, tempstr);
+  g_string_append_len (parms->queued_commands, tempstr, len);
+  parms->queued_responses++;
+  g_free (tempstr);
+}
+
+
 static char *
 parse_ftp_proxy_string (gftp_request * request)
 {
@@ -371,13 +542,11 @@ parse_ftp_proxy_string (gftp_request * request)
 
 
 static int
-rfc959_getcwd (gftp_request * request)
+rfc959_parse_pwd (gftp_request * request, int ret)
 {
   char *pos, *dir, *utf8;
   size_t destlen;
-  int ret;
 
-  ret = rfc959_send_command (request, "PWD\r\n", -1, 1, 0);
   if (ret < 0)
     return (ret);
   else if (ret != '2')
@@ -424,6 +593,16 @@ rfc959_getcwd (gftp_request * request)
 }
 
 
+static int
+rfc959_getcwd (gftp_request * request)
+{
+  int ret;
+
+  ret = rfc959_send_command (request, "PWD\r\n", -1, 1, 0);
+  return (rfc959_parse_pwd (request, ret));
+}
+
+
 static int
 rfc959_chdir (gftp_request * request, const char *directory)
 {
@@ -450,15 +629,10 @@ rfc959_chdir (gftp_request * request, const char *directory)
 
 
 static int
-rfc959_syst (gftp_request * request)
+rfc959_parse_syst (gftp_request * request, int ret)
 {
-  int ret, disable_ls_options;
   char *stpos, *endpos;
-
-  g_return_val_if_fail (request != NULL, GFTP_EFATAL);
-  g_return_val_if_fail (request->datafd > 0, GFTP_EFATAL);
-
-  ret = rfc959_send_command (request, "SYST\r\n", -1, 1, 0);
+  int disable_ls_options;
 
   if (ret < 0)
     return (ret);
@@ -507,6 +681,211 @@ rfc959_syst (gftp_request * request)
 }
 
 
+static int
+rfc959_syst (gftp_request * request)
+{
+  int ret;
+
+  g_return_val_if_fail (request != NULL, GFTP_EFATAL);
+  g_return_val_if_fail (request->datafd > 0, GFTP_EFATAL);
+
+  ret = rfc959_send_command (request, "SYST\r\n", -1, 1, 0);
+  return (rfc959_parse_syst (request, ret));
+}
+
+
+static void
+rfc959_free_response_lines (rfc959_parms * parms)
+{
+  GList * templist;
+
+  for (templist = parms->response_lines;
+       templist != NULL;
+       templist = templist->next)
+    g_free (templist->data);
+
+  g_list_free (parms->response_lines);
+  parms->response_lines = NULL;
+}
+
+
+static int
+rfc959_set_mlst_facts (gftp_request * request, char *facts)
+{
+  static const char *wanted_facts[] = { "type", "size", "sizd", "modify",
+                                        "perm", "UNIX.mode", "UNIX.owner",
+                                        "UNIX.ownername", "UNIX.group",
+                                        "UNIX.groupname", NULL };
+  char *pos, *endpos, *tempstr, *newstr;
+  int i, enabled, missing, ret;
+  size_t len;
+
+  /* The server marks the facts that it sends by default with a *. Ask for
+     the ones that we can use if some of them are turned off. */
+  tempstr = g_strdup ("OPTS MLST ");
+  missing = 0;
+
+  for (pos = facts; pos != NULL && *pos != '\0'; pos = endpos)
+    {
+      if ((endpos = strchr (pos, ';')) != NULL)
+        *endpos++ = '\0';
+
+      len = strlen (pos);
+      enabled = len > 0 && pos[len - 1] == '*';
+      if (enabled)
+        pos[len - 1] = '\0';
+
+      for (i = 0; wanted_facts[i] != NULL; i++)
+        if (strcasecmp (pos, wanted_facts[i]) == 0)
+          break;
+
+      if (wanted_facts[i] == NULL)
+        continue;
+
+      if (!enabled)
+        missing = 1;
+
+      newstr = g_strconcat (tempstr, pos, ";", NULL);
+      g_free (tempstr);
+      tempstr = newstr;
+    }
+
+  ret = 0;
+  if (missing)
+    {
+      newstr = g_strconcat (tempstr, "\r\n", NULL);
+      ret = rfc959_send_command (request, newstr, -1, 1, 0);
+      g_free (newstr);
+    }
+
+  g_free (tempstr);
+  return (ret < 0 ? ret : 0);
+}
+
+
+/* ret is the reply to FEAT. The features that the server listed are in
+   parms->response_lines */
+
+static int
+rfc959_parse_feat (gftp_request * request, int ret)
+{
+  intptr_t use_mlsd;
+  rfc959_parms * parms;
+  GList * templist;
+  char *feature;
+  int has_mlst;
+
+  parms = request->protocol_data;
+  parms->has_feat = 0;
+  parms->has_size = 0;
+  parms->use_mlst = 0;
+
+  if (ret != '2')
+    {
+      /* Older servers don't know about FEAT. This is not an error. */
+      rfc959_free_response_lines (parms);
+      return (ret < 0 ? ret : 0);
+    }
+
+  parms->has_feat = 1;
+  gftp_lookup_request_option (request, "use_mlsd", &use_mlsd);
+
+  has_mlst = 0;
+  for (templist = parms->response_lines;
+       templist != NULL;
+       templist = templist->next)
+    {
+      feature = templist->data;
+      if (strcasecmp (feature, "SIZE") == 0)
+        parms->has_size = 1;
+      else if (strncasecmp (feature, "MLST", 4) == 0 &&
+               (feature[4] == '\0' || feature[4] == ' '))
+        {
+          has_mlst = 1;
+          if (use_mlsd && feature[4] == ' ' &&
+              (ret = rfc959_set_mlst_facts (request, feature + 5)) < 0)
+            break;
+        }
+    }
+
+  rfc959_free_response_lines (parms);
+  if (ret < 0)
+    return (ret);
+
+  parms->use_mlst = has_mlst && use_mlsd;
+  return (0);
+}
+
+
+static int
+rfc959_feat (gftp_request * request)
+{
+  rfc959_parms * parms;
+  int ret;
+
+  parms = request->protocol_data;
+  parms->keep_response_lines = 1;
+  ret = rfc959_send_command (request, "FEAT\r\n", -1, 1, 0);
+  parms->keep_response_lines = 0;
+
+  return (rfc959_parse_feat (request, ret));
+}
+
+
+/* Sends the commands that follow the login all at once. If the directory
+   cannot be changed to, then PWD returns the login directory, which is
+   what rfc959_connect() falls back to as well. */
+
+static int
+rfc959_pipelined_login_setup (gftp_request * request, const char *type_command)
+{
+  int ret, feat_resp, cwd_sent;
+  rfc959_parms * parms;
+
+  parms = request->protocol_data;
+  cwd_sent = request->directory != NULL && *request->directory != '\0';
+
+  rfc959_queue_command (request, "FEAT", NULL);
+  rfc959_queue_command (request, "SYST", NULL);
+  rfc959_queue_command (request, type_command, NULL);
+  if (cwd_sent)
+    rfc959_queue_command (request, "CWD", request->directory);
+  rfc959_queue_command (request, "PWD", NULL);
+
+  parms->keep_response_lines = 1;
+  feat_resp = rfc959_read_queued_response (request);
+  parms->keep_response_lines = 0;
+  if (feat_resp < 0)
+    return (feat_resp);
+
+  if ((ret = rfc959_read_queued_response (request)) < 0)
+    return (ret);
+
+  if ((ret = rfc959_parse_syst (request, ret)) < 0 && request->datafd < 0)
+    return (ret);
+
+  if ((ret = rfc959_read_queued_response (request)) < 0)
+    return (ret);
+
+  if (cwd_sent && (ret = rfc959_read_queued_response (request)) < 0)
+    return (ret);
+
+  ret = rfc959_read_queued_response (request);
+  if ((ret = rfc959_parse_pwd (request, ret)) < 0)
+    return (ret);
+
+  /* This is done last since it might have to send OPTS MLST */
+  if ((ret = rfc959_parse_feat (request, feat_resp)) < 0 &&
+      request->datafd < 0)
+    return (ret);
+
+  if (request->datafd < 0)
+    return (GFTP_EFATAL);
+
+  return (0);
+}
+
+
 int
 rfc959_connect (gftp_request * request)
 {
@@ -522,6 +901,7 @@ rfc959_connect (gftp_request * request)
     return (0);
 
   parms = request->protocol_data;
+  parms->block_mode = 0;
 
   gftp_lookup_request_option (request, "ftp_proxy_host", &proxy_hostname);
   gftp_lookup_request_option (request, "ftp_proxy_port", &proxy_port);
@@ -583,10 +963,44 @@ rfc959_connect (gftp_request * request)
 	}
       g_free (tempstr);
     }
-  else
+  else if (rfc959_use_pipelining (request) && request->password != NULL)
     {
-      resp = rfc959_generate_and_send_command (request, "USER",
-                                               request->username, 1, 0);
+      /* Nearly every server asks for a password, so it is sent along with
+         the user name. A server that does not need it answers the PASS
+         with 503, and that reply is thrown away. */
+      rfc959_queue_command (request, "USER", request->username);
+      rfc959_queue_command (request, "PASS", request->password);
+
+      resp = rfc959_read_queued_response (request);
+      if (resp == '3')
+        {
+          resp = rfc959_read_queued_response (request);
+          if (resp == '5' && strncmp (request->last_ftp_response, "503", 3) == 0)
+            {
+              rfc959_disable_pipelining (request);
+              gftp_disconnect (request);
+              return (GFTP_ERETRYABLE);
+            }
+        }
+      else if (resp == '2' &&
+               (ret = rfc959_discard_queued_responses (request)) < 0)
+        return (ret);
+
+      if (resp < 0)
+        return (resp);
+
+      if (resp == '3' && request->account != NULL)
+	{
+          resp = rfc959_generate_and_send_command (request, "ACCT",
+                                                   request->account, 1, 0);
+          if (resp < 0)
+            return (resp);
+	}
+    }
+  else
+    {
+      resp = rfc959_generate_and_send_command (request, "USER",
+                                               request->username, 1, 0);
       if (resp < 0)
         return (resp);
 
@@ -617,22 +1031,29 @@ rfc959_connect (gftp_request * request)
         return (GFTP_ERETRYABLE);
     }
 
-  if ((ret = rfc959_syst (request)) < 0 && request->datafd < 0)
-    return (ret);
-
   gftp_lookup_request_option (request, "ascii_transfers", &ascii_transfers);
   if (ascii_transfers)
     {
-      tempstr = "TYPE A\r\n";
+      tempstr = "TYPE A";
       parms->is_ascii_transfer = 1;
     }
   else
     {
-      tempstr = "TYPE I\r\n";
+      tempstr = "TYPE I";
       parms->is_ascii_transfer = 0;
     }
 
-  if ((ret = rfc959_send_command (request, tempstr, -1, 1, 0)) < 0)
+  if (rfc959_use_pipelining (request))
+    return (rfc959_pipelined_login_setup (request, tempstr));
+
+  if ((ret = rfc959_feat (request)) < 0 && request->datafd < 0)
+    return (ret);
+
+  if ((ret = rfc959_syst (request)) < 0 && request->datafd < 0)
+    return (ret);
+
+  if ((ret = rfc959_generate_and_send_command (request, tempstr, NULL,
+                                               1, 0)) < 0)
     return (ret);
 
   ret = -1;
@@ -664,6 +1085,16 @@ rfc959_close_data_connection (gftp_request * request)
   g_return_if_fail (request != NULL);
 
   parms = request->protocol_data;
+
+#ifdef USE_SSL
+  if (parms->data_ssl != NULL)
+    {
+      SSL_shutdown (parms->data_ssl);
+      SSL_free (parms->data_ssl);
+      parms->data_ssl = NULL;
+    }
+#endif
+
   if (parms->data_connection != -1)
     {
       close (parms->data_connection);
@@ -675,8 +1106,16 @@ rfc959_close_data_connection (gftp_request * request)
 static void
 rfc959_disconnect (gftp_request * request)
 {
+  rfc959_parms * parms;
+
   g_return_if_fail (request != NULL);
 
+  parms = request->protocol_data;
+  parms->block_mode = 0;
+  parms->queued_responses = 0;
+  if (parms->queued_commands != NULL)
+    g_string_truncate (parms->queued_commands, 0);
+
   rfc959_close_data_connection (request);
   if (request->datafd > 0)
     {
@@ -689,18 +1128,18 @@ rfc959_disconnect (gftp_request * request)
 }
 
 
+/* Opens the socket for the data connection and returns the PASV or PORT
+   command that goes with it. rfc959_ipv4_data_connection_finish() takes
+   the reply to that command. */
+
 static int
-rfc959_ipv4_data_connection_new (gftp_request * request)
+rfc959_ipv4_data_connection_start (gftp_request * request, char **command)
 {
   struct sockaddr_in data_addr;
-  intptr_t ignore_pasv_address;
-  char *pos, *pos1, *command;
   intptr_t passive_transfer;
   rfc959_parms * parms;
   socklen_t data_addr_len;
-  unsigned int temp[6];
-  unsigned char ad[6];
-  int i, resp;
+  char *pos, *pos1;
 
   parms = request->protocol_data;
 
@@ -723,139 +1162,154 @@ rfc959_ipv4_data_connection_new (gftp_request * request)
       return (GFTP_ERETRYABLE);
     }
 
+  gftp_lookup_request_option (request, "passive_transfer", &passive_transfer);
+  if (passive_transfer)
+    {
+      *command = g_strdup ("PASV");
+      return (0);
+    }
+
   data_addr_len = sizeof (data_addr);
   memset (&data_addr, 0, data_addr_len);
   data_addr.sin_family = AF_INET;
 
-  gftp_lookup_request_option (request, "passive_transfer", &passive_transfer);
-  if (passive_transfer)
+  if (getsockname (request->datafd, (struct sockaddr *) &data_addr,
+                   &data_addr_len) == -1)
     {
-      resp = rfc959_send_command (request, "PASV\r\n", -1, 1, 1);
-      if (resp < 0)
-        return (resp);
-      else if (resp != '2')
-	{
-          gftp_set_request_option (request, "passive_transfer",
-                                   GINT_TO_POINTER(0));
-	  return (rfc959_ipv4_data_connection_new (request));
-	}
+      request->logging_function (gftp_logging_error, request,
+                                 _("Cannot get socket name: %s\n"),
+                                 g_strerror (errno));
+      gftp_disconnect (request);
+      return (GFTP_ERETRYABLE);
+    }
 
-      pos = request->last_ftp_response + 4;
-      while (!isdigit ((int) *pos) && *pos != '\0')
-        pos++;
+  data_addr.sin_port = 0;
+  if (bind (parms->data_connection, (struct sockaddr *) &data_addr, 
+            data_addr_len) == -1)
+    {
+      request->logging_function (gftp_logging_error, request,
+                                 _("Cannot bind a port: %s\n"),
+                                 g_strerror (errno));
+      gftp_disconnect (request);
+      return (GFTP_ERETRYABLE);
+    }
 
-      if (*pos == '\0')
-        {
-          request->logging_function (gftp_logging_error, request,
-                      _("Cannot find an IP address in PASV response '%s'\n"),
-                      request->last_ftp_response);
-          gftp_disconnect (request);
-          return (GFTP_EFATAL);
-        }
+  if (getsockname (parms->data_connection, (struct sockaddr *) &data_addr, 
+                   &data_addr_len) == -1)
+    {
+      request->logging_function (gftp_logging_error, request,
+                                 _("Cannot get socket name: %s\n"),
+                                 g_strerror (errno));
+      gftp_disconnect (request);
+      return (GFTP_ERETRYABLE);
+    }
 
-      if (sscanf (pos, "%u,%u,%u,%u,%u,%u", &temp[0], &temp[1], &temp[2],
-                  &temp[3], &temp[4], &temp[5]) != 6)
-        {
-          request->logging_function (gftp_logging_error, request,
-                      _("Cannot find an IP address in PASV response '%s'\n"),
-                      request->last_ftp_response);
-          gftp_disconnect (request);
-          return (GFTP_EFATAL);
-        }
+  if (listen (parms->data_connection, 1) == -1)
+    {
+      request->logging_function (gftp_logging_error, request,
+                                 _("Cannot listen on port %d: %s\n"),
+                                 ntohs (data_addr.sin_port),
+                                 g_strerror (errno));
+      gftp_disconnect (request);
+      return (GFTP_ERETRYABLE);
+    }
 
-      for (i = 0; i < 6; i++)
-        ad[i] = (unsigned char) (temp[i] & 0xff);
+  pos = (char *) &data_addr.sin_addr;
+  pos1 = (char *) &data_addr.sin_port;
+  *command = g_strdup_printf ("PORT %u,%u,%u,%u,%u,%u",
+                              pos[0] & 0xff, pos[1] & 0xff, pos[2] & 0xff,
+                              pos[3] & 0xff, pos1[0] & 0xff,
+                              pos1[1] & 0xff);
+  return (0);
+}
 
-      memcpy (&data_addr.sin_port, &ad[4], 2);
 
-      gftp_lookup_request_option (request, "ignore_pasv_address",
-                                  &ignore_pasv_address);
-      if (ignore_pasv_address)
-	{
-          memcpy (&data_addr.sin_addr, request->remote_addr,
-                  request->remote_addr_len);
+static int
+rfc959_ipv4_data_connection_finish (gftp_request * request, int resp)
+{
+  struct sockaddr_in data_addr;
+  intptr_t ignore_pasv_address;
+  intptr_t passive_transfer;
+  rfc959_parms * parms;
+  socklen_t data_addr_len;
+  unsigned int temp[6];
+  unsigned char ad[6];
+  char *pos;
+  int i;
 
-          pos = (char *) &data_addr.sin_addr;
-          request->logging_function (gftp_logging_error, request,
-               _("Ignoring IP address in PASV response, connecting to %d.%d.%d.%d:%d\n"),
-               pos[0] & 0xff, pos[1] & 0xff, pos[2] & 0xff, pos[3] & 0xff,
-               ntohs (data_addr.sin_port));
-        }
-      else
-        memcpy (&data_addr.sin_addr, &ad[0], 4);
+  parms = request->protocol_data;
 
-      if (connect (parms->data_connection, (struct sockaddr *) &data_addr, 
-                   data_addr_len) == -1)
-        {
+  gftp_lookup_request_option (request, "passive_transfer", &passive_transfer);
+  if (!passive_transfer)
+    {
+      if (resp != '2')
+	{
           request->logging_function (gftp_logging_error, request,
-                                    _("Cannot create a data connection: %s\n"),
-                                    g_strerror (errno));
+                                     _("Invalid response '%c' received from server.\n"),
+                                     resp);
           gftp_disconnect (request);
-          return (GFTP_ERETRYABLE);
+	  return (GFTP_ERETRYABLE);
 	}
+
+      return (0);
     }
-  else
+
+  data_addr_len = sizeof (data_addr);
+  memset (&data_addr, 0, data_addr_len);
+  data_addr.sin_family = AF_INET;
+
+  pos = request->last_ftp_response + 4;
+  while (!isdigit ((int) *pos) && *pos != '\0')
+    pos++;
+
+  if (*pos == '\0')
     {
-      if (getsockname (request->datafd, (struct sockaddr *) &data_addr,
-                       &data_addr_len) == -1)
-        {
-	  request->logging_function (gftp_logging_error, request,
-				     _("Cannot get socket name: %s\n"),
-				     g_strerror (errno));
-          gftp_disconnect (request);
-	  return (GFTP_ERETRYABLE);
-        }
+      request->logging_function (gftp_logging_error, request,
+                  _("Cannot find an IP address in PASV response '%s'\n"),
+                  request->last_ftp_response);
+      gftp_disconnect (request);
+      return (GFTP_EFATAL);
+    }
 
-      data_addr.sin_port = 0;
-      if (bind (parms->data_connection, (struct sockaddr *) &data_addr, 
-                data_addr_len) == -1)
-	{
-	  request->logging_function (gftp_logging_error, request,
-				     _("Cannot bind a port: %s\n"),
-				     g_strerror (errno));
-          gftp_disconnect (request);
-	  return (GFTP_ERETRYABLE);
-	}
+  if (sscanf (pos, "%u,%u,%u,%u,%u,%u", &temp[0], &temp[1], &temp[2],
+              &temp[3], &temp[4], &temp[5]) != 6)
+    {
+      request->logging_function (gftp_logging_error, request,
+                  _("Cannot find an IP address in PASV response '%s'\n"),
+                  request->last_ftp_response);
+      gftp_disconnect (request);
+      return (GFTP_EFATAL);
+    }
 
-      if (getsockname (parms->data_connection, (struct sockaddr *) &data_addr, 
-                       &data_addr_len) == -1)
-        {
-	  request->logging_function (gftp_logging_error, request,
-				     _("Cannot get socket name: %s\n"),
-				     g_strerror (errno));
-          gftp_disconnect (request);
-	  return (GFTP_ERETRYABLE);
-        }
+  for (i = 0; i < 6; i++)
+    ad[i] = (unsigned char) (temp[i] & 0xff);
 
-      if (listen (parms->data_connection, 1) == -1)
-	{
-	  request->logging_function (gftp_logging_error, request,
-				     _("Cannot listen on port %d: %s\n"),
-				     ntohs (data_addr.sin_port),
-				     g_strerror (errno));
-          gftp_disconnect (request);
-	  return (GFTP_ERETRYABLE);
-	}
+  memcpy (&data_addr.sin_port, &ad[4], 2);
+
+  gftp_lookup_request_option (request, "ignore_pasv_address",
+                              &ignore_pasv_address);
+  if (ignore_pasv_address)
+    {
+      memcpy (&data_addr.sin_addr, request->remote_addr,
+              request->remote_addr_len);
 
       pos = (char *) &data_addr.sin_addr;
-      pos1 = (char *) &data_addr.sin_port;
-      command = g_strdup_printf ("PORT %u,%u,%u,%u,%u,%u\r\n",
-				 pos[0] & 0xff, pos[1] & 0xff, pos[2] & 0xff,
-				 pos[3] & 0xff, pos1[0] & 0xff,
-				 pos1[1] & 0xff);
-      resp = rfc959_send_command (request, command, -1, 1, 1);
-      g_free (command);
+      request->logging_function (gftp_logging_error, request,
+           _("Ignoring IP address in PASV response, connecting to %d.%d.%d.%d:%d\n"),
+           pos[0] & 0xff, pos[1] & 0xff, pos[2] & 0xff, pos[3] & 0xff,
+           ntohs (data_addr.sin_port));
+    }
+  else
+    memcpy (&data_addr.sin_addr, &ad[0], 4);
 
-      if (resp < 0)
-        return (resp);
-      else if (resp != '2')
-	{
-          request->logging_function (gftp_logging_error, request,
-                                     _("Invalid response '%c' received from server.\n"),
-                                     resp);
-          gftp_disconnect (request);
-	  return (GFTP_ERETRYABLE);
-	}
+  if (connect (parms->data_connection, (struct sockaddr *) &data_addr, 
+               data_addr_len) == -1)
+    {
+      request->logging_function (gftp_logging_error, request,
+                                _("Cannot create a data connection: %s\n"),
+                                g_strerror (errno));
+      gftp_disconnect (request);
+      return (GFTP_ERETRYABLE);
     }
 
   return (0);
@@ -865,14 +1319,12 @@ rfc959_ipv4_data_connection_new (gftp_request * request)
 #ifdef HAVE_IPV6
 
 static int
-rfc959_ipv6_data_connection_new (gftp_request * request)
+rfc959_ipv6_data_connection_start (gftp_request * request, char **command)
 {
   struct sockaddr_in6 data_addr;
-  char *pos, buf[64], *command;
   intptr_t passive_transfer;
   rfc959_parms * parms;
-  unsigned int port;
-  int resp;
+  char buf[64];
 
   parms = request->protocol_data;
   if ((parms->data_connection = socket (AF_INET6, SOCK_STREAM, IPPROTO_TCP)) < 0)
@@ -902,114 +1354,117 @@ rfc959_ipv6_data_connection_new (gftp_request * request)
       return (GFTP_EFATAL);
     }
 
-  memset (&data_addr, 0, sizeof (data_addr));
-  data_addr.sin6_family = AF_INET6;
-
   gftp_lookup_request_option (request, "passive_transfer", &passive_transfer);
   if (passive_transfer)
     {
-      resp = rfc959_send_command (request, "EPSV\r\n", -1, 1, 1);
-      if (resp < 0)
-        return (resp);
-      else if (resp != '2')
-	{
-          gftp_set_request_option (request, "passive_transfer", 
-                                   GINT_TO_POINTER(0));
-	  return (rfc959_ipv6_data_connection_new (request));
-	}
+      *command = g_strdup ("EPSV");
+      return (0);
+    }
 
-      pos = request->last_ftp_response + 4;
-      while (*pos != '(' && *pos != '\0')
-        pos++;
+  memcpy (&data_addr, request->remote_addr, request->remote_addr_len);
+  data_addr.sin6_port = 0;
 
-      if (*pos == '\0' || *(pos + 1) == '\0')
-        {
-          request->logging_function (gftp_logging_error, request,
-                      _("Invalid EPSV response '%s'\n"),
-                      request->last_ftp_response);
-          gftp_disconnect (request);
-          return (GFTP_EFATAL);
-        }
-
-      if (sscanf (pos + 1, "|||%u|", &port) != 1)
-        {
-          request->logging_function (gftp_logging_error, request,
-                      _("Invalid EPSV response '%s'\n"),
-                      request->last_ftp_response);
-          gftp_disconnect (request);
-          return (GFTP_EFATAL);
-        }
+  if (bind (parms->data_connection, (struct sockaddr *) &data_addr, 
+            request->remote_addr_len) == -1)
+    {
+      request->logging_function (gftp_logging_error, request,
+                                 _("Cannot bind a port: %s\n"),
+                                 g_strerror (errno));
+      gftp_disconnect (request);
+      return (GFTP_ERETRYABLE);
+    }
 
-      memcpy (&data_addr, request->remote_addr, request->remote_addr_len);
-      data_addr.sin6_port = htons (port);
+  if (getsockname (parms->data_connection, (struct sockaddr *) &data_addr, 
+                   &request->remote_addr_len) == -1)
+    {
+      request->logging_function (gftp_logging_error, request,
+                                 _("Cannot get socket name: %s\n"),
+                                 g_strerror (errno));
+      gftp_disconnect (request);
+      return (GFTP_ERETRYABLE);
+    }
 
-      if (connect (parms->data_connection, (struct sockaddr *) &data_addr, 
-                   request->remote_addr_len) == -1)
-        {
-          request->logging_function (gftp_logging_error, request,
-                                    _("Cannot create a data connection: %s\n"),
-                                    g_strerror (errno));
-          gftp_disconnect (request);
-          return (GFTP_ERETRYABLE);
-	}
+  if (listen (parms->data_connection, 1) == -1)
+    {
+      request->logging_function (gftp_logging_error, request,
+                                 _("Cannot listen on port %d: %s\n"),
+                                 ntohs (data_addr.sin6_port),
+                                 g_strerror (errno));
+      gftp_disconnect (request);
+      return (GFTP_ERETRYABLE);
     }
-  else
+
+  if (inet_ntop (AF_INET6, &data_addr.sin6_addr, buf, sizeof (buf)) == NULL)
     {
-      memcpy (&data_addr, request->remote_addr, request->remote_addr_len);
-      data_addr.sin6_port = 0;
+      request->logging_function (gftp_logging_error, request,
+                                 _("Cannot get address of local socket: %s\n"),
+                                 g_strerror (errno));
+      gftp_disconnect (request);
+      return (GFTP_ERETRYABLE);
+    }
 
-      if (bind (parms->data_connection, (struct sockaddr *) &data_addr, 
-                request->remote_addr_len) == -1)
-	{
-	  request->logging_function (gftp_logging_error, request,
-				     _("Cannot bind a port: %s\n"),
-				     g_strerror (errno));
-          gftp_disconnect (request);
-	  return (GFTP_ERETRYABLE);
-	}
+  *command = g_strdup_printf ("EPRT |2|%s|%d|", buf,
+                              ntohs (data_addr.sin6_port));
+  return (0);
+}
 
-      if (getsockname (parms->data_connection, (struct sockaddr *) &data_addr, 
-                       &request->remote_addr_len) == -1)
-        {
-          request->logging_function (gftp_logging_error, request,
-				     _("Cannot get socket name: %s\n"),
-				     g_strerror (errno));
-          gftp_disconnect (request);
-	  return (GFTP_ERETRYABLE);
-        }
 
-      if (listen (parms->data_connection, 1) == -1)
+static int
+rfc959_ipv6_data_connection_finish (gftp_request * request, int resp)
+{
+  struct sockaddr_in6 data_addr;
+  intptr_t passive_transfer;
+  rfc959_parms * parms;
+  unsigned int port;
+  char *pos;
+
+  parms = request->protocol_data;
+
+  gftp_lookup_request_option (request, "passive_transfer", &passive_transfer);
+  if (!passive_transfer)
+    {
+      if (resp != '2')
 	{
-	  request->logging_function (gftp_logging_error, request,
-				     _("Cannot listen on port %d: %s\n"),
-				     ntohs (data_addr.sin6_port),
-				     g_strerror (errno));
           gftp_disconnect (request);
 	  return (GFTP_ERETRYABLE);
 	}
 
-      if (inet_ntop (AF_INET6, &data_addr.sin6_addr, buf, sizeof (buf)) == NULL)
-        {
-          request->logging_function (gftp_logging_error, request,
-				     _("Cannot get address of local socket: %s\n"),
-				     g_strerror (errno));
-          gftp_disconnect (request);
-	  return (GFTP_ERETRYABLE);
-        }
+      return (0);
+    }
 
-      command = g_strdup_printf ("EPRT |2|%s|%d|\n", buf,
-                                 ntohs (data_addr.sin6_port));
+  pos = request->last_ftp_response + 4;
+  while (*pos != '(' && *pos != '\0')
+    pos++;
 
-      resp = rfc959_send_command (request, command, -1, 1, 1);
-      g_free (command);
+  if (*pos == '\0' || *(pos + 1) == '\0')
+    {
+      request->logging_function (gftp_logging_error, request,
+                  _("Invalid EPSV response '%s'\n"),
+                  request->last_ftp_response);
+      gftp_disconnect (request);
+      return (GFTP_EFATAL);
+    }
 
-      if (resp < 0)
-        return (resp);
-      else if (resp != '2')
-	{
-          gftp_disconnect (request);
-	  return (GFTP_ERETRYABLE);
-	}
+  if (sscanf (pos + 1, "|||%u|", &port) != 1)
+    {
+      request->logging_function (gftp_logging_error, request,
+                  _("Invalid EPSV response '%s'\n"),
+                  request->last_ftp_response);
+      gftp_disconnect (request);
+      return (GFTP_EFATAL);
+    }
+
+  memcpy (&data_addr, request->remote_addr, request->remote_addr_len);
+  data_addr.sin6_port = htons (port);
+
+  if (connect (parms->data_connection, (struct sockaddr *) &data_addr, 
+               request->remote_addr_len) == -1)
+    {
+      request->logging_function (gftp_logging_error, request,
+                                _("Cannot create a data connection: %s\n"),
+                                g_strerror (errno));
+      gftp_disconnect (request);
+      return (GFTP_ERETRYABLE);
     }
 
   return (0);
@@ -1018,22 +1473,66 @@ rfc959_ipv6_data_connection_new (gftp_request * request)
 #endif /* HAVE_IPV6 */
 
 
+static int
+rfc959_data_connection_start (gftp_request * request, char **command)
+{
+#ifdef HAVE_IPV6
+  if (request->ai_family == AF_INET6)
+    return (rfc959_ipv6_data_connection_start (request, command));
+#endif
+
+  return (rfc959_ipv4_data_connection_start (request, command));
+}
+
+
+/* resp is the reply to the command from rfc959_data_connection_start().
+   Returns 1 if the server refused a passive transfer. The data connection
+   then has to be started over, with the server connecting to us. */
+
+static int
+rfc959_data_connection_finish (gftp_request * request, int resp)
+{
+  intptr_t passive_transfer;
+
+  gftp_lookup_request_option (request, "passive_transfer", &passive_transfer);
+  if (passive_transfer && resp != '2')
+    {
+      rfc959_close_data_connection (request);
+      gftp_set_request_option (request, "passive_transfer",
+                               GINT_TO_POINTER(0));
+      return (1);
+    }
+
+#ifdef HAVE_IPV6
+  if (request->ai_family == AF_INET6)
+    return (rfc959_ipv6_data_connection_finish (request, resp));
+#endif
+
+  return (rfc959_ipv4_data_connection_finish (request, resp));
+}
+
+
 static int
 rfc959_data_connection_new (gftp_request * request, int dont_try_to_reconnect)
 {
+  char *command;
   int ret;
 
   g_return_val_if_fail (request != NULL, GFTP_EFATAL);
   g_return_val_if_fail (request->datafd > 0, GFTP_EFATAL);
 
-#ifdef HAVE_IPV6
-  if (request->ai_family == AF_INET6)
-    ret = rfc959_ipv6_data_connection_new (request);
-  else
-    ret = rfc959_ipv4_data_connection_new (request);
-#else
-  ret = rfc959_ipv4_data_connection_new (request);
-#endif
+  do
+    {
+      if ((ret = rfc959_data_connection_start (request, &command)) < 0)
+        break;
+
+      ret = rfc959_generate_and_send_command (request, command, NULL, 1, 1);
+      g_free (command);
+
+      if (ret >= 0)
+        ret = rfc959_data_connection_finish (request, ret);
+    }
+  while (ret == 1);
 
   if (ret == GFTP_ETIMEDOUT && !dont_try_to_reconnect)
     {
@@ -1063,38 +1562,244 @@ rfc959_accept_active_connection (gftp_request * request)
 
   parms = request->protocol_data;
 
-  g_return_val_if_fail (request != NULL, GFTP_EFATAL);
-  g_return_val_if_fail (parms->data_connection > 0, GFTP_EFATAL);
+  g_return_val_if_fail (request != NULL, GFTP_EFATAL);
+  g_return_val_if_fail (parms->data_connection > 0, GFTP_EFATAL);
+
+  gftp_lookup_request_option (request, "passive_transfer", &passive_transfer);
+  g_return_val_if_fail (!passive_transfer, GFTP_EFATAL);
+
+  cli_addr_len = sizeof (cli_addr);
+
+  if ((ret = gftp_fd_set_sockblocking (request, parms->data_connection, 0)) < 0)
+    return (ret);
+
+  if ((infd = accept (parms->data_connection, (struct sockaddr *) &cli_addr,
+       &cli_addr_len)) == -1)
+    {
+      request->logging_function (gftp_logging_error, request,
+                                _("Cannot accept connection from server: %s\n"),
+                                g_strerror (errno));
+      gftp_disconnect (request);
+      return (GFTP_ERETRYABLE);
+    }
+
+  close (parms->data_connection);
+  parms->data_connection = infd;
+
+  if ((ret = gftp_fd_set_sockblocking (request, parms->data_connection, 1)) < 0)
+    return (ret);
+
+  return (0);
+}
+
+
+static int
+rfc959_use_block_mode (gftp_request * request)
+{
+  intptr_t ftp_block_mode;
+  rfc959_parms * parms;
+
+  parms = request->protocol_data;
+  if (parms->no_block_mode)
+    return (0);
+
+  gftp_lookup_request_option (request, "ftp_block_mode", &ftp_block_mode);
+  return (ftp_block_mode);
+}
+
+
+/* Switches the server between stream mode and block mode. A server that
+   refuses MODE B is not asked again. */
+
+static int
+rfc959_set_block_mode (gftp_request * request, int block_mode)
+{
+  rfc959_parms * parms;
+  int ret;
+
+  parms = request->protocol_data;
+  if (parms->block_mode == block_mode)
+    return (0);
+
+  rfc959_close_data_connection (request);
+
+  ret = rfc959_send_command (request, block_mode ? "MODE B\r\n" : "MODE S\r\n",
+                             -1, 1, 0);
+  if (ret < 0)
+    return (ret);
+  else if (ret == '2')
+    parms->block_mode = block_mode;
+  else if (block_mode)
+    parms->no_block_mode = 1;
+  else
+    {
+      /* The server would keep sending blocks that we do not expect */
+      gftp_disconnect (request);
+      return (GFTP_ERETRYABLE);
+    }
+
+  return (0);
+}
+
+
+/* Puts the server in the transfer mode that the next transfer is going to
+   use. Returns 1 if the data connection from the last block mode transfer
+   is still open and can be used again, or 0 if a new one is needed. */
+
+static int
+rfc959_reuse_data_connection (gftp_request * request, int block_mode)
+{
+  rfc959_parms * parms;
+  struct timeval tv;
+  fd_set fset;
+  int ret;
+
+  parms = request->protocol_data;
+
+  if ((ret = rfc959_set_block_mode (request, block_mode &&
+                                    rfc959_use_block_mode (request))) < 0)
+    return (ret);
+
+  parms->block_remaining = 0;
+  parms->block_eof = 0;
+  parms->block_sending = 0;
+
+  if (parms->data_connection < 0)
+    return (0);
+
+  /* Nothing is sent over an idle data connection. If it is readable, then
+     the server closed it after the last transfer. */
+  FD_ZERO (&fset);
+  FD_SET (parms->data_connection, &fset);
+  tv.tv_sec = tv.tv_usec = 0;
+  if (!parms->block_mode ||
+      select (parms->data_connection + 1, &fset, NULL, NULL, &tv) != 0)
+    {
+      rfc959_close_data_connection (request);
+      return (0);
+    }
+
+  return (1);
+}
+
+
+static int
+rfc959_read_block_bytes (gftp_request * request, char *buf, size_t size,
+                         int fd)
+{
+  rfc959_parms * parms;
+  ssize_t num_read;
+
+  parms = request->protocol_data;
+  while (size > 0)
+    {
+      num_read = parms->data_conn_read (request, buf, size, fd);
+      if (num_read < 0)
+        return (num_read);
+      else if (num_read == 0)
+        {
+          request->logging_function (gftp_logging_error, request,
+                                     _("The data connection was closed in the middle of a block\n"));
+          return (GFTP_ERETRYABLE);
+        }
+
+      buf += num_read;
+      size -= num_read;
+    }
+
+  return (0);
+}
+
+
+/* Used in place of data_conn_read() in block mode. Strips the block headers
+   and returns 0 at the end of the EOF block. */
+
+static ssize_t
+rfc959_block_read (gftp_request * request, void *ptr, size_t size, int fd)
+{
+  unsigned char header[3];
+  rfc959_parms * parms;
+  char marker[256];
+  size_t count, len;
+  ssize_t num_read;
+  int ret;
+
+  parms = request->protocol_data;
+  while (parms->block_remaining == 0)
+    {
+      if (parms->block_eof)
+        return (0);
+
+      if ((ret = rfc959_read_block_bytes (request, (char *) header,
+                                          sizeof (header), fd)) < 0)
+        return (ret);
 
-  gftp_lookup_request_option (request, "passive_transfer", &passive_transfer);
-  g_return_val_if_fail (!passive_transfer, GFTP_EFATAL);
+      count = (header[1] << 8) | header[2];
+      if (header[0] & RFC959_BLOCK_EOF)
+        parms->block_eof = 1;
 
-  cli_addr_len = sizeof (cli_addr);
+      if (header[0] & RFC959_BLOCK_RESTART)
+        {
+          /* Restart markers are not file data */
+          for (; count > 0; count -= len)
+            {
+              len = count < sizeof (marker) ? count : sizeof (marker);
+              if ((ret = rfc959_read_block_bytes (request, marker, len,
+                                                  fd)) < 0)
+                return (ret);
+            }
+        }
+      else
+        parms->block_remaining = count;
+    }
 
-  if ((ret = gftp_fd_set_sockblocking (request, parms->data_connection, 0)) < 0)
-    return (ret);
+  if (size > parms->block_remaining)
+    size = parms->block_remaining;
 
-  if ((infd = accept (parms->data_connection, (struct sockaddr *) &cli_addr,
-       &cli_addr_len)) == -1)
+  num_read = parms->data_conn_read (request, ptr, size, fd);
+  if (num_read == 0)
     {
       request->logging_function (gftp_logging_error, request,
-                                _("Cannot accept connection from server: %s\n"),
-                                g_strerror (errno));
-      gftp_disconnect (request);
+                                 _("The data connection was closed in the middle of a block\n"));
       return (GFTP_ERETRYABLE);
     }
+  else if (num_read > 0)
+    parms->block_remaining -= num_read;
 
-  close (parms->data_connection);
-  parms->data_connection = infd;
+  return (num_read);
+}
 
-  if ((ret = gftp_fd_set_sockblocking (request, parms->data_connection, 1)) < 0)
-    return (ret);
 
-  return (0);
+/* Used in place of data_conn_write() in block mode. The header is written
+   together with the data so that they go out in the same packet. */
+
+static ssize_t
+rfc959_block_write (gftp_request * request, const char *ptr, size_t size,
+                    int fd)
+{
+  rfc959_parms * parms;
+  ssize_t num_wrote;
+  char *buf;
+
+  parms = request->protocol_data;
+
+  if (size > RFC959_BLOCK_MAX)
+    size = RFC959_BLOCK_MAX;
+
+  buf = g_malloc (size + 3);
+  buf[0] = 0;
+  buf[1] = (size >> 8) & 0xff;
+  buf[2] = size & 0xff;
+  memcpy (buf + 3, ptr, size);
+
+  num_wrote = parms->data_conn_write (request, buf, size + 3, fd);
+  g_free (buf);
+
+  return (num_wrote < 0 ? num_wrote : (ssize_t) size);
 }
 
 
-static unsigned int
+unsigned int
 rfc959_is_ascii_transfer (gftp_request * request, const char *filename)
 {
   gftp_config_list_vars * tmplistvar;
@@ -1126,34 +1831,151 @@ rfc959_is_ascii_transfer (gftp_request * request, const char *filename)
 }
 
 
-static int
-rfc959_set_data_type (gftp_request * request, const char *filename)
+/* Returns the data connection if the file data goes over it unmodified, so
+   that it can be passed to gftp_fd_splice(). Returns -1 for ascii, FXP and
+   block mode transfers, and for encrypted ones unless kernel TLS does the
+   encryption of an upload. */
+
+int
+rfc959_get_plain_data_fd (gftp_request * request)
+{
+  rfc959_parms * parms;
+
+  g_return_val_if_fail (request != NULL, -1);
+  g_return_val_if_fail (request->protonum == GFTP_FTP_NUM ||
+                        request->protonum == GFTP_FTPS_NUM, -1);
+
+  parms = request->protocol_data;
+  if (parms->data_connection < 0 || parms->is_ascii_transfer ||
+      parms->is_fxp_transfer || parms->block_mode)
+    return (-1);
+
+#ifdef USE_SSL
+  /* With kernel TLS the data can be written to the socket as it is, but it
+     still has to be read through OpenSSL */
+  if (parms->data_ssl != NULL)
+    return (parms->block_sending ?
+            gftp_ssl_get_ktls_send_fd (parms->data_ssl) : -1);
+#endif
+
+  if (parms->data_conn_read != gftp_fd_read ||
+      parms->data_conn_write != gftp_fd_write)
+    return (-1);
+
+  return (parms->data_connection);
+}
+
+
+/* Returns the TYPE command that is needed before the file can be
+   transferred, or NULL if the data type is right already */
+
+static const char *
+rfc959_data_type_command (gftp_request * request, const char *filename)
 {
   unsigned int new_ascii;
   rfc959_parms * parms;
-  char *tempstr;
+
+  parms = request->protocol_data;
+  new_ascii = rfc959_is_ascii_transfer (request, filename);
+
+  if (new_ascii == parms->is_ascii_transfer)
+    return (NULL);
+
+  parms->is_ascii_transfer = new_ascii;
+  return (new_ascii ? "TYPE A" : "TYPE I");
+}
+
+
+static int
+rfc959_set_data_type (gftp_request * request, const char *filename)
+{
+  const char *tempstr;
   int ret;
 
   g_return_val_if_fail (request != NULL, GFTP_EFATAL);
 
-  parms = request->protocol_data;
-  new_ascii = rfc959_is_ascii_transfer (request, filename);
+  if (request->datafd > 0 &&
+      (tempstr = rfc959_data_type_command (request, filename)) != NULL)
+    {
+      if ((ret = rfc959_generate_and_send_command (request, tempstr, NULL,
+                                                   1, 0)) < 0)
+        return (ret);
+    }
+
+  return (0);
+}
+
+
+/* Sends TYPE, PRET, PASV or PORT and REST together. The transfer command
+   itself is not sent along with them since the server would start the
+   transfer from the beginning of the file if it refused the REST. Returns
+   1 if the data connection has to be set up one command at a time
+   instead. */
+
+static int
+rfc959_pipelined_transfer_setup (gftp_request * request, const char *filename,
+                                 off_t startsize, const char *transfer_command)
+{
+  intptr_t passive_transfer, pretransfer;
+  const char *type_command;
+  char *command, *tempstr;
+  int ret, pret_sent;
+
+  if ((ret = rfc959_data_connection_start (request, &command)) < 0)
+    return (ret);
+
+  gftp_lookup_request_option (request, "pretransfer_command", &pretransfer);
+  gftp_lookup_request_option (request, "passive_transfer", &passive_transfer);
+  pret_sent = passive_transfer && pretransfer;
+
+  if ((type_command = rfc959_data_type_command (request, filename)) != NULL)
+    rfc959_queue_command (request, type_command, NULL);
 
-  if (request->datafd > 0 && new_ascii != parms->is_ascii_transfer)
+  if (pret_sent)
     {
-      if (new_ascii)
-        {
-	  tempstr = "TYPE A\r\n";
-          parms->is_ascii_transfer = 1;
-        }
-      else
-        {
-	  tempstr = "TYPE I\r\n";
-          parms->is_ascii_transfer = 0;
-        }
+      tempstr = g_strconcat ("PRET ", transfer_command, NULL);
+      rfc959_queue_command (request, tempstr, filename);
+      g_free (tempstr);
+    }
+
+  rfc959_queue_command (request, command, NULL);
+  g_free (command);
+
+  if (startsize > 0)
+    {
+      tempstr = g_strdup_printf ("REST " GFTP_OFF_T_PRINTF_MOD, startsize);
+      rfc959_queue_command (request, tempstr, NULL);
+      g_free (tempstr);
+    }
+
+  /* The replies to TYPE and PRET are not checked when they are sent one at
+     a time either */
+  if (type_command != NULL && (ret = rfc959_read_queued_response (request)) < 0)
+    return (ret);
+
+  if (pret_sent && (ret = rfc959_read_queued_response (request)) < 0)
+    return (ret);
+
+  if ((ret = rfc959_read_queued_response (request)) < 0)
+    return (ret);
+
+  if ((ret = rfc959_data_connection_finish (request, ret)) != 0)
+    {
+      if (ret == 1 && (ret = rfc959_discard_queued_responses (request)) == 0)
+        return (1);
+
+      return (ret);
+    }
 
-      if ((ret = rfc959_send_command (request, tempstr, -1, 1, 0)) < 0)
+  if (startsize > 0)
+    {
+      if ((ret = rfc959_read_queued_response (request)) < 0)
         return (ret);
+      else if (ret != '3')
+        {
+          rfc959_close_data_connection (request);
+	  return (GFTP_ERETRYABLE);
+        }
     }
 
   return (0);
@@ -1164,39 +1986,71 @@ static int
 rfc959_setup_file_transfer (gftp_request * request, const char *filename,
                             off_t startsize, char *transfer_command)
 {
-  intptr_t passive_transfer;
+  intptr_t passive_transfer, pretransfer;
   rfc959_parms * parms;
+  int ret, reused;
   char *command;
-  int ret;
 
   parms = request->protocol_data;
 
-  if ((ret = rfc959_set_data_type (request, filename)) < 0)
-    return (ret);
+  /* Block mode restarts use markers instead of byte offsets, so resumed
+     transfers are done in stream mode */
+  if ((reused = rfc959_reuse_data_connection (request, startsize == 0)) < 0)
+    return (reused);
 
-  if (parms->data_connection < 0 && 
-      (ret = rfc959_data_connection_new (request, 0)) < 0)
-    return (ret);
+  parms->block_sending = strcmp (transfer_command, "STOR") == 0;
 
-  if ((ret = gftp_fd_set_sockblocking (request, parms->data_connection, 1)) < 0)
-    return (ret);
+  ret = 1;
+  if (!reused && rfc959_use_pipelining (request))
+    ret = rfc959_pipelined_transfer_setup (request, filename, startsize,
+                                           transfer_command);
 
-  if (startsize > 0)
+  if (ret < 0)
+    return (ret);
+  else if (ret == 1)
     {
-      command = g_strdup_printf ("REST " GFTP_OFF_T_PRINTF_MOD "\r\n",
-                                 startsize);
-      ret = rfc959_send_command (request, command, -1, 1, 0);
-      g_free (command);
+      if ((ret = rfc959_set_data_type (request, filename)) < 0)
+        return (ret);
 
-      if (ret < 0)
+      gftp_lookup_request_option (request, "pretransfer_command",
+                                  &pretransfer);
+      gftp_lookup_request_option (request, "passive_transfer",
+                                  &passive_transfer);
+      if (!reused && passive_transfer && pretransfer)
+        {
+          command = g_strconcat ("PRET ", transfer_command, NULL);
+          ret = rfc959_generate_and_send_command (request, command, filename,
+                                                  1, 0);
+          g_free (command);
+        }
+
+      if (parms->data_connection < 0 && 
+          (ret = rfc959_data_connection_new (request, 0)) < 0)
         return (ret);
-      else if (ret != '3')
+
+      if (startsize > 0)
         {
-          rfc959_close_data_connection (request);
-	  return (GFTP_ERETRYABLE);
+          command = g_strdup_printf ("REST " GFTP_OFF_T_PRINTF_MOD "\r\n",
+                                     startsize);
+          ret = rfc959_send_command (request, command, -1, 1, 0);
+          g_free (command);
+
+          if (ret < 0)
+            return (ret);
+          else if (ret != '3')
+            {
+              rfc959_close_data_connection (request);
+	      return (GFTP_ERETRYABLE);
+            }
         }
     }
 
+  /* A reused connection is still set up the way the last transfer left it.
+     With PROT P that is blocking, since SSL needs it. */
+  if (!reused &&
+      (ret = gftp_fd_set_sockblocking (request, parms->data_connection, 1)) < 0)
+    return (ret);
+
   ret = rfc959_generate_and_send_command (request, transfer_command, filename,
                                           1, 0);
   if (ret < 0)
@@ -1212,10 +2066,14 @@ rfc959_setup_file_transfer (gftp_request * request, const char *filename,
     }
 
   gftp_lookup_request_option (request, "passive_transfer", &passive_transfer);
-  if (!passive_transfer &&
+  if (!passive_transfer && !reused &&
       (ret = rfc959_accept_active_connection (request)) < 0)
     return (ret);
 
+  if (parms->data_conn_setup != NULL &&
+      (ret = parms->data_conn_setup (request)) < 0)
+    return (ret);
+
   return (0);
 }
 
@@ -1226,20 +2084,11 @@ rfc959_get_file (gftp_request * request, const char *filename,
 {
   char *tempstr;
   int ret;
-  intptr_t pretransfer;
-  intptr_t passive_transfer;
 
   g_return_val_if_fail (request != NULL, GFTP_EFATAL);
   g_return_val_if_fail (filename != NULL, GFTP_EFATAL);
   g_return_val_if_fail (request->datafd > 0, GFTP_EFATAL);
 
-  gftp_lookup_request_option (request, "pretransfer_command", &pretransfer);
-  gftp_lookup_request_option (request, "passive_transfer", &passive_transfer);
-
-  if (passive_transfer && pretransfer){
-  ret = rfc959_generate_and_send_command (request, "PRET RETR", filename,1, 0);
-  }
-
   ret = rfc959_setup_file_transfer (request, filename, startsize, "RETR");
   if (ret < 0)
     return (ret);
@@ -1261,30 +2110,10 @@ static int
 rfc959_put_file (gftp_request * request, const char *filename,
                  off_t startsize, off_t totalsize)
 {
-  rfc959_parms * parms;
-  int ret;
-  intptr_t pretransfer;
-  intptr_t passive_transfer;
-
   g_return_val_if_fail (request != NULL, GFTP_EFATAL);
   g_return_val_if_fail (filename != NULL, GFTP_EFATAL);
   g_return_val_if_fail (request->datafd > 0, GFTP_EFATAL);
 
-  if ((ret = rfc959_set_data_type (request, filename)) < 0)
-    return (ret);
-
-  gftp_lookup_request_option (request, "pretransfer_command", &pretransfer);
-  gftp_lookup_request_option (request, "passive_transfer", &passive_transfer);
-
-  if (passive_transfer && pretransfer){
-  ret = rfc959_generate_and_send_command (request, "PRET STOR", filename,1, 0);
-  }
-
-  parms = request->protocol_data;
-  if (parms->data_connection < 0 && 
-      (ret = rfc959_data_connection_new (request, 0)) < 0)
-    return (ret);
-
   return (rfc959_setup_file_transfer (request, filename, startsize, "STOR"));
 }
 
@@ -1305,6 +2134,11 @@ rfc959_transfer_file (gftp_request *fromreq, const char *fromfile,
   g_return_val_if_fail (fromreq->datafd > 0, GFTP_EFATAL);
   g_return_val_if_fail (toreq->datafd > 0, GFTP_EFATAL);
 
+  /* Both servers have to use the same mode. Stream mode works everywhere. */
+  if ((ret = rfc959_set_block_mode (fromreq, 0)) < 0 ||
+      (ret = rfc959_set_block_mode (toreq, 0)) < 0)
+    return (ret);
+
   if ((ret = rfc959_send_command (fromreq, "PASV\r\n", -1, 1, 0)) < 0)
     return (ret);
   else if (ret != '2')
@@ -1359,15 +2193,33 @@ static int
 rfc959_end_transfer (gftp_request * request)
 {
   rfc959_parms * parms;
+  char header[3];
   int ret;
 
   g_return_val_if_fail (request != NULL, GFTP_EFATAL);
   g_return_val_if_fail (request->datafd > 0, GFTP_EFATAL);
 
   parms = request->protocol_data;
+
+  /* In block mode the data connection is kept for the next transfer once
+     the EOF block went across */
+  if (parms->block_mode && parms->block_sending && !parms->block_eof &&
+      !parms->is_fxp_transfer && parms->data_connection >= 0)
+    {
+      header[0] = RFC959_BLOCK_EOF;
+      header[1] = header[2] = 0;
+      if (parms->data_conn_write (request, header, sizeof (header),
+                                  parms->data_connection) == sizeof (header))
+        parms->block_eof = 1;
+    }
+
+  if (!parms->block_mode || !parms->block_eof || parms->is_fxp_transfer)
+    rfc959_close_data_connection (request);
+
   parms->is_fxp_transfer = 0;
 
-  rfc959_close_data_connection (request);
+  if (request->datafd < 0)
+    return (GFTP_ERETRYABLE);
 
   ret = rfc959_read_response (request, 1);
 
@@ -1376,7 +2228,10 @@ rfc959_end_transfer (gftp_request * request)
   else if (ret == '2')
     return (0);
   else
-    return (GFTP_ERETRYABLE);
+    {
+      rfc959_close_data_connection (request);
+      return (GFTP_ERETRYABLE);
+    }
 }
 
 
@@ -1408,23 +2263,33 @@ rfc959_list_files (gftp_request * request)
 {
   intptr_t show_hidden_files, resolve_symlinks, passive_transfer;
   char *tempstr, parms[3];
-  int ret;
+  int ret, reused;
 
   g_return_val_if_fail (request != NULL, GFTP_EFATAL);
   g_return_val_if_fail (request->datafd > 0, GFTP_EFATAL);
 
-  if ((ret = rfc959_data_connection_new (request, 0)) < 0)
+  if ((reused = rfc959_reuse_data_connection (request, 1)) < 0)
+    return (reused);
+
+  if (!reused && (ret = rfc959_data_connection_new (request, 0)) < 0)
     return (ret);
 
   gftp_lookup_request_option (request, "show_hidden_files", &show_hidden_files);
   gftp_lookup_request_option (request, "resolve_symlinks", &resolve_symlinks);
   gftp_lookup_request_option (request, "passive_transfer", &passive_transfer);
 
-  *parms = '\0';
-  strcat (parms, show_hidden_files ? "a" : "");
-  strcat (parms, resolve_symlinks ? "L" : "");
-  tempstr = g_strconcat ("LIST", *parms != '\0' ? " -" : "", parms, "\r\n", 
-                         NULL); 
+  /* MLSD always lists the hidden files. They are filtered out in
+     rfc959_get_next_file() */
+  if (((rfc959_parms *) request->protocol_data)->use_mlst)
+    tempstr = g_strdup ("MLSD\r\n");
+  else
+    {
+      *parms = '\0';
+      strcat (parms, show_hidden_files ? "a" : "");
+      strcat (parms, resolve_symlinks ? "L" : "");
+      tempstr = g_strconcat ("LIST", *parms != '\0' ? " -" : "", parms,
+                             "\r\n", NULL); 
+    }
 
   ret = rfc959_send_command (request, tempstr, -1, 1, 0);
   g_free (tempstr);
@@ -1439,11 +2304,14 @@ rfc959_list_files (gftp_request * request)
       return (GFTP_ERETRYABLE);
     }
 
-  ret = 0;
-  if (!passive_transfer)
-    ret = rfc959_accept_active_connection (request);
+  if (!passive_transfer && !reused &&
+      (ret = rfc959_accept_active_connection (request)) < 0)
+    return (ret);
 
-  return (ret);
+  if (((rfc959_parms *) request->protocol_data)->data_conn_setup != NULL)
+    return (((rfc959_parms *) request->protocol_data)->data_conn_setup (request));
+
+  return (0);
 }
 
 
@@ -1458,7 +2326,11 @@ rfc959_get_next_file_chunk (gftp_request * request, char *buf, size_t size)
   if (parms->is_fxp_transfer)
     return (GFTP_ENOTRANS);
 
-  num_read = parms->data_conn_read (request, buf, size, parms->data_connection);
+  if (parms->block_mode)
+    num_read = rfc959_block_read (request, buf, size, parms->data_connection);
+  else
+    num_read = parms->data_conn_read (request, buf, size,
+                                      parms->data_connection);
   if (num_read < 0)
     return (num_read);
 
@@ -1530,8 +2402,12 @@ rfc959_put_next_file_chunk (gftp_request * request, char *buf, size_t size)
   pos = tempstr;
   while (rsize > 0)
     {
-      num_wrote = parms->data_conn_write (request, pos, rsize,
-                                          parms->data_connection);
+      if (parms->block_mode)
+        num_wrote = rfc959_block_write (request, pos, rsize,
+                                        parms->data_connection);
+      else
+        num_wrote = parms->data_conn_write (request, pos, rsize,
+                                            parms->data_connection);
       if (num_wrote < 0)
         {
           ret = num_wrote;
@@ -1561,7 +2437,10 @@ rfc959_get_next_dirlist_line (gftp_request * request, int fd,
   parms = request->protocol_data;
 
   oldread_func = request->read_function;
-  request->read_function = parms->data_conn_read;
+  if (parms->block_mode)
+    request->read_function = rfc959_block_read;
+  else
+    request->read_function = parms->data_conn_read;
   len = gftp_get_line (request, &parms->dataconn_rbuf, buf, buflen, fd);
   request->read_function = oldread_func;
 
@@ -1571,6 +2450,7 @@ rfc959_get_next_dirlist_line (gftp_request * request, int fd,
 int
 rfc959_get_next_file (gftp_request * request, gftp_file * fle, int fd)
 {
+  intptr_t show_hidden_files;
   rfc959_parms * parms;
   char tempstr[1024];
   size_t stlen;
@@ -1591,6 +2471,8 @@ rfc959_get_next_file (gftp_request * request, gftp_file * fle, int fd)
   if (fd == request->datafd)
     fd = parms->data_connection;
 
+  gftp_lookup_request_option (request, "show_hidden_files", &show_hidden_files);
+
   do
     {
       len = rfc959_get_next_dirlist_line (request, fd, tempstr,
@@ -1611,6 +2493,12 @@ rfc959_get_next_file (gftp_request * request, gftp_file * fle, int fd)
 	  gftp_file_destroy (fle, 0);
 	  continue;
 	}
+      else if (!show_hidden_files && *fle->file == '.' &&
+               strcmp (fle->file, "..") != 0)
+        {
+	  gftp_file_destroy (fle, 0);
+	  continue;
+        }
       else
 	break;
     }
@@ -1626,15 +2514,76 @@ rfc959_get_next_file (gftp_request * request, gftp_file * fle, int fd)
 }
 
 
+static int
+rfc959_stat_filename (gftp_request * request, const char *filename,
+                      mode_t * mode, off_t * filesize)
+{
+  rfc959_parms * parms;
+  gftp_file fle;
+  int ret;
+
+  g_return_val_if_fail (request != NULL, GFTP_EFATAL);
+  g_return_val_if_fail (filename != NULL, GFTP_EFATAL);
+  g_return_val_if_fail (request->datafd > 0, GFTP_EFATAL);
+
+  parms = request->protocol_data;
+  if (!parms->use_mlst)
+    return (GFTP_ERETRYABLE);
+
+  parms->keep_response_lines = 1;
+  ret = rfc959_generate_and_send_command (request, "MLST", filename, 1, 0);
+  parms->keep_response_lines = 0;
+
+  if (ret < 0)
+    {
+      rfc959_free_response_lines (parms);
+      return (ret);
+    }
+  else if (ret != '2' || parms->response_lines == NULL)
+    {
+      rfc959_free_response_lines (parms);
+      return (GFTP_ERETRYABLE);
+    }
+
+  ret = gftp_parse_ls (request, parms->response_lines->data, &fle, -1);
+  rfc959_free_response_lines (parms);
+
+  if (ret == 0)
+    {
+      *mode = fle.st_mode;
+      *filesize = fle.size;
+    }
+
+  gftp_file_destroy (&fle, 0);
+  return (ret == 0 ? 0 : GFTP_ERETRYABLE);
+}
+
+
 static off_t
 rfc959_get_file_size (gftp_request * request, const char *filename)
 {
+  rfc959_parms * parms;
+  off_t filesize;
+  mode_t mode;
   int ret;
 
   g_return_val_if_fail (request != NULL, 0);
   g_return_val_if_fail (filename != NULL, 0);
   g_return_val_if_fail (request->datafd > 0, 0);
 
+  /* Some servers only have MLST. Don't bother them with SIZE. */
+  parms = request->protocol_data;
+  if (parms->has_feat && !parms->has_size && parms->use_mlst)
+    {
+      filesize = 0;
+      if ((ret = rfc959_stat_filename (request, filename, &mode,
+                                       &filesize)) == GFTP_EFATAL ||
+          request->datafd < 0)
+        return (ret);
+
+      return (filesize);
+    }
+
   ret = rfc959_generate_and_send_command (request, "SIZE", filename, 1, 0);
   if (ret < 0)
     return (ret);
@@ -1841,6 +2790,53 @@ rfc959_register_module (void)
 }
 
 
+/* Used by the session pool. The control connection can only be handed over
+   when there is no data connection open and no reply waiting to be read.
+   If probe is set, the server also has to answer a NOOP. */
+
+static int
+rfc959_check_connection (gftp_request * request, int probe)
+{
+  rfc959_parms * parms;
+  struct timeval tv;
+  fd_set fset;
+  int ret;
+
+  g_return_val_if_fail (request != NULL, GFTP_EFATAL);
+
+  parms = request->protocol_data;
+
+  /* An idle block mode data connection cannot be handed over along with the
+     control connection */
+  if (parms->block_mode && parms->block_eof)
+    rfc959_close_data_connection (request);
+
+  if (request->datafd < 0 || parms->data_connection >= 0 ||
+      parms->queued_responses > 0 ||
+      (parms->datafd_rbuf != NULL && parms->datafd_rbuf->cur_bufsize > 0))
+    return (GFTP_ERETRYABLE);
+
+  if (!probe)
+    return (0);
+
+  /* Anything that is readable here is either a stray reply or the server
+     closing the connection after its own idle timeout */
+  FD_ZERO (&fset);
+  FD_SET (request->datafd, &fset);
+  tv.tv_sec = tv.tv_usec = 0;
+  if (select (request->datafd + 1, &fset, NULL, NULL, &tv) != 0)
+    return (GFTP_ERETRYABLE);
+
+  ret = rfc959_send_command (request, "NOOP\r\n", -1, 1, 1);
+  if (ret < 0)
+    return (ret);
+  else if (ret != '2')
+    return (GFTP_ERETRYABLE);
+
+  return (0);
+}
+
+
 static void
 rfc959_request_destroy (gftp_request * request)
 {
@@ -1853,6 +2849,11 @@ rfc959_request_destroy (gftp_request * request)
 
   if (parms->dataconn_rbuf != NULL)
     gftp_free_getline_buffer (&parms->dataconn_rbuf);
+
+  rfc959_free_response_lines (parms);
+
+  if (parms->queued_commands != NULL)
+    g_string_free (parms->queued_commands, TRUE);
 }
 
 
@@ -1868,7 +2869,14 @@ rfc959_copy_param_options (gftp_request * dest_request,
   dparms->data_connection = -1;
   dparms->is_ascii_transfer = sparms->is_ascii_transfer;
   dparms->is_fxp_transfer = sparms->is_fxp_transfer;
+  dparms->has_feat = sparms->has_feat;
+  dparms->has_size = sparms->has_size;
+  dparms->use_mlst = sparms->use_mlst;
+  dparms->no_pipelining = sparms->no_pipelining;
+  dparms->block_mode = sparms->block_mode;
+  dparms->no_block_mode = sparms->no_block_mode;
   dparms->auth_tls_start = sparms->auth_tls_start;
+  dparms->data_conn_setup = sparms->data_conn_setup;
   dparms->data_conn_read = sparms->data_conn_read;
   dparms->data_conn_write = sparms->data_conn_write;
 
@@ -1920,7 +2928,7 @@ rfc959_init (gftp_request * request)
   request->put_next_file_chunk = rfc959_put_next_file_chunk;
   request->end_transfer = rfc959_end_transfer;
   request->abort_transfer = rfc959_abort_transfer;
-  request->stat_filename = NULL;
+  request->stat_filename = rfc959_stat_filename;
   request->list_files = rfc959_list_files;
   request->get_next_file = rfc959_get_next_file;
   request->get_next_dirlist_line = rfc959_get_next_dirlist_line;
@@ -1935,6 +2943,10 @@ rfc959_init (gftp_request * request)
   request->site = rfc959_site;
   request->parse_url = NULL;
   request->swap_socks = NULL;
+  request->exec_command = NULL;
+  request->check_connection = rfc959_check_connection;
+  request->prefetch_file = NULL;
+  request->prefetch_listings = NULL;
   request->set_config_options = rfc959_set_config_options;
   request->url_prefix = "ftp";
   request->need_hostport = 1;
@@ -1943,11 +2955,13 @@ rfc959_init (gftp_request * request)
   request->use_cache = 1;
   request->always_connected = 0;
   request->use_local_encoding = 0;
+  request->ranged_get = 1;
 
   request->protocol_data = g_malloc0 (sizeof (rfc959_parms));
   parms = request->protocol_data;
   parms->data_connection = -1; 
   parms->auth_tls_start = NULL;
+  parms->data_conn_setup = NULL;
   parms->data_conn_read = gftp_fd_read;
   parms->data_conn_write = gftp_fd_write;
 
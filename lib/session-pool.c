@@ -0,0 +1,331 @@
+/*****************************************************************************/
+/*  session-pool.c - keeps idle logins around so that they can be reused    */
+/*  Copyright (C) 1998-2008 Brian Masney <masneyb@gftp.org>                  */
+/*                                                                           */
+/*  This program is free software; you can redistribute it and/or modify     */
+/*  it under the terms of the GNU General Public License as published by     */
+/*  the Free Software Foundation; either version 2 of the License, or        */
+/*  (at your option) any later version.                                      */
+/*                                                                           */
+/*  This program is distributed in the hope that it will be useful,          */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of           */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            */
+/*  GNU General Public License for more details.                             */
+/*                                                                           */
+/*  You should have received a copy of the GNU General Public License        */
+/*  along with this program; if not, write to the Free Software              */
+/*  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA      */
+/*****************************************************************************/
+
+#include "gftp.h"
+static const char cvsid[] = "$Id$";
+
+/* When a request that is still logged in is destroyed, its connection is
+   moved into a request of its own and parked here instead of being closed.
+   The next gftp_connect() to the same protocol, host, port, user, password
+   and account, with the same per-request options, takes it over with
+   gftp_swap_socks() and skips the login. Only the protocols that have a
+   check_connection function take part. A parked connection is closed once
+   it has been idle for session_pool_timeout seconds, and it is checked with
+   the server before it is handed out again. */
+
+static GStaticMutex pool_mutex = G_STATIC_MUTEX_INIT;
+static GList * pool = NULL;
+
+typedef struct gftp_pooled_session_tag
+{
+  gftp_request * request;
+  time_t parked;
+} gftp_pooled_session;
+
+
+static void
+_gftp_session_pool_close (gftp_pooled_session * session)
+{
+  /* This is disconnected first so that destroying it does not park it
+     again */
+  gftp_disconnect (session->request);
+  gftp_request_destroy (session->request, 1);
+  g_free (session);
+}
+
+
+static gftp_config_vars *
+_gftp_session_pool_lookup_var (gftp_request * request, const char * key)
+{
+  gftp_config_vars * cv;
+
+  if (request->local_options_hash != NULL &&
+      (cv = g_hash_table_lookup (request->local_options_hash, key)) != NULL)
+    return (cv);
+
+  return (g_hash_table_lookup (gftp_global_options_htable, key));
+}
+
+
+/* Returns 1 if every option that was set on request1 by itself (from a
+   bookmark or with the set command) has the same value in request2 */
+
+static int
+_gftp_session_pool_same_local_options (gftp_request * request1,
+                                       gftp_request * request2)
+{
+  gftp_config_vars * cv1, * cv2;
+  int i;
+
+  for (i = 0; i < request1->num_local_options_vars; i++)
+    {
+      cv1 = &request1->local_options_vars[i];
+      if (cv1->key == NULL)
+        continue;
+
+      cv2 = _gftp_session_pool_lookup_var (request2, cv1->key);
+      if (cv2 == NULL || cv1->otype != cv2->otype)
+        return (0);
+
+      if (gftp_option_types[cv1->otype].compare_function != NULL &&
+          gftp_option_types[cv1->otype].compare_function (cv1, cv2) != 0)
+        return (0);
+    }
+
+  return (1);
+}
+
+
+static int
+_gftp_session_pool_same_string (const char * str1, const char * str2)
+{
+  if (str1 == NULL || str2 == NULL)
+    return (str1 == str2);
+
+  return (strcmp (str1, str2) == 0);
+}
+
+
+/* A parked login is only handed out if nothing that went into setting it up
+   is different: the server, the credentials and the options that change how
+   the session talks to the server, such as the FTP passive mode, the SSL
+   settings or the proxy server type */
+
+static int
+_gftp_session_pool_matches (gftp_request * parked, gftp_request * request)
+{
+  if (!compare_request (parked, request, 0))
+    return (0);
+
+  if (!_gftp_session_pool_same_string (parked->password, request->password) ||
+      !_gftp_session_pool_same_string (parked->account, request->account))
+    return (0);
+
+  return (_gftp_session_pool_same_local_options (parked, request) &&
+          _gftp_session_pool_same_local_options (request, parked));
+}
+
+
+/* Takes the sessions that have been idle for too long out of the pool.
+   Called with pool_mutex held. The caller closes them after it lets go of
+   the mutex, since that can block. */
+
+static GList *
+_gftp_session_pool_remove_expired (time_t now)
+{
+  gftp_pooled_session * session;
+  GList * templist, * next, * expired;
+  intptr_t session_pool_timeout;
+
+  expired = NULL;
+  for (templist = pool; templist != NULL; templist = next)
+    {
+      next = templist->next;
+      session = templist->data;
+
+      gftp_lookup_request_option (session->request, "session_pool_timeout",
+                                  &session_pool_timeout);
+      if (now - session->parked < session_pool_timeout)
+        continue;
+
+      pool = g_list_remove_link (pool, templist);
+      expired = g_list_concat (expired, templist);
+    }
+
+  return (expired);
+}
+
+
+static void
+_gftp_session_pool_close_list (GList * sessions)
+{
+  GList * templist;
+
+  for (templist = sessions; templist != NULL; templist = templist->next)
+    _gftp_session_pool_close (templist->data);
+
+  g_list_free (sessions);
+}
+
+
+/* Closes the sessions that have been idle for longer than
+   session_pool_timeout. The pool does this by itself whenever it is used;
+   the UI can also call this from a timer so that idle logins do not stay
+   open when nothing else is going on */
+
+void
+gftp_session_pool_expire (void)
+{
+  GList * expired;
+
+  if (g_thread_supported ())
+    g_static_mutex_lock (&pool_mutex);
+
+  expired = _gftp_session_pool_remove_expired (time (NULL));
+
+  if (g_thread_supported ())
+    g_static_mutex_unlock (&pool_mutex);
+
+  _gftp_session_pool_close_list (expired);
+}
+
+
+/* Called by gftp_request_destroy(). If the request is logged in and idle,
+   its connection is parked in the pool instead of being closed. */
+
+void
+gftp_session_pool_checkin (gftp_request * request)
+{
+  intptr_t session_pool_timeout;
+  gftp_pooled_session * session;
+  GList * expired, * templist;
+  gftp_request * parked;
+
+  g_return_if_fail (request != NULL);
+
+  if (request->check_connection == NULL || request->datafd < 0 ||
+      request->cancel || request->hostname == NULL ||
+      request->directory == NULL)
+    return;
+
+  gftp_lookup_request_option (request, "session_pool_timeout",
+                              &session_pool_timeout);
+  if (session_pool_timeout <= 0)
+    return;
+
+  if (request->check_connection (request, 0) < 0)
+    return;
+
+  if ((parked = gftp_copy_request (request)) == NULL)
+    return;
+
+  gftp_swap_socks (parked, request);
+  parked->server_type = request->server_type;
+  if (request->homedir != NULL)
+    parked->homedir = g_strdup (request->homedir);
+
+  session = g_malloc0 (sizeof (*session));
+  session->request = parked;
+  session->parked = time (NULL);
+
+  if (g_thread_supported ())
+    g_static_mutex_lock (&pool_mutex);
+
+  expired = _gftp_session_pool_remove_expired (session->parked);
+
+  pool = g_list_append (pool, session);
+  if (g_list_length (pool) > GFTP_SESSION_POOL_MAX)
+    {
+      templist = pool;
+      pool = g_list_remove_link (pool, templist);
+      expired = g_list_concat (expired, templist);
+    }
+
+  if (g_thread_supported ())
+    g_static_mutex_unlock (&pool_mutex);
+
+  _gftp_session_pool_close_list (expired);
+}
+
+
+/* Called by gftp_connect(). If there is a parked login that matches the
+   request and that still works, the request takes it over and is changed
+   to its directory. Returns 1 if the request is connected now and 0 if it
+   has to log in by itself. */
+
+int
+gftp_session_pool_checkout (gftp_request * request)
+{
+  gftp_pooled_session * session;
+  GList * templist, * expired;
+  gftp_request * parked;
+
+  g_return_val_if_fail (request != NULL, 0);
+
+  if (request->check_connection == NULL)
+    return (0);
+
+  while (1)
+    {
+      if (g_thread_supported ())
+        g_static_mutex_lock (&pool_mutex);
+
+      expired = _gftp_session_pool_remove_expired (time (NULL));
+
+      session = NULL;
+      for (templist = pool; templist != NULL; templist = templist->next)
+        {
+          if (_gftp_session_pool_matches (
+                     ((gftp_pooled_session *) templist->data)->request,
+                     request))
+            {
+              session = templist->data;
+              pool = g_list_remove_link (pool, templist);
+              g_list_free_1 (templist);
+              break;
+            }
+        }
+
+      if (g_thread_supported ())
+        g_static_mutex_unlock (&pool_mutex);
+
+      _gftp_session_pool_close_list (expired);
+
+      if (session == NULL)
+        return (0);
+
+      parked = session->request;
+      if (parked->check_connection (parked, 1) == 0)
+        break;
+
+      _gftp_session_pool_close (session);
+    }
+
+  request->logging_function (gftp_logging_misc, request,
+                             _("Reusing the login to %s\n"),
+                             request->hostname);
+
+  gftp_copy_param_options (request, parked);
+  gftp_swap_socks (request, parked);
+  request->server_type = parked->server_type;
+
+  if (request->homedir == NULL && parked->homedir != NULL)
+    request->homedir = g_strdup (parked->homedir);
+
+  if (request->directory == NULL || *request->directory == '\0')
+    {
+      if (request->directory != NULL)
+        g_free (request->directory);
+
+      request->directory = g_strdup (request->homedir != NULL ?
+                                     request->homedir : parked->directory);
+    }
+
+  _gftp_session_pool_close (session);
+
+  /* The server is still in whatever directory the last user left it in. If
+     that does not work, then a normal login sorts out the directory */
+  if (request->chdir (request, request->directory) < 0)
+    {
+      gftp_disconnect (request);
+      return (0);
+    }
+
+  return (1);
+}
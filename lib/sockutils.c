@@ -307,6 +307,272 @@ gftp_fd_write (gftp_request * request, const char *ptr, size_t size, int fd)
   return (ret);
 }
 
+/* Writes out all of the buffers in iov with as few system calls as possible.
+   The entries in iov are updated as they are written. */
+
+ssize_t 
+gftp_fd_writev (gftp_request * request, struct iovec * iov, int iovcnt,
+                int fd)
+{
+  intptr_t network_timeout;
+  struct timeval tv;
+  int ret, s_ret;
+  ssize_t w_ret;
+  fd_set fset;
+
+  g_return_val_if_fail (fd >= 0, GFTP_EFATAL);
+  g_return_val_if_fail (iov != NULL, GFTP_EFATAL);
+
+  gftp_lookup_request_option (request, "network_timeout", &network_timeout);  
+
+  errno = 0;
+  ret = 0;
+  FD_ZERO (&fset);
+
+  while (iovcnt > 0)
+    {
+      FD_SET (fd, &fset);
+      tv.tv_sec = network_timeout;
+      tv.tv_usec = 0;
+      s_ret = select (fd + 1, NULL, &fset, NULL, &tv);
+      if (s_ret == -1 && (errno == EINTR || errno == EAGAIN))
+        {
+          if (request != NULL && request->cancel)
+            {
+              gftp_disconnect (request);
+              return (GFTP_ERETRYABLE);
+            }
+
+          continue;
+        }
+      else if (s_ret <= 0)
+        {
+          if (request != NULL)
+            {
+              request->logging_function (gftp_logging_error, request,
+                                         _("Connection to %s timed out\n"),
+                                         request->hostname);
+              gftp_disconnect (request);
+            }
+
+          return (GFTP_ERETRYABLE);
+        }
+
+      w_ret = writev (fd, iov, iovcnt);
+      if (w_ret < 0)
+        {
+          if (errno == EINTR || errno == EAGAIN)
+            {
+              if (request != NULL && request->cancel)
+                {
+                  gftp_disconnect (request);
+                  return (GFTP_ERETRYABLE);
+                }
+
+              continue;
+             }
+ 
+          if (request != NULL)
+            {
+              request->logging_function (gftp_logging_error, request,
+                                    _("Error: Could not write to socket: %s\n"),
+                                    g_strerror (errno));
+              gftp_disconnect (request);
+            }
+
+          return (GFTP_ERETRYABLE);
+        }
+
+      ret += w_ret;
+
+      /* Skip over the buffers that went out completely */
+      while (iovcnt > 0 && (size_t) w_ret >= iov->iov_len)
+        {
+          w_ret -= iov->iov_len;
+          iov++;
+          iovcnt--;
+        }
+
+      if (iovcnt > 0)
+        {
+          iov->iov_base = (char *) iov->iov_base + w_ret;
+          iov->iov_len -= w_ret;
+        }
+    }
+
+  return (ret);
+}
+
+#if defined (HAVE_SENDFILE) || defined (HAVE_SPLICE)
+static int
+_gftp_fd_wait (gftp_request * request, int fd, int for_write)
+{
+  intptr_t network_timeout;
+  struct timeval tv;
+  fd_set fset;
+  int s_ret;
+
+  gftp_lookup_request_option (request, "network_timeout", &network_timeout);  
+
+  FD_ZERO (&fset);
+  while (1)
+    {
+      FD_SET (fd, &fset);
+      tv.tv_sec = network_timeout;
+      tv.tv_usec = 0;
+      if (for_write)
+        s_ret = select (fd + 1, NULL, &fset, NULL, &tv);
+      else
+        s_ret = select (fd + 1, &fset, NULL, NULL, &tv);
+
+      if (s_ret > 0)
+        return (0);
+      else if (s_ret == -1 && (errno == EINTR || errno == EAGAIN))
+        {
+          if (request->cancel)
+            {
+              gftp_disconnect (request);
+              return (GFTP_ERETRYABLE);
+            }
+
+          continue;
+        }
+
+      request->logging_function (gftp_logging_error, request,
+                                 _("Connection to %s timed out\n"),
+                                 request->hostname);
+      gftp_disconnect (request);
+      return (GFTP_ERETRYABLE);
+    }
+}
+
+
+static void
+_gftp_close_splice_pipe (int *pipefds)
+{
+  close (pipefds[0]);
+  close (pipefds[1]);
+  pipefds[0] = pipefds[1] = -1;
+}
+#endif
+
+
+/* Moves up to size bytes from fromfd to tofd without copying the data into
+   user space. If pipefds is NULL, fromfd must be a regular file and
+   sendfile() is used. Otherwise the data is spliced through the pipe in
+   pipefds, which must be empty. Returns GFTP_ENOTRANS if the kernel cannot
+   do this for these descriptors, in which case nothing has been moved and
+   the caller should fall back to read()/write(). */
+
+ssize_t
+gftp_fd_splice (gftp_request * request, int fromfd, int tofd, int *pipefds,
+                size_t size)
+{
+#if defined (HAVE_SENDFILE) || defined (HAVE_SPLICE)
+  ssize_t ret, n_ret, num_wrote;
+
+  g_return_val_if_fail (request != NULL, GFTP_EFATAL);
+  g_return_val_if_fail (fromfd >= 0, GFTP_EFATAL);
+  g_return_val_if_fail (tofd >= 0, GFTP_EFATAL);
+
+  while (1)
+    {
+      errno = 0;
+      if (pipefds == NULL)
+        {
+#ifdef HAVE_SENDFILE
+          ret = sendfile (tofd, fromfd, NULL, size);
+#else
+          return (GFTP_ENOTRANS);
+#endif
+        }
+      else
+        {
+#ifdef HAVE_SPLICE
+          ret = splice (fromfd, NULL, pipefds[1], NULL, size, SPLICE_F_MOVE);
+#else
+          return (GFTP_ENOTRANS);
+#endif
+        }
+
+      if (ret >= 0)
+        break;
+      else if (errno == EINVAL || errno == ENOSYS)
+        return (GFTP_ENOTRANS);
+      else if (errno == EINTR || errno == EAGAIN)
+        {
+          if (request->cancel)
+            {
+              gftp_disconnect (request);
+              return (GFTP_ERETRYABLE);
+            }
+
+          if (errno == EAGAIN &&
+              (ret = _gftp_fd_wait (request, pipefds == NULL ? tofd : fromfd,
+                                    pipefds == NULL)) < 0)
+            return (ret);
+
+          continue;
+        }
+
+      request->logging_function (gftp_logging_error, request,
+                                 _("Error: Could not transfer data: %s\n"),
+                                 g_strerror (errno));
+      gftp_disconnect (request);
+      return (GFTP_ERETRYABLE);
+    }
+
+  if (pipefds == NULL || ret == 0)
+    return (ret);
+
+#ifdef HAVE_SPLICE
+  /* Drain everything that was just read into the pipe. If this fails, the
+     pipe is closed so that stale data is never written out later */
+  num_wrote = 0;
+  while (num_wrote < ret)
+    {
+      errno = 0;
+      n_ret = splice (pipefds[0], NULL, tofd, NULL, ret - num_wrote,
+                      SPLICE_F_MOVE);
+      if (n_ret > 0)
+        {
+          num_wrote += n_ret;
+          continue;
+        }
+      else if (n_ret < 0 && (errno == EINTR || errno == EAGAIN))
+        {
+          if (request->cancel)
+            {
+              _gftp_close_splice_pipe (pipefds);
+              gftp_disconnect (request);
+              return (GFTP_ERETRYABLE);
+            }
+
+          if (errno == EAGAIN && 
+              (n_ret = _gftp_fd_wait (request, tofd, 1)) < 0)
+            {
+              _gftp_close_splice_pipe (pipefds);
+              return (n_ret);
+            }
+
+          continue;
+        }
+
+      request->logging_function (gftp_logging_error, request,
+                                 _("Error: Could not write to socket: %s\n"),
+                                 g_strerror (errno));
+      _gftp_close_splice_pipe (pipefds);
+      gftp_disconnect (request);
+      return (GFTP_ERETRYABLE);
+    }
+#endif
+
+  return (ret);
+#else
+  return (GFTP_ENOTRANS);
+#endif
+}
+
 
 ssize_t 
 gftp_writefmt (gftp_request * request, int fd, const char *fmt, ...)
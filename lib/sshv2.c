@@ -23,6 +23,20 @@ static const char cvsid[] = "$Id$";
 #define SSH_MAX_HANDLE_SIZE		256
 #define SSH_MAX_STRING_SIZE		34000
 
+/* Largest SSH_FXP_READ/SSH_FXP_WRITE that fits into a 34000 byte message
+   along with the handle. This is also what the protocol draft says every
+   server must support. */
+#define SSH_MAX_TRANSFER_SIZE		32768
+
+/* Servers that have the limits@openssh.com extension tell us how big the
+   packets can really be. We won't go over this no matter what they say. */
+#define SSH_LIMITS_EXTENSION		"limits@openssh.com"
+#define SSH_MAX_PACKET_SIZE		(256 * 1024)
+
+/* How many seconds a shared SSH connection stays up after its last
+   session is closed */
+#define SSH_CONTROL_PERSIST		120
+
 static gftp_config_vars config_vars[] =
 {
   {"", N_("SSH"), gftp_option_type_notebook, NULL, NULL, 
@@ -39,6 +53,21 @@ static gftp_config_vars config_vars[] =
    gftp_option_type_checkbox, GINT_TO_POINTER(1), NULL, 
    GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
    N_("Require a username/password for SSH connections"), GFTP_PORT_ALL, NULL},
+  {"ssh_multiplex", N_("Share SSH connections"), 
+   gftp_option_type_checkbox, GINT_TO_POINTER(0), NULL, 
+   GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
+   N_("If this is enabled, then all of the SFTP sessions to the same user and host share one SSH connection. Only the first session has to log in, so the transfer queue and the other window can open their sessions right away. This needs OpenSSH 6.7 or later."),
+   GFTP_PORT_ALL, NULL},
+  {"ssh_requests_in_flight", N_("Requests in flight:"), 
+   gftp_option_type_int, GINT_TO_POINTER(32), NULL, 
+   GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
+   N_("The number of SFTP read or write requests that are kept outstanding while a file is transferred. Raise this on links with a long round trip time."),
+   GFTP_PORT_ALL, NULL},
+  {"ssh_bulk_transfers", N_("Copy new directories with tar"), 
+   gftp_option_type_checkbox, GINT_TO_POINTER(0), NULL, 
+   GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
+   N_("If this is enabled, then a directory that does not exist on the other side yet is sent as one tar stream over a separate ssh session instead of one file at a time, and directories are removed with rm -rf. The server must have a POSIX shell with tar, du and rm. The other side must be local or another SSH2 server with this option."),
+   GFTP_PORT_ALL, NULL},
 
   {NULL, NULL, 0, NULL, NULL, 0, NULL, 0, NULL}
 };
@@ -51,8 +80,20 @@ typedef struct sshv2_message_tag
   char *buffer,
        *pos,
        *end;
+  unsigned int in_recv_buffer : 1; /* buffer is the connection's receive
+                                      buffer and is only good until the
+                                      next message is read */
 } sshv2_message;
 
+typedef struct sshv2_read_tag
+{
+  guint32 id,
+          len,
+          done;			/* Bytes of the reply already handed out */
+  off_t offset;
+  sshv2_message message;	/* The reply, once it came in */
+} sshv2_read;
+
 typedef struct sshv2_params_tag
 {
   char handle[SSH_MAX_HANDLE_SIZE + 4], /* We'll encode the ID in here too */
@@ -62,9 +103,20 @@ typedef struct sshv2_params_tag
   guint32 id,
           count;
   sshv2_message message;
+  size_t max_packet_len;	/* Largest message either side may send */
+
+  char *recv_buffer;		/* Reused for every message that is read */
+  size_t recv_buffer_len;
+
+  GList * reads;		/* SSH_FXP_READ requests in flight, in the
+                                   order of their file offsets */
+  unsigned int num_reads,
+               num_writes;	/* SSH_FXP_WRITEs that were not acked yet */
+  off_t read_offset;		/* Where the next SSH_FXP_READ starts */
 
   unsigned int initialized : 1,
-               dont_log_status : 1;              /* For uploading files */
+               dont_log_status : 1,              /* For uploading files */
+               read_eof : 1;
 
 #ifdef G_HAVE_GINT64
   guint64 offset;
@@ -330,10 +382,11 @@ sshv2_add_exec_args (char **logstr, size_t *logstr_len, char ***args,
 
 
 static char **
-sshv2_gen_exec_args (gftp_request * request)
+sshv2_gen_exec_args (gftp_request * request, const char *command)
 {
   size_t logstr_len, args_len, args_cur;
   char **args, *tempstr, *logstr;
+  intptr_t ssh_multiplex;
 
   gftp_lookup_request_option (request, "ssh_prog_name", &tempstr);
   if (tempstr == NULL || *tempstr == '\0')
@@ -355,6 +408,21 @@ sshv2_gen_exec_args (gftp_request * request)
   sshv2_add_exec_args (&logstr, &logstr_len, &args, &args_len, &args_cur,
                        " -e none");
 
+  gftp_lookup_request_option (request, "ssh_multiplex", &ssh_multiplex);
+  if (ssh_multiplex)
+    {
+      /* The first session to a user@host becomes the master and the later
+         ones attach to its socket without another key exchange or login.
+         The socket is named after %C, a hash of the user, host and port,
+         since spelling them out can go past the length limit of a Unix
+         socket path */
+      tempstr = gftp_expand_path (request, BASE_CONF_DIR);
+      sshv2_add_exec_args (&logstr, &logstr_len, &args, &args_len, &args_cur,
+                           " -o ControlMaster=auto -o \"ControlPath=%s/ssh-%%C\" -o ControlPersist=%d",
+                           tempstr, SSH_CONTROL_PERSIST);
+      g_free (tempstr);
+    }
+
   if (request->username && *request->username != '\0')
     sshv2_add_exec_args (&logstr, &logstr_len, &args, &args_len, &args_cur,
                          " -l %s", request->username);
@@ -362,8 +430,25 @@ sshv2_gen_exec_args (gftp_request * request)
   sshv2_add_exec_args (&logstr, &logstr_len, &args, &args_len, &args_cur,
                        " -p %d", request->port);
 
-  sshv2_add_exec_args (&logstr, &logstr_len, &args, &args_len, &args_cur,
-                       " %s -s sftp", request->hostname);
+  if (command == NULL)
+    sshv2_add_exec_args (&logstr, &logstr_len, &args, &args_len, &args_cur,
+                         " %s -s sftp", request->hostname);
+  else
+    {
+      sshv2_add_exec_args (&logstr, &logstr_len, &args, &args_len, &args_cur,
+                           " %s", request->hostname);
+
+      /* The command is passed as one argument so that the spaces inside of
+         the quoted paths are left alone */
+      if (args_cur == args_len + 1)
+        args = g_realloc (args, sizeof (char *) * ++args_cur);
+      args[args_len++] = g_strdup (command);
+      args[args_len] = NULL;
+
+      tempstr = g_strconcat (logstr, " ", command, NULL);
+      g_free (logstr);
+      logstr = tempstr;
+    }
 
   request->logging_function (gftp_logging_misc, request, 
                              _("Running program %s\n"), logstr);
@@ -372,6 +457,9 @@ sshv2_gen_exec_args (gftp_request * request)
 }
 
 
+/* Answers the prompts from ssh on ptymfd until the remote side starts
+   writing to fdm. The caller disconnects if this fails */
+
 static int
 sshv2_start_login_sequence (gftp_request * request, int fdm, int ptymfd)
 {
@@ -422,10 +510,7 @@ sshv2_start_login_sequence (gftp_request * request, int fdm, int ptymfd)
           if (errno == EINTR || errno == EAGAIN)
             {
               if (request->cancel)
-                {
-                  gftp_disconnect (request);
-                  return (GFTP_ERETRYABLE);
-                }
+                return (GFTP_ERETRYABLE);
 
               continue;
             }
@@ -434,7 +519,6 @@ sshv2_start_login_sequence (gftp_request * request, int fdm, int ptymfd)
               request->logging_function (gftp_logging_error, request,
                                          _("Connection to %s timed out\n"),
                                          request->hostname);
-              gftp_disconnect (request);
               return (GFTP_ERETRYABLE);
             }
         }
@@ -444,7 +528,6 @@ sshv2_start_login_sequence (gftp_request * request, int fdm, int ptymfd)
           request->logging_function (gftp_logging_error, request,
                                _("Error: Could not read from socket: %s\n"),
                                 g_strerror (errno));
-          gftp_disconnect (request);
           return (GFTP_ERETRYABLE);
         }
         
@@ -566,7 +649,6 @@ sshv2_start_login_sequence (gftp_request * request, int fdm, int ptymfd)
         request->logging_function (gftp_logging_error, request,
                                _("Error: An incorrect password was entered\n"));
 
-      gftp_disconnect (request);
       return (GFTP_EFATAL);
     }
  
@@ -738,38 +820,55 @@ sshv2_log_command (gftp_request * request, gftp_logging_level level,
 }
 
 
+/* The header, the command and the data are written out together with
+   writev() so that large chunks of file data are not copied around */
+
 static int
-sshv2_send_command (gftp_request * request, char type, char *command, 
-                    size_t len)
+sshv2_send_command_with_data (gftp_request * request, char type,
+                              char *command, size_t len, char *data,
+                              size_t datalen)
 {
-  char buf[34000];
+  sshv2_params * params;
+  struct iovec iov[3];
+  char header[5];
   guint32 clen;
   int ret;
 
-  if (len > 33995)
+  params = request->protocol_data;
+
+  if (len + datalen > params->max_packet_len - 5)
     {
       request->logging_function (gftp_logging_error, request,
-                             _("Error: Message size %d too big\n"), len);
+                             _("Error: Message size %d too big\n"),
+                             len + datalen);
       gftp_disconnect (request);
       return (GFTP_EFATAL);
     }
 
-  clen = htonl (len + 1);
-  memcpy (buf, &clen, 4);
-  buf[4] = type;
-  memcpy (&buf[5], command, len);
-  buf[len + 5] = '\0';
+  clen = htonl (len + datalen + 1);
+  memcpy (header, &clen, 4);
+  header[4] = type;
 
 #ifdef DEBUG
   printf ("\rSending to FD %d: ", request->datafd);
-  for (clen=0; clen<len + 5; clen++)
-    printf ("%x ", buf[clen] & 0xff);
+  for (clen=0; clen<5; clen++)
+    printf ("%x ", header[clen] & 0xff);
+  for (clen=0; clen<len; clen++)
+    printf ("%x ", command[clen] & 0xff);
   printf ("\n");
 #endif
 
-  sshv2_log_command (request, gftp_logging_send, type, buf + 5, len);
+  sshv2_log_command (request, gftp_logging_send, type, command, len);
 
-  if ((ret = gftp_fd_write (request, buf, len + 5, request->datafd)) < 0)
+  iov[0].iov_base = header;
+  iov[0].iov_len = sizeof (header);
+  iov[1].iov_base = command;
+  iov[1].iov_len = len;
+  iov[2].iov_base = data;
+  iov[2].iov_len = datalen;
+
+  if ((ret = gftp_fd_writev (request, iov, datalen > 0 ? 3 : 2,
+                             request->datafd)) < 0)
     return (ret);
 
   return (0);
@@ -777,33 +876,51 @@ sshv2_send_command (gftp_request * request, char type, char *command,
 
 
 static int
-sshv2_read_response (gftp_request * request, sshv2_message * message,
-                     int fd)
+sshv2_send_command (gftp_request * request, char type, char *command, 
+                    size_t len)
 {
-  char buf[6], error_buffer[255], *pos;
-  sshv2_params * params;
-  ssize_t numread;
-  size_t rem;
+  return (sshv2_send_command_with_data (request, type, command, len, NULL, 0));
+}
 
-  params = request->protocol_data;
 
-  if (fd <= 0)
-    fd = request->datafd;
+static int
+sshv2_read_data (gftp_request * request, char *buf, size_t len, int fd)
+{
+  ssize_t numread;
 
-  pos = buf;
-  rem = 5;
-  while (rem > 0)
+  while (len > 0)
     {
-      if ((numread = gftp_fd_read (request, pos, rem, fd)) < 0)
+      if ((numread = gftp_fd_read (request, buf, len, fd)) < 0)
         return (numread);
-      rem -= numread;
-      pos += numread;
+      len -= numread;
+      buf += numread;
     }
+
+  return (0);
+}
+
+
+/* Reads the length and the type of the next message */
+
+static int
+sshv2_read_message_header (gftp_request * request, sshv2_message * message,
+                           int fd)
+{
+  char buf[6], error_buffer[255];
+  sshv2_params * params;
+  ssize_t numread;
+  int ret;
+
+  params = request->protocol_data;
+
+  memset (message, 0, sizeof (*message));
+  if ((ret = sshv2_read_data (request, buf, 5, fd)) < 0)
+    return (ret);
   buf[5] = '\0';
 
   memcpy (&message->length, buf, 4);
   message->length = ntohl (message->length);
-  if (message->length > 34000)
+  if (message->length > params->max_packet_len)
     {
       if (params->initialized)
         {
@@ -837,21 +954,48 @@ sshv2_read_response (gftp_request * request, sshv2_message * message,
     }
 
   message->command = buf[4];
-  message->buffer = g_malloc0 (message->length + 1);
+  return (message->command);
+}
 
-  message->pos = message->buffer;
-  message->end = message->buffer + message->length - 1;
 
-  pos = message->buffer;
-  rem = message->length - 1;
-  while (rem > 0)
+/* The message is read into the receive buffer of the connection, so it has
+   to be used up before the next one is read */
+
+static int
+sshv2_read_response (gftp_request * request, sshv2_message * message,
+                     int fd)
+{
+  sshv2_params * params;
+  int ret;
+#ifdef DEBUG
+  size_t rem;
+#endif
+
+  params = request->protocol_data;
+
+  if (fd <= 0)
+    fd = request->datafd;
+
+  if ((ret = sshv2_read_message_header (request, message, fd)) < 0)
+    return (ret);
+
+  if (params->recv_buffer_len < message->length + 1)
     {
-      if ((numread = gftp_fd_read (request, pos, rem, fd)) < 0)
-        return (numread);
-      rem -= numread;
-      pos += numread;
+      params->recv_buffer_len = message->length + 1;
+      params->recv_buffer = g_realloc (params->recv_buffer,
+                                       params->recv_buffer_len);
     }
 
+  message->buffer = params->recv_buffer;
+  message->in_recv_buffer = 1;
+
+  message->pos = message->buffer;
+  message->end = message->buffer + message->length - 1;
+
+  if ((ret = sshv2_read_data (request, message->buffer, message->length - 1,
+                              fd)) < 0)
+    return (ret);
+
 #ifdef DEBUG
   printf ("\rReceived message: ");
   for (rem=0; rem<message->length; rem++)
@@ -859,7 +1003,7 @@ sshv2_read_response (gftp_request * request, sshv2_message * message,
   printf ("\n");
 #endif
 
-  message->buffer[message->length] = '\0';
+  message->buffer[message->length - 1] = '\0';
 
   sshv2_log_command (request, gftp_logging_recv, message->command, 
                      message->buffer, message->length);
@@ -869,22 +1013,49 @@ sshv2_read_response (gftp_request * request, sshv2_message * message,
 
 
 static void
-sshv2_destroy (gftp_request * request)
+sshv2_message_free (sshv2_message * message)
 {
-  g_return_if_fail (request != NULL);
-  g_return_if_fail (request->protonum == GFTP_SSHV2_NUM);
+  if (message->buffer && !message->in_recv_buffer)
+    g_free (message->buffer);
+  memset (message, 0, sizeof (*message));
+}
 
-  g_free (request->protocol_data);
-  request->protocol_data = NULL;
+
+static void
+sshv2_free_reads (sshv2_params * params)
+{
+  GList * templist;
+  sshv2_read * rreq;
+
+  for (templist = params->reads; templist != NULL; templist = templist->next)
+    {
+      rreq = templist->data;
+      sshv2_message_free (&rreq->message);
+      g_free (rreq);
+    }
+
+  g_list_free (params->reads);
+  params->reads = NULL;
+  params->num_reads = 0;
 }
 
 
 static void
-sshv2_message_free (sshv2_message * message)
+sshv2_destroy (gftp_request * request)
 {
-  if (message->buffer)
-    g_free (message->buffer);
-  memset (message, 0, sizeof (*message));
+  sshv2_params * params;
+
+  g_return_if_fail (request != NULL);
+  g_return_if_fail (request->protonum == GFTP_SSHV2_NUM);
+
+  params = request->protocol_data;
+  sshv2_free_reads (params);
+
+  if (params->recv_buffer != NULL)
+    g_free (params->recv_buffer);
+
+  g_free (request->protocol_data);
+  request->protocol_data = NULL;
 }
 
 
@@ -1000,7 +1171,7 @@ sshv2_buffer_get_int64 (gftp_request * request, sshv2_message * message,
     return (ret);
 
 #if G_HAVE_GINT64
-  snum = (gint64) lonum | ((gint64) hinum >> 32);
+  snum = (gint64) lonum | ((gint64) hinum << 32);
 #else
   snum = lonum;
 #endif
@@ -1138,6 +1309,114 @@ sshv2_free_args (char **args)
 }
 
 
+/* Looks through the extensions in the SSH_FXP_VERSION message. Returns 1
+   if the server has limits@openssh.com. */
+
+static int
+sshv2_read_extensions (gftp_request * request, sshv2_message * message)
+{
+  char *name, *data;
+  int ret, has_limits;
+
+  if ((ret = sshv2_buffer_get_int32 (request, message, 0, 0, NULL)) < 0)
+    return (ret);
+
+  has_limits = 0;
+  while (message->pos < message->end)
+    {
+      if ((name = sshv2_buffer_get_string (request, message, 1)) == NULL)
+        return (GFTP_EFATAL);
+
+      if ((data = sshv2_buffer_get_string (request, message, 1)) == NULL)
+        {
+          g_free (name);
+          return (GFTP_EFATAL);
+        }
+
+      if (strcmp (name, SSH_LIMITS_EXTENSION) == 0)
+        has_limits = 1;
+
+      g_free (name);
+      g_free (data);
+    }
+
+  return (has_limits);
+}
+
+
+static int
+sshv2_get_limits (gftp_request * request)
+{
+#ifdef G_HAVE_GINT64
+  guint64 max_packet_len, max_read_len, max_write_len;
+#else
+  guint32 max_packet_len, max_read_len, max_write_len;
+#endif
+  sshv2_params * params;
+  sshv2_message message;
+  size_t len, max_len;
+  char *tempstr;
+  int ret;
+
+  params = request->protocol_data;
+
+  len = strlen (SSH_LIMITS_EXTENSION) + 8;
+  tempstr = sshv2_initialize_buffer (request, len);
+  sshv2_add_string_to_buf (tempstr + 4, SSH_LIMITS_EXTENSION, len - 8);
+
+  ret = sshv2_send_command (request, SSH_FXP_EXTENDED, tempstr, len);
+  g_free (tempstr);
+  if (ret < 0)
+    return (ret);
+
+  memset (&message, 0, sizeof (message));
+  ret = sshv2_read_response (request, &message, -1);
+  if (ret < 0)
+    return (ret);
+  else if (ret != SSH_FXP_EXTENDED_REPLY)
+    {
+      /* Just stay with the small packets */
+      sshv2_message_free (&message);
+      return (0);
+    }
+
+  message.pos += 4;
+  if ((ret = sshv2_buffer_get_int64 (request, &message, 0, 0,
+                                     &max_packet_len)) < 0 ||
+      (ret = sshv2_buffer_get_int64 (request, &message, 0, 0,
+                                     &max_read_len)) < 0 ||
+      (ret = sshv2_buffer_get_int64 (request, &message, 0, 0,
+                                     &max_write_len)) < 0)
+    {
+      sshv2_message_free (&message);
+      return (ret);
+    }
+
+  sshv2_message_free (&message);
+
+  /* A limit of 0 means that the server doesn't have one */
+  if (max_packet_len == 0 || max_packet_len > SSH_MAX_PACKET_SIZE)
+    max_packet_len = SSH_MAX_PACKET_SIZE;
+
+  if (max_packet_len <= SSH_MAX_STRING_SIZE)
+    return (0);
+
+  /* Leave room for the handle and the other fields around the data */
+  max_len = max_packet_len - 1024;
+  if (max_read_len > 0 && max_read_len < max_len)
+    max_len = max_read_len;
+  if (max_write_len > 0 && max_write_len < max_len)
+    max_len = max_write_len;
+
+  if (max_len <= SSH_MAX_TRANSFER_SIZE)
+    return (0);
+
+  params->max_packet_len = max_packet_len;
+  request->max_trans_blksize = max_len;
+  return (0);
+}
+
+
 static int
 sshv2_connect (gftp_request * request)
 {
@@ -1174,7 +1453,7 @@ sshv2_connect (gftp_request * request)
         request->port = ntohs (serv_struct.s_port);
     }
 
-  args = sshv2_gen_exec_args (request);
+  args = sshv2_gen_exec_args (request, NULL);
 
   child = gftp_exec (request, &fdm, &ptymfd, args);
 
@@ -1188,6 +1467,9 @@ sshv2_connect (gftp_request * request)
 
   request->datafd = fdm;
 
+  params->max_packet_len = SSH_MAX_STRING_SIZE;
+  request->max_trans_blksize = SSH_MAX_TRANSFER_SIZE;
+
   version = htonl (SSH_MY_VERSION);
   if ((ret = sshv2_send_command (request, SSH_FXP_INIT, (char *) 
                                  &version, 4)) < 0)
@@ -1195,7 +1477,10 @@ sshv2_connect (gftp_request * request)
 
   ret = sshv2_start_login_sequence (request, fdm, ptymfd);
   if (ret < 0)
-    return (ret);
+    {
+      gftp_disconnect (request);
+      return (ret);
+    }
 
   memset (&message, 0, sizeof (message));
   ret = sshv2_read_response (request, &message, -1);
@@ -1207,8 +1492,14 @@ sshv2_connect (gftp_request * request)
   else if (ret != SSH_FXP_VERSION)
     return (sshv2_wrong_response (request, &message));
 
+  if ((ret = sshv2_read_extensions (request, &message)) < 0)
+    return (ret);
+
   sshv2_message_free (&message);
 
+  if (ret > 0 && (ret = sshv2_get_limits (request)) < 0)
+    return (ret);
+
   params->initialized = 1;
   request->logging_function (gftp_logging_misc, request,
                              _("Successfully logged into SSH server %s\n"),
@@ -1260,6 +1551,289 @@ sshv2_disconnect (gftp_request * request)
       sshv2_message_free (&params->message);
       params->message.buffer = NULL;
     }
+
+  sshv2_free_reads (params);
+  params->num_writes = 0;
+}
+
+
+static void
+sshv2_setup_file_offset (sshv2_params * params, char *buf, off_t offset)
+{
+  guint32 hinum, lownum;
+#ifdef G_HAVE_GINT64
+  hinum = htonl((guint64) offset >> 32);
+  lownum = htonl((guint32) offset);
+#else
+  hinum = 0;
+  lownum = htonl (offset);
+#endif
+
+  memcpy (buf + params->handle_len, &hinum, 4);
+  memcpy (buf + params->handle_len + 4, &lownum, 4);
+}
+
+
+static int
+sshv2_send_read (gftp_request * request, sshv2_read * rreq)
+{
+  sshv2_params * params;
+  guint32 num;
+
+  params = request->protocol_data;
+
+  rreq->id = params->id++;
+  num = htonl (rreq->id);
+  memcpy (params->transfer_buffer, &num, 4);
+
+  sshv2_setup_file_offset (params, params->transfer_buffer, rreq->offset);
+
+  num = htonl (rreq->len);
+  memcpy (params->transfer_buffer + params->handle_len + 8, &num, 4);
+
+  return (sshv2_send_command (request, SSH_FXP_READ, params->transfer_buffer,
+                              params->handle_len + 12));
+}
+
+
+static int
+sshv2_fill_read_window (gftp_request * request, size_t size)
+{
+  intptr_t requests_in_flight;
+  sshv2_params * params;
+  sshv2_read * rreq;
+  int ret;
+
+  params = request->protocol_data;
+
+  gftp_lookup_request_option (request, "ssh_requests_in_flight",
+                              &requests_in_flight);
+  if (requests_in_flight < 1)
+    requests_in_flight = 1;
+
+  while (!params->read_eof && params->num_reads < requests_in_flight)
+    {
+      rreq = g_malloc0 (sizeof (*rreq));
+      rreq->offset = params->read_offset;
+      rreq->len = size;
+
+      if ((ret = sshv2_send_read (request, rreq)) < 0)
+        {
+          g_free (rreq);
+          return (ret);
+        }
+
+      params->reads = g_list_append (params->reads, rreq);
+      params->num_reads++;
+      params->read_offset += size;
+    }
+
+  return (0);
+}
+
+
+/* Reads the next reply from the server. If it is the data that the first
+   read in the queue is waiting for and it fits, it is read straight into
+   buf and its length is returned. Otherwise the reply is attached to the
+   read request that it answers and 0 is returned. The replies can come back
+   in any order. */
+
+static int
+sshv2_read_reply (gftp_request * request, char *buf, size_t size)
+{
+  sshv2_params * params;
+  sshv2_message message;
+  GList * templist;
+  sshv2_read * rreq;
+  guint32 id, num;
+  char start[8];
+  int ret;
+
+  params = request->protocol_data;
+
+  if ((ret = sshv2_read_message_header (request, &message,
+                                        request->datafd)) < 0)
+    return (ret);
+
+  if ((ret != SSH_FXP_DATA && ret != SSH_FXP_STATUS) || message.length < 9)
+    return (sshv2_wrong_response (request, &message));
+
+  if ((ret = sshv2_read_data (request, start, sizeof (start),
+                              request->datafd)) < 0)
+    return (ret);
+
+  memcpy (&id, start, 4);
+  id = ntohl (id);
+  memcpy (&num, start + 4, 4);
+  num = ntohl (num);
+
+  for (templist = params->reads; templist != NULL; templist = templist->next)
+    {
+      rreq = templist->data;
+      if (rreq->id == id && rreq->message.buffer == NULL)
+        break;
+    }
+
+  if (templist == NULL)
+    return (sshv2_wrong_response (request, &message));
+
+  if (buf != NULL && templist == params->reads &&
+      message.command == SSH_FXP_DATA && num > 0 && num <= size &&
+      num <= rreq->len && num == message.length - 9)
+    {
+      if ((ret = sshv2_read_data (request, buf, num, request->datafd)) < 0)
+        return (ret);
+
+      return (num);
+    }
+
+  /* This one has to wait in the queue until its turn comes */
+  message.buffer = g_malloc (message.length);
+  memcpy (message.buffer, start, sizeof (start));
+  if ((ret = sshv2_read_data (request, message.buffer + sizeof (start),
+                              message.length - 1 - sizeof (start),
+                              request->datafd)) < 0)
+    {
+      sshv2_message_free (&message);
+      return (ret);
+    }
+
+  message.buffer[message.length - 1] = '\0';
+  message.pos = message.buffer;
+  message.end = message.buffer + message.length - 1;
+
+  sshv2_log_command (request, gftp_logging_recv, message.command, 
+                     message.buffer, message.length);
+
+  memcpy (&rreq->message, &message, sizeof (message));
+  return (0);
+}
+
+
+static void
+sshv2_remove_first_read (sshv2_params * params)
+{
+  GList * templist;
+  sshv2_read * rreq;
+
+  templist = params->reads;
+  rreq = templist->data;
+  sshv2_message_free (&rreq->message);
+  g_free (rreq);
+
+  params->reads = g_list_remove_link (params->reads, templist);
+  g_list_free_1 (templist);
+  params->num_reads--;
+}
+
+
+/* Called once num bytes of the first read in the queue were handed out */
+
+static int
+sshv2_first_read_done (gftp_request * request, guint32 num)
+{
+  sshv2_params * params;
+  sshv2_read * rreq;
+
+  params = request->protocol_data;
+  rreq = params->reads->data;
+
+  if (num < rreq->len)
+    {
+      /* A short read. The later reads are already at higher offsets, so
+         ask for the rest of this one again. */
+      rreq->offset += num;
+      rreq->len -= num;
+      rreq->done = 0;
+      sshv2_message_free (&rreq->message);
+
+      return (sshv2_send_read (request, rreq));
+    }
+
+  sshv2_remove_first_read (params);
+  return (0);
+}
+
+
+/* Waits for the replies to all of the reads that are still outstanding and
+   throws them away. This has to happen before anything else is sent. */
+
+static int
+sshv2_drain_reads (gftp_request * request)
+{
+  sshv2_params * params;
+  sshv2_read * rreq;
+  int ret;
+
+  params = request->protocol_data;
+  params->read_eof = 1;
+  params->dont_log_status = 1;
+
+  ret = 0;
+  while (params->reads != NULL)
+    {
+      rreq = params->reads->data;
+      if (rreq->message.buffer != NULL)
+        sshv2_remove_first_read (params);
+      else if ((ret = sshv2_read_reply (request, NULL, 0)) < 0)
+        break;
+    }
+
+  params->dont_log_status = 0;
+  sshv2_free_reads (params);
+  return (ret);
+}
+
+
+static int
+sshv2_read_write_status (gftp_request * request)
+{
+  sshv2_params * params;
+  sshv2_message message;
+  int ret;
+
+  params = request->protocol_data;
+
+  memset (&message, 0, sizeof (message));
+  params->dont_log_status = 1;
+  ret = sshv2_read_response (request, &message, -1);
+  params->dont_log_status = 0;
+
+  if (ret < 0)
+    return (ret);
+
+  params->num_writes--;
+  if (ret != SSH_FXP_STATUS)
+    return (sshv2_wrong_response (request, &message));
+
+  message.pos += 4;
+  ret = sshv2_buffer_get_int32 (request, &message, SSH_FX_OK, 1, NULL);
+  sshv2_message_free (&message);
+
+  return (ret < 0 ? ret : 0);
+}
+
+
+/* Collects the status of every write that is still outstanding. Returns the
+   first error. */
+
+static int
+sshv2_drain_writes (gftp_request * request)
+{
+  sshv2_params * params;
+  int ret, tmpret;
+
+  params = request->protocol_data;
+
+  ret = 0;
+  while (params->num_writes > 0 && request->datafd > 0)
+    {
+      if ((tmpret = sshv2_read_write_status (request)) < 0 && ret == 0)
+        ret = tmpret;
+    }
+
+  params->num_writes = 0;
+  return (ret);
 }
 
 
@@ -1268,8 +1842,8 @@ sshv2_end_transfer (gftp_request * request)
 {
   sshv2_params * params;
   sshv2_message message;
+  int ret, write_ret;
   guint32 len;
-  int ret;
 
   g_return_val_if_fail (request != NULL, GFTP_EFATAL);
   g_return_val_if_fail (request->protonum == GFTP_SSHV2_NUM, GFTP_EFATAL);
@@ -1282,6 +1856,14 @@ sshv2_end_transfer (gftp_request * request)
       params->count = 0;
     }
 
+  if (params->reads != NULL && (ret = sshv2_drain_reads (request)) < 0)
+    return (ret);
+
+  /* A write that failed is reported after the handle is closed */
+  write_ret = 0;
+  if (params->num_writes > 0)
+    write_ret = sshv2_drain_writes (request);
+
   if (params->handle_len > 0)
     {
       len = htonl (params->id++);
@@ -1306,7 +1888,7 @@ sshv2_end_transfer (gftp_request * request)
       params->transfer_buffer = NULL;
     }
 
-  return (0);
+  return (write_ret);
 }
 
 
@@ -1816,6 +2398,8 @@ sshv2_open_file (gftp_request * request, const char *file, off_t startsize,
 
   params = request->protocol_data;
   params->offset = startsize;
+  params->read_offset = startsize;
+  params->read_eof = 0;
 
   len = 8; /* For mode */
   tempstr = sshv2_initialize_string_with_path (request, file, &len, &endpos);
@@ -1885,29 +2469,18 @@ sshv2_put_file (gftp_request * request, const char *file,
 }
 
 
-static void
-sshv2_setup_file_offset (sshv2_params * params, char *buf)
-{
-  guint32 hinum, lownum;
-#ifdef G_HAVE_GINT64
-  hinum = htonl(params->offset >> 32);
-  lownum = htonl((guint32) params->offset);
-#else
-  hinum = 0;
-  lownum = htonl (params->offset);
-#endif
-
-  memcpy (buf + params->handle_len, &hinum, 4);
-  memcpy (buf + params->handle_len + 4, &lownum, 4);
-}
-
+/* Keeps up to ssh_requests_in_flight reads outstanding so that a download
+   is not limited to one chunk per round trip. The data is handed out in
+   file order no matter which order the replies come back in. */
 
 static ssize_t 
 sshv2_get_next_file_chunk (gftp_request * request, char *buf, size_t size)
 {
   sshv2_params * params;
   sshv2_message message;
+  sshv2_read * rreq;
   guint32 num;
+  size_t len;
   int ret;
 
   g_return_val_if_fail (request != NULL, GFTP_EFATAL);
@@ -1924,58 +2497,90 @@ sshv2_get_next_file_chunk (gftp_request * request, char *buf, size_t size)
       memcpy (params->transfer_buffer, params->handle, params->handle_len);
     }
 
-  num = htonl (params->id++);
-  memcpy (params->transfer_buffer, &num, 4);
-
-  sshv2_setup_file_offset (params, params->transfer_buffer);
+  if (params->read_eof)
+    return (0);
 
-  num = htonl (size);
-  memcpy (params->transfer_buffer + params->handle_len + 8, &num, 4);
-  
-  if ((ret = sshv2_send_command (request, SSH_FXP_READ, params->transfer_buffer,
-                                 params->handle_len + 12)) < 0)
+  if ((ret = sshv2_fill_read_window (request, size)) < 0)
     return (ret);
 
-  memset (&message, 0, sizeof (message));
-  if ((ret = sshv2_read_response (request, &message, -1)) != SSH_FXP_DATA)
+  rreq = params->reads->data;
+  while (rreq->message.buffer == NULL)
     {
-      if (ret < 0)
+      if ((ret = sshv2_read_reply (request, buf, size)) < 0)
         return (ret);
+      else if (ret > 0)
+        {
+          /* The data went straight into buf */
+          params->offset += ret;
+          len = ret;
 
-      message.pos += 4;
-      if ((ret = sshv2_buffer_get_int32 (request, &message, SSH_FX_EOF, 1,
-                                         NULL)) < 0)
-        return (ret); 
+          if ((ret = sshv2_first_read_done (request, len)) < 0)
+            return (ret);
+
+          return (len);
+        }
+    }
 
+  if (rreq->message.command != SSH_FXP_DATA)
+    {
+      /* Take the reply off the queue first since an error disconnects */
+      memcpy (&message, &rreq->message, sizeof (message));
+      memset (&rreq->message, 0, sizeof (rreq->message));
+      sshv2_remove_first_read (params);
+
+      message.pos += 4;
+      ret = sshv2_buffer_get_int32 (request, &message, SSH_FX_EOF, 1, NULL);
       sshv2_message_free (&message);
-      return (0);
+
+      /* The reads after this one are past the end of the file too */
+      if (request->datafd > 0)
+        sshv2_drain_reads (request);
+      else
+        sshv2_free_reads (params);
+
+      return (ret < 0 ? ret : 0);
     }
 
-  memcpy (&num, message.buffer + 4, 4);
+  memcpy (&num, rreq->message.buffer + 4, 4);
   num = ntohl (num);
-  if (num > size)
+  if (num > rreq->len || num > rreq->message.length - 9)
     {
       request->logging_function (gftp_logging_error, request,
                              _("Error: Message size %d too big from server\n"),
                              num);
-      sshv2_message_free (&message);
       gftp_disconnect (request);
       return (GFTP_ERETRYABLE);
-        
+    }
+  else if (num == 0)
+    {
+      sshv2_drain_reads (request);
+      return (0);
     }
 
-  memcpy (buf, message.buffer + 8, num);
-  sshv2_message_free (&message);
-  params->offset += num;
-  return (num);
+  len = num - rreq->done;
+  if (len > size)
+    len = size;
+
+  memcpy (buf, rreq->message.buffer + 8 + rreq->done, len);
+  rreq->done += len;
+  params->offset += len;
+
+  if (rreq->done == num && (ret = sshv2_first_read_done (request, num)) < 0)
+    return (ret);
+
+  return (len);
 }
 
 
+/* Sends up to ssh_requests_in_flight writes before waiting for the first
+   status to come back. A failed write is reported by a later call or by
+   sshv2_end_transfer(). */
+
 static ssize_t 
 sshv2_put_next_file_chunk (gftp_request * request, char *buf, size_t size)
 {
+  intptr_t requests_in_flight;
   sshv2_params * params;
-  sshv2_message message;
   guint32 num;
   int ret;
 
@@ -1986,9 +2591,20 @@ sshv2_put_next_file_chunk (gftp_request * request, char *buf, size_t size)
 
   params = request->protocol_data;
 
+  gftp_lookup_request_option (request, "ssh_requests_in_flight",
+                              &requests_in_flight);
+  if (requests_in_flight < 1)
+    requests_in_flight = 1;
+
+  while (params->num_writes >= requests_in_flight)
+    {
+      if ((ret = sshv2_read_write_status (request)) < 0)
+        return (ret);
+    }
+
   if (params->transfer_buffer == NULL)
     {
-      params->transfer_buffer_len = params->handle_len + size + 12;
+      params->transfer_buffer_len = params->handle_len + 12;
       params->transfer_buffer = g_malloc0 (params->transfer_buffer_len);
       memcpy (params->transfer_buffer, params->handle, params->handle_len);
     }
@@ -1996,37 +2612,18 @@ sshv2_put_next_file_chunk (gftp_request * request, char *buf, size_t size)
   num = htonl (params->id++);
   memcpy (params->transfer_buffer, &num, 4);
 
-  sshv2_setup_file_offset (params, params->transfer_buffer);
+  sshv2_setup_file_offset (params, params->transfer_buffer, params->offset);
 
   num = htonl (size);
   memcpy (params->transfer_buffer + params->handle_len + 8, &num, 4);
-  memcpy (params->transfer_buffer + params->handle_len + 12, buf, size);
   
-  if ((ret = sshv2_send_command (request, SSH_FXP_WRITE,
-                                 params->transfer_buffer,
-                                 params->transfer_buffer_len)) < 0)
+  if ((ret = sshv2_send_command_with_data (request, SSH_FXP_WRITE,
+                                           params->transfer_buffer,
+                                           params->handle_len + 12,
+                                           buf, size)) < 0)
     return (ret);
 
-  memset (&message, 0, sizeof (message));
-  params->dont_log_status = 1;
-  ret = sshv2_read_response (request, &message, -1);
-  if (ret < 0)
-    return (ret);
-
-  params->dont_log_status = 0;
-  if (ret != SSH_FXP_STATUS)
-    return (sshv2_wrong_response (request, &message));
-
-  message.pos += 4;
-  if ((ret = sshv2_buffer_get_int32 (request, &message, SSH_FX_OK, 1, &num)) < 0)
-    {
-      if (num == SSH_FX_EOF)
-        return (0);
-
-      return (ret);
-    }
-
-  sshv2_message_free (&message);
+  params->num_writes++;
   params->offset += size;
   return (size);
 }
@@ -2055,6 +2652,44 @@ sshv2_swap_socks (gftp_request * dest, gftp_request * source)
 }
 
 
+static pid_t
+sshv2_exec_command (gftp_request * request, const char *command, int *fd,
+                    int *errfd)
+{
+  char **args;
+  pid_t child;
+  int ret;
+
+  g_return_val_if_fail (request != NULL, GFTP_EFATAL);
+  g_return_val_if_fail (request->protonum == GFTP_SSHV2_NUM, GFTP_EFATAL);
+  g_return_val_if_fail (command != NULL, GFTP_EFATAL);
+
+  /* This is a separate ssh session next to the SFTP one. With ssh_multiplex
+     enabled it is only another channel on the same connection */
+  args = sshv2_gen_exec_args (request, command);
+
+  child = gftp_exec (request, fd, errfd, args);
+
+  if (child == 0)
+    exit (0);
+
+  sshv2_free_args (args);
+
+  if (child < 0)
+    return (GFTP_ERETRYABLE);
+
+  if ((ret = sshv2_start_login_sequence (request, *fd, *errfd)) < 0)
+    {
+      kill (child, SIGTERM);
+      close (*fd);
+      close (*errfd);
+      return (ret);
+    }
+
+  return (child);
+}
+
+
 void 
 sshv2_register_module (void)
 {
@@ -2068,6 +2703,7 @@ sshv2_copy_message (sshv2_message * src_message, sshv2_message * dest_message)
   dest_message->length = src_message->length;
   dest_message->command = src_message->command;
   dest_message->buffer = g_strdup (src_message->buffer);
+  dest_message->in_recv_buffer = 0;
   dest_message->pos = dest_message->buffer + (src_message->pos - src_message->buffer);
   dest_message->end = dest_message->buffer + (src_message->end - src_message->buffer);
 }
@@ -2100,6 +2736,12 @@ sshv2_copy_param_options (gftp_request * dest_request,
   dparms->initialized = sparms->initialized;
   dparms->dont_log_status = sparms->dont_log_status;
   dparms->offset = sparms->offset;
+  dparms->max_packet_len = sparms->max_packet_len;
+  dparms->reads = NULL;
+  dparms->num_reads = 0;
+  dparms->num_writes = 0;
+  dparms->read_offset = sparms->read_offset;
+  dparms->read_eof = sparms->read_eof;
 }
 
 
@@ -2142,6 +2784,10 @@ sshv2_init (gftp_request * request)
   request->parse_url = NULL;
   request->set_config_options = sshv2_set_config_options;
   request->swap_socks = sshv2_swap_socks;
+  request->exec_command = sshv2_exec_command;
+  request->check_connection = NULL;
+  request->prefetch_file = NULL;
+  request->prefetch_listings = NULL;
   request->url_prefix = "ssh2";
   request->need_hostport = 1;
   request->need_username = 1;
@@ -2149,11 +2795,14 @@ sshv2_init (gftp_request * request)
   request->use_cache = 1;
   request->always_connected = 0;
   request->use_local_encoding = 0;
+  request->ranged_get = 1;
+  request->max_trans_blksize = SSH_MAX_TRANSFER_SIZE;
   request->protocol_data = g_malloc0 (sizeof (sshv2_params));
   request->server_type = GFTP_DIRTYPE_UNIX;
 
   params = request->protocol_data;
   params->id = 1;
+  params->max_packet_len = SSH_MAX_STRING_SIZE;
 
   return (gftp_set_config_options (request));
 }
@@ -41,6 +41,10 @@ static gftp_config_vars config_vars[] =
   {"verify_ssl_peer", N_("Verify SSL Peer"),
   gftp_option_type_checkbox, GINT_TO_POINTER(1), NULL, 0,
    N_("Verify SSL Peer"), GFTP_PORT_ALL, NULL},
+  {"enable_ktls", N_("Use kernel TLS"),
+   gftp_option_type_checkbox, GINT_TO_POINTER(0), NULL, 0,
+   N_("Let the kernel encrypt and decrypt the SSL records once the connection is set up. This needs Linux with the tls module and OpenSSL 3.0 or newer built with kernel TLS support. It also lets encrypted uploads be sent straight from the file with sendfile()."),
+   GFTP_PORT_ALL, NULL},
 
   {NULL, NULL, 0, NULL, NULL, 0, NULL, 0, NULL}
 };  
@@ -49,6 +53,11 @@ static GMutex ** gftp_ssl_mutexes = NULL;
 static volatile int gftp_ssl_initialized = 0;
 static SSL_CTX * ctx = NULL;
 
+/* The last session of each host:port, so that the next connection to it can
+   resume the session instead of doing a full handshake */
+static GStaticMutex session_cache_mutex = G_STATIC_MUTEX_INIT;
+static GHashTable * session_cache = NULL;
+
 struct CRYPTO_dynlock_value
 { 
   GMutex * mutex;
@@ -114,7 +123,7 @@ gftp_ssl_verify_callback (int ok, X509_STORE_CTX *store)
 
 
 static int
-gftp_ssl_post_connection_check (gftp_request * request)
+gftp_ssl_post_connection_check (gftp_request * request, SSL * ssl)
 {
   char data[256], *extstr;
   int extcount, ok, i, j;
@@ -123,7 +132,7 @@ gftp_ssl_post_connection_check (gftp_request * request)
   X509 *cert;
  
   ok = 0;
-  if (!(cert = SSL_get_peer_certificate (request->ssl)))
+  if (!(cert = SSL_get_peer_certificate (ssl)))
     {
       request->logging_function (gftp_logging_error, request,
                                  _("Cannot get peer certificate\n"));
@@ -202,7 +211,7 @@ gftp_ssl_post_connection_check (gftp_request * request)
  
   X509_free (cert);
 
-  return (SSL_get_verify_result(request->ssl));
+  return (SSL_get_verify_result(ssl));
 }
 
 
@@ -334,88 +343,286 @@ gftp_ssl_startup (gftp_request * request)
 }
 
 
-int
-gftp_ssl_session_setup (gftp_request * request)
+static gboolean
+_gftp_ssl_free_cached_session (gpointer key, gpointer value, gpointer data)
 {
-  intptr_t verify_ssl_peer;
+  g_free (key);
+  SSL_SESSION_free (value);
+  return (TRUE);
+}
+
+
+static SSL_SESSION *
+_gftp_ssl_get_cached_session (gftp_request * request)
+{
+  SSL_SESSION * session;
+  char *key;
+
+  if (request->hostname == NULL)
+    return (NULL);
+
+  key = g_strdup_printf ("%s:%d", request->hostname, request->port);
+
+  if (g_thread_supported ())
+    g_static_mutex_lock (&session_cache_mutex);
+
+  session = NULL;
+  if (session_cache != NULL &&
+      (session = g_hash_table_lookup (session_cache, key)) != NULL)
+    {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+      SSL_SESSION_up_ref (session);
+#else
+      CRYPTO_add (&session->references, 1, CRYPTO_LOCK_SSL_SESSION);
+#endif
+    }
+
+  if (g_thread_supported ())
+    g_static_mutex_unlock (&session_cache_mutex);
+
+  g_free (key);
+  return (session);
+}
+
+
+static void
+_gftp_ssl_cache_session (gftp_request * request, SSL * ssl)
+{
+  gpointer oldkey, oldsession;
+  SSL_SESSION * session;
+  char *key;
+
+  if (request->hostname == NULL ||
+      (session = SSL_get1_session (ssl)) == NULL)
+    return;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+  /* A TLS 1.3 session cannot be resumed until the server has sent a ticket
+     for it */
+  if (!SSL_SESSION_is_resumable (session))
+    {
+      SSL_SESSION_free (session);
+      return;
+    }
+#endif
+
+  key = g_strdup_printf ("%s:%d", request->hostname, request->port);
+
+  if (g_thread_supported ())
+    g_static_mutex_lock (&session_cache_mutex);
+
+  if (session_cache == NULL)
+    session_cache = g_hash_table_new (string_hash_function,
+                                      string_hash_compare);
+
+  if (g_hash_table_lookup_extended (session_cache, key, &oldkey, &oldsession))
+    {
+      g_hash_table_remove (session_cache, key);
+      _gftp_ssl_free_cached_session (oldkey, oldsession, NULL);
+    }
+  else if (g_hash_table_size (session_cache) >= GFTP_SSL_SESSION_CACHE_MAX)
+    g_hash_table_foreach_remove (session_cache, _gftp_ssl_free_cached_session,
+                                 NULL);
+
+  g_hash_table_insert (session_cache, key, session);
+
+  if (g_thread_supported ())
+    g_static_mutex_unlock (&session_cache_mutex);
+}
+
+
+/* Does the SSL handshake on fd. If session is not NULL, then the server is
+   asked to resume it. The caller disconnects if this fails. */
+
+static int
+_gftp_ssl_connect (gftp_request * request, int fd, SSL_SESSION * session,
+                   SSL ** ssl)
+{
+  intptr_t verify_ssl_peer, enable_ktls;
+#ifdef SSL_OP_ENABLE_KTLS
+  int ktls_send, ktls_recv;
+#endif
   BIO * bio;
   long ret;
 
-  g_return_val_if_fail (request->datafd > 0, GFTP_EFATAL);
-
   if (!gftp_ssl_initialized)
     {
       request->logging_function (gftp_logging_error, request,
                                  _("Error: SSL engine was not initialized\n"));
-      gftp_disconnect (request);
       return (GFTP_EFATAL);
     }
 
   /* FIXME - take this out. I need to find out how to do timeouts with the SSL
      functions (a select() or poll() like function) */
 
-  if (gftp_fd_set_sockblocking (request, request->datafd, 0) < 0)
-    {
-      gftp_disconnect (request);
-      return (GFTP_ERETRYABLE);
-    }
+  if (gftp_fd_set_sockblocking (request, fd, 0) < 0)
+    return (GFTP_ERETRYABLE);
 
   if ((bio = BIO_new (BIO_s_socket ())) == NULL)
     {
       request->logging_function (gftp_logging_error, request,
                                  _("Error setting up SSL connection (BIO object)\n"));
-      gftp_disconnect (request);
       return (GFTP_EFATAL);
     }
 
-  BIO_set_fd (bio, request->datafd, BIO_NOCLOSE);
+  BIO_set_fd (bio, fd, BIO_NOCLOSE);
 
-  if ((request->ssl = SSL_new (ctx)) == NULL)
+  if ((*ssl = SSL_new (ctx)) == NULL)
     {
       request->logging_function (gftp_logging_error, request,
                                  _("Error setting up SSL connection (SSL object)\n"));
-      gftp_disconnect (request);
+      BIO_free (bio);
       return (GFTP_EFATAL);
     }
 
-  SSL_set_bio (request->ssl, bio, bio);
-  SSL_set_ex_data (request->ssl, gftp_ssl_get_index (), request);
+  SSL_set_bio (*ssl, bio, bio);
+  SSL_set_ex_data (*ssl, gftp_ssl_get_index (), request);
+
+  if (session != NULL)
+    SSL_set_session (*ssl, session);
+
+  gftp_lookup_request_option (request, "enable_ktls", &enable_ktls);
+#ifdef SSL_OP_ENABLE_KTLS
+  if (enable_ktls)
+    SSL_set_options (*ssl, SSL_OP_ENABLE_KTLS);
+#endif
 
-  if (SSL_connect (request->ssl) <= 0)
+  if (SSL_connect (*ssl) <= 0)
     {
-      gftp_disconnect (request);
+      SSL_free (*ssl);
+      *ssl = NULL;
       return (GFTP_EFATAL);
     }
 
   gftp_lookup_request_option (request, "verify_ssl_peer", &verify_ssl_peer);
 
   if (verify_ssl_peer && 
-      (ret = gftp_ssl_post_connection_check (request)) != X509_V_OK)
+      (ret = gftp_ssl_post_connection_check (request, *ssl)) != X509_V_OK)
     {
       if (ret != X509_V_ERR_APPLICATION_VERIFICATION)
         request->logging_function (gftp_logging_error, request,
                                    _("Error with peer certificate: %s\n"),
                                    X509_verify_cert_error_string (ret));
-      gftp_disconnect (request);
+      SSL_free (*ssl);
+      *ssl = NULL;
       return (GFTP_EFATAL);
     }
 
-  request->logging_function (gftp_logging_misc, request,
-                             "SSL connection established using %s (%s)\n", 
-                             SSL_get_cipher_version (request->ssl), 
-                             SSL_get_cipher_name (request->ssl));
+  if (SSL_session_reused (*ssl))
+    request->logging_function (gftp_logging_misc, request,
+                               "SSL session resumed using %s (%s)\n", 
+                               SSL_get_cipher_version (*ssl), 
+                               SSL_get_cipher_name (*ssl));
+  else
+    request->logging_function (gftp_logging_misc, request,
+                               "SSL connection established using %s (%s)\n", 
+                               SSL_get_cipher_version (*ssl), 
+                               SSL_get_cipher_name (*ssl));
+
+#ifdef SSL_OP_ENABLE_KTLS
+  if (enable_ktls)
+    {
+      /* OpenSSL quietly stays in user space if the kernel cannot do the
+         cipher */
+      ktls_send = BIO_get_ktls_send (SSL_get_wbio (*ssl));
+      ktls_recv = BIO_get_ktls_recv (SSL_get_rbio (*ssl));
+      if (ktls_send || ktls_recv)
+        request->logging_function (gftp_logging_misc, request,
+                                   _("Kernel TLS is used for sending: %s, receiving: %s\n"),
+                                   ktls_send ? _("yes") : _("no"),
+                                   ktls_recv ? _("yes") : _("no"));
+      else
+        request->logging_function (gftp_logging_misc, request,
+                                   _("Kernel TLS is not available for this connection\n"));
+    }
+#else
+  if (enable_ktls)
+    request->logging_function (gftp_logging_misc, request,
+                               _("Kernel TLS is not supported by this OpenSSL library\n"));
+#endif
+
+  return (0);
+}
+
+
+int
+gftp_ssl_session_setup (gftp_request * request)
+{
+  SSL_SESSION * session;
+  int ret;
+
+  g_return_val_if_fail (request->datafd > 0, GFTP_EFATAL);
+
+  session = _gftp_ssl_get_cached_session (request);
+  ret = _gftp_ssl_connect (request, request->datafd, session, &request->ssl);
+  if (session != NULL)
+    SSL_SESSION_free (session);
+
+  if (ret < 0)
+    {
+      gftp_disconnect (request);
+      return (ret);
+    }
 
+  _gftp_ssl_cache_session (request, request->ssl);
   return (0);
 }
 
 
+/* Sets up SSL on a data connection, such as the one for an FTPS transfer.
+   It resumes the session of the control connection. Some servers refuse
+   data connections that do not. */
+
+int
+gftp_ssl_data_session_setup (gftp_request * request, int fd, SSL ** ssl)
+{
+  SSL_SESSION * session;
+  int ret;
+
+  g_return_val_if_fail (request->ssl != NULL, GFTP_EFATAL);
+  g_return_val_if_fail (fd > 0, GFTP_EFATAL);
+
+  session = SSL_get1_session (request->ssl);
+  ret = _gftp_ssl_connect (request, fd, session, ssl);
+  if (session != NULL)
+    SSL_SESSION_free (session);
+
+  if (ret < 0)
+    {
+      request->logging_function (gftp_logging_error, request,
+                                 _("Cannot set up SSL on the data connection\n"));
+      gftp_disconnect (request);
+    }
+
+  return (ret);
+}
+
+
+/* Called by gftp_disconnect(). By now a TLS 1.3 server has sent its session
+   ticket, so this is the session that the next connection resumes. */
+
+void
+gftp_ssl_free (gftp_request * request)
+{
+  g_return_if_fail (request != NULL);
+
+  if (request->ssl == NULL)
+    return;
+
+  _gftp_ssl_cache_session (request, request->ssl);
+  SSL_free (request->ssl);
+  request->ssl = NULL;
+}
+
+
 ssize_t 
-gftp_ssl_read (gftp_request * request, void *ptr, size_t size, int fd)
+gftp_ssl_session_read (gftp_request * request, SSL * ssl, void *ptr,
+                       size_t size)
 {
   ssize_t ret;
   int err;
 
-  g_return_val_if_fail (request->ssl != NULL, GFTP_EFATAL);
+  g_return_val_if_fail (ssl != NULL, GFTP_EFATAL);
 
   if (!gftp_ssl_initialized)
     {
@@ -428,9 +635,9 @@ gftp_ssl_read (gftp_request * request, void *ptr, size_t size, int fd)
   ret = 0;
   do
     {
-      if ((ret = SSL_read (request->ssl, ptr, size)) < 0)
+      if ((ret = SSL_read (ssl, ptr, size)) < 0)
         { 
-          err = SSL_get_error (request->ssl, ret);
+          err = SSL_get_error (ssl, ret);
           if (errno == EINTR || errno == EAGAIN)
             {
               if (request->cancel)
@@ -459,11 +666,12 @@ gftp_ssl_read (gftp_request * request, void *ptr, size_t size, int fd)
 
 
 ssize_t 
-gftp_ssl_write (gftp_request * request, const char *ptr, size_t size, int fd)
+gftp_ssl_session_write (gftp_request * request, SSL * ssl, const char *ptr,
+                        size_t size)
 {
   size_t ret, w_ret;
  
-  g_return_val_if_fail (request->ssl != NULL, GFTP_EFATAL);
+  g_return_val_if_fail (ssl != NULL, GFTP_EFATAL);
 
   if (!gftp_ssl_initialized)
     {
@@ -475,7 +683,7 @@ gftp_ssl_write (gftp_request * request, const char *ptr, size_t size, int fd)
   ret = 0;
   do
     {
-      w_ret = SSL_write (request->ssl, ptr, size);
+      w_ret = SSL_write (ssl, ptr, size);
       if (w_ret <= 0)
         {
           if (errno == EINTR || errno == EAGAIN)
@@ -506,4 +714,36 @@ gftp_ssl_write (gftp_request * request, const char *ptr, size_t size, int fd)
   return (ret);
 }
 
+
+/* Returns the socket of ssl if the kernel encrypts what is written to it,
+   so that sendfile() and splice() can write the file data to it directly.
+   Returns -1 otherwise. */
+
+int
+gftp_ssl_get_ktls_send_fd (SSL * ssl)
+{
+  g_return_val_if_fail (ssl != NULL, -1);
+
+#ifdef SSL_OP_ENABLE_KTLS
+  if (BIO_get_ktls_send (SSL_get_wbio (ssl)))
+    return (SSL_get_fd (ssl));
+#endif
+
+  return (-1);
+}
+
+
+ssize_t 
+gftp_ssl_read (gftp_request * request, void *ptr, size_t size, int fd)
+{
+  return (gftp_ssl_session_read (request, request->ssl, ptr, size));
+}
+
+
+ssize_t 
+gftp_ssl_write (gftp_request * request, const char *ptr, size_t size, int fd)
+{
+  return (gftp_ssl_session_write (request, request->ssl, ptr, size));
+}
+
 #endif
@@ -0,0 +1,768 @@
+/*****************************************************************************/
+/*  transfer-journal.c - saves the transfer queue so it survives a restart   */
+/*  Copyright (C) 1998-2008 Brian Masney <masneyb@gftp.org>                  */
+/*                                                                           */
+/*  This program is free software; you can redistribute it and/or modify     */
+/*  it under the terms of the GNU General Public License as published by     */
+/*  the Free Software Foundation; either version 2 of the License, or        */
+/*  (at your option) any later version.                                      */
+/*                                                                           */
+/*  This program is distributed in the hope that it will be useful,          */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of           */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            */
+/*  GNU General Public License for more details.                             */
+/*                                                                           */
+/*  You should have received a copy of the GNU General Public License        */
+/*  along with this program; if not, write to the Free Software              */
+/*  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA      */
+/*****************************************************************************/
+
+#include "gftp.h"
+static const char cvsid[] = "$Id$";
+
+/* The transfer queue is journaled to TRANSFER_QUEUE_FILE. The journal is
+   only ever appended to while gFTP is running. Each line is one record and
+   the fields are separated by tabs. A \, tab or newline inside of a field is
+   escaped with a \.
+
+   T id <from request> <to request>
+                        A new transfer. Each request is written as the
+                        protocol, hostname, port, username, scrambled
+                        password, account and directory
+   F id index size startsize mode datetime action file destfile
+                        A file or directory in the transfer
+   S id index           The contents of the directory have not been added
+                        to the transfer yet
+   L id index           The contents of the directory were added
+   B id index           The directory is copied in one piece by
+                        gftp_bulk_transfer_dir()
+   P id index offset    The first offset bytes of the file have been written
+   D id index           The file is finished or was skipped
+   X id                 The transfer was removed from the queue
+
+   gftp_journal_load() reads the journal back in and writes the transfers
+   that are not finished into a new journal. Only one copy of gFTP uses the
+   journal at a time; it is locked with fcntl() */
+
+#define GFTP_JOURNAL_MAX_FIELDS		17
+
+typedef struct gftp_journal_entry_tag
+{
+  gftp_transfer * tdata;
+  GPtrArray * files;
+  unsigned int removed : 1;
+} gftp_journal_entry;
+
+static GStaticMutex journal_mutex = G_STATIC_MUTEX_INIT;
+static int journal_fd = -1;
+static int journal_disabled = 0;
+static int journal_clean = 0;		/* Every transfer in the journal was
+                                           written by us */
+static long journal_next_id = 1;
+static long journal_live_transfers = 0;
+static char journal_buf[32768];
+static size_t journal_buflen = 0;
+
+
+static int
+_gftp_journal_lock (int fd)
+{
+  struct flock lck;
+
+  memset (&lck, 0, sizeof (lck));
+  lck.l_type = F_WRLCK;
+  lck.l_whence = SEEK_SET;
+  return (fcntl (fd, F_SETLK, &lck));
+}
+
+
+static int
+_gftp_journal_enabled (void)
+{
+  intptr_t journal_transfers;
+
+  if (journal_disabled)
+    return (0);
+
+  gftp_lookup_global_option ("journal_transfers", &journal_transfers);
+  return (journal_transfers != 0);
+}
+
+
+static int
+_gftp_journal_open (void)
+{
+  struct stat st;
+  char *filename;
+
+  if (journal_fd >= 0)
+    return (0);
+  else if (!_gftp_journal_enabled ())
+    return (-1);
+
+  filename = gftp_expand_path (NULL, TRANSFER_QUEUE_FILE);
+  journal_fd = gftp_fd_open (NULL, filename, O_WRONLY | O_APPEND | O_CREAT,
+                             S_IRUSR | S_IWUSR);
+  g_free (filename);
+
+  if (journal_fd < 0)
+    {
+      journal_fd = -1;
+      journal_disabled = 1;
+      return (-1);
+    }
+
+  /* Another copy of gFTP has the journal */
+  if (_gftp_journal_lock (journal_fd) == -1)
+    {
+      close (journal_fd);
+      journal_fd = -1;
+      journal_disabled = 1;
+      return (-1);
+    }
+
+  journal_clean = fstat (journal_fd, &st) == 0 && st.st_size == 0;
+  return (0);
+}
+
+
+static void
+_gftp_journal_flush (void)
+{
+  if (journal_buflen > 0 && journal_fd >= 0 &&
+      gftp_fd_write (NULL, journal_buf, journal_buflen, journal_fd) < 0)
+    {
+      close (journal_fd);
+      journal_fd = -1;
+      journal_disabled = 1;
+    }
+
+  journal_buflen = 0;
+}
+
+
+static void
+_gftp_journal_append (const char *str)
+{
+  size_t len;
+
+  len = strlen (str);
+  if (journal_buflen + len > sizeof (journal_buf))
+    _gftp_journal_flush ();
+
+  if (len > sizeof (journal_buf))
+    {
+      if (journal_fd >= 0 && gftp_fd_write (NULL, str, len, journal_fd) < 0)
+        {
+          close (journal_fd);
+          journal_fd = -1;
+          journal_disabled = 1;
+        }
+      return;
+    }
+
+  memcpy (journal_buf + journal_buflen, str, len);
+  journal_buflen += len;
+}
+
+
+static char *
+_gftp_journal_escape (const char *str)
+{
+  char *newstr, *newpos;
+
+  if (str == NULL)
+    return (g_strdup (""));
+
+  newstr = g_malloc0 ((gulong) strlen (str) * 2 + 1);
+  for (newpos = newstr; *str != '\0'; str++)
+    {
+      if (*str == '\\' || *str == '\t' || *str == '\n')
+        {
+          *newpos++ = '\\';
+          *newpos++ = *str == '\t' ? 't' : *str == '\n' ? 'n' : '\\';
+        }
+      else
+        *newpos++ = *str;
+    }
+  *newpos = '\0';
+
+  return (newstr);
+}
+
+
+static void
+_gftp_journal_unescape (char *str)
+{
+  char *pos;
+
+  for (pos = str; *str != '\0'; str++)
+    {
+      if (*str == '\\' && *(str + 1) != '\0')
+        {
+          str++;
+          *pos++ = *str == 't' ? '\t' : *str == 'n' ? '\n' : *str;
+        }
+      else
+        *pos++ = *str;
+    }
+  *pos = '\0';
+}
+
+
+static int
+_gftp_journal_split_line (char *line, char **fields)
+{
+  int num_fields;
+  char *pos;
+
+  num_fields = 0;
+  for (pos = line; num_fields < GFTP_JOURNAL_MAX_FIELDS; pos++)
+    {
+      fields[num_fields++] = pos;
+      if ((pos = strchr (pos, '\t')) == NULL)
+        break;
+      *pos = '\0';
+    }
+
+  return (num_fields);
+}
+
+
+static char *
+_gftp_journal_request_str (gftp_request * request)
+{
+  char *fields[5], *password, *ret;
+  int i;
+
+  if (request->password != NULL && *request->password != '\0')
+    {
+      password = gftp_scramble_password (request->password);
+      fields[2] = _gftp_journal_escape (password);
+      g_free (password);
+    }
+  else
+    fields[2] = g_strdup ("");
+
+  fields[0] = _gftp_journal_escape (request->hostname);
+  fields[1] = _gftp_journal_escape (request->username);
+  fields[3] = _gftp_journal_escape (request->account);
+  fields[4] = _gftp_journal_escape (request->directory);
+
+  ret = g_strdup_printf ("%s\t%s\t%u\t%s\t%s\t%s\t%s",
+                         gftp_protocols[request->protonum].name, fields[0],
+                         request->port, fields[1], fields[2], fields[3],
+                         fields[4]);
+
+  for (i = 0; i < 5; i++)
+    g_free (fields[i]);
+
+  return (ret);
+}
+
+
+/* Must be called with journal_mutex held and the journal open */
+
+static void
+_gftp_journal_add_files (gftp_transfer * tdata, GList * files)
+{
+  char *fromstr, *tostr, *filestr, *deststr, *tempstr;
+  gftp_file * fle;
+
+  if (tdata->journal_id == 0)
+    {
+      tdata->journal_id = journal_next_id++;
+      journal_live_transfers++;
+
+      fromstr = _gftp_journal_request_str (tdata->fromreq);
+      tostr = _gftp_journal_request_str (tdata->toreq);
+      tempstr = g_strdup_printf ("T\t%ld\t%s\t%s\n", tdata->journal_id,
+                                 fromstr, tostr);
+      _gftp_journal_append (tempstr);
+      g_free (tempstr);
+      g_free (fromstr);
+      g_free (tostr);
+    }
+
+  for (; files != NULL; files = files->next)
+    {
+      fle = files->data;
+      fle->journal_index = tdata->journal_files++;
+
+      filestr = _gftp_journal_escape (fle->file);
+      deststr = _gftp_journal_escape (fle->destfile);
+      tempstr = g_strdup_printf ("F\t%ld\t%ld\t" GFTP_OFF_T_PRINTF_MOD "\t"
+                                 GFTP_OFF_T_PRINTF_MOD "\t%u\t%ld\t%d\t%s\t%s\n",
+                                 tdata->journal_id, fle->journal_index,
+                                 (GFTP_OFF_T_PRINTF_CONVERSION) fle->size,
+                                 (GFTP_OFF_T_PRINTF_CONVERSION) fle->startsize,
+                                 (unsigned int) fle->st_mode,
+                                 (long) fle->datetime,
+                                 (int) fle->transfer_action, filestr, deststr);
+      _gftp_journal_append (tempstr);
+      g_free (tempstr);
+      g_free (filestr);
+      g_free (deststr);
+
+      if (fle->list_pending)
+        {
+          tempstr = g_strdup_printf ("S\t%ld\t%ld\n", tdata->journal_id,
+                                     fle->journal_index);
+          _gftp_journal_append (tempstr);
+          g_free (tempstr);
+        }
+
+      if (fle->bulk_transfer)
+        {
+          tempstr = g_strdup_printf ("B\t%ld\t%ld\n", tdata->journal_id,
+                                     fle->journal_index);
+          _gftp_journal_append (tempstr);
+          g_free (tempstr);
+        }
+    }
+}
+
+
+/* Records the files in the journal. The first call for a transfer also
+   records the two requests. */
+
+void
+gftp_journal_add_files (gftp_transfer * tdata, GList * files)
+{
+  g_return_if_fail (tdata != NULL);
+
+  if (g_thread_supported ())
+    g_static_mutex_lock (&journal_mutex);
+
+  if (_gftp_journal_open () == 0)
+    {
+      _gftp_journal_add_files (tdata, files);
+      _gftp_journal_flush ();
+    }
+
+  if (g_thread_supported ())
+    g_static_mutex_unlock (&journal_mutex);
+}
+
+
+static void
+_gftp_journal_write_record (const char *record)
+{
+  if (g_thread_supported ())
+    g_static_mutex_lock (&journal_mutex);
+
+  if (journal_fd >= 0)
+    {
+      _gftp_journal_append (record);
+      _gftp_journal_flush ();
+    }
+
+  if (g_thread_supported ())
+    g_static_mutex_unlock (&journal_mutex);
+}
+
+
+void
+gftp_journal_file_progress (gftp_transfer * tdata, gftp_file * fle,
+                            off_t offset)
+{
+  char tempstr[128];
+
+  g_return_if_fail (tdata != NULL);
+  g_return_if_fail (fle != NULL);
+
+  if (tdata->parent != NULL)
+    tdata = tdata->parent;
+
+  if (tdata->journal_id == 0)
+    return;
+
+  g_snprintf (tempstr, sizeof (tempstr),
+              "P\t%ld\t%ld\t" GFTP_OFF_T_PRINTF_MOD "\n", tdata->journal_id,
+              fle->journal_index, (GFTP_OFF_T_PRINTF_CONVERSION) offset);
+  _gftp_journal_write_record (tempstr);
+}
+
+
+void
+gftp_journal_file_done (gftp_transfer * tdata, gftp_file * fle)
+{
+  char tempstr[64];
+
+  g_return_if_fail (tdata != NULL);
+  g_return_if_fail (fle != NULL);
+
+  if (tdata->parent != NULL)
+    tdata = tdata->parent;
+
+  if (tdata->journal_id == 0)
+    return;
+
+  g_snprintf (tempstr, sizeof (tempstr), "D\t%ld\t%ld\n", tdata->journal_id,
+              fle->journal_index);
+  _gftp_journal_write_record (tempstr);
+}
+
+
+void
+gftp_journal_dir_listed (gftp_transfer * tdata, gftp_file * fle)
+{
+  char tempstr[64];
+
+  g_return_if_fail (tdata != NULL);
+  g_return_if_fail (fle != NULL);
+
+  if (tdata->parent != NULL)
+    tdata = tdata->parent;
+
+  if (tdata->journal_id == 0)
+    return;
+
+  g_snprintf (tempstr, sizeof (tempstr), "L\t%ld\t%ld\n", tdata->journal_id,
+              fle->journal_index);
+  _gftp_journal_write_record (tempstr);
+}
+
+
+void
+gftp_journal_remove_transfer (gftp_transfer * tdata)
+{
+  char tempstr[64];
+
+  g_return_if_fail (tdata != NULL);
+
+  if (tdata->journal_id == 0)
+    return;
+
+  if (g_thread_supported ())
+    g_static_mutex_lock (&journal_mutex);
+
+  if (journal_fd >= 0)
+    {
+      g_snprintf (tempstr, sizeof (tempstr), "X\t%ld\n", tdata->journal_id);
+      _gftp_journal_append (tempstr);
+      _gftp_journal_flush ();
+
+      /* Start over with an empty journal once nothing is left in it */
+      if (--journal_live_transfers == 0 && journal_clean &&
+          journal_fd >= 0 && ftruncate (journal_fd, 0) == -1)
+        journal_clean = 0;
+    }
+
+  tdata->journal_id = 0;
+
+  if (g_thread_supported ())
+    g_static_mutex_unlock (&journal_mutex);
+}
+
+
+static gftp_request *
+_gftp_journal_new_request (char **fields, gftp_logging_func logging_function)
+{
+  gftp_request * request;
+  char *password;
+  int i, protonum;
+
+  for (protonum = 0; gftp_protocols[protonum].name; protonum++)
+    {
+      if (strcmp (gftp_protocols[protonum].name, fields[0]) == 0)
+        break;
+    }
+
+  if (gftp_protocols[protonum].name == NULL)
+    return (NULL);
+
+  for (i = 1; i < 7; i++)
+    _gftp_journal_unescape (fields[i]);
+
+  request = gftp_request_new ();
+  request->logging_function = logging_function;
+
+  if (*fields[1] != '\0')
+    gftp_set_hostname (request, fields[1]);
+  gftp_set_port (request, strtol (fields[2], NULL, 10));
+  if (*fields[3] != '\0')
+    gftp_set_username (request, fields[3]);
+  if (*fields[4] != '\0')
+    {
+      password = gftp_descramble_password (fields[4]);
+      gftp_set_password (request, password);
+      g_free (password);
+    }
+  if (*fields[5] != '\0')
+    gftp_set_account (request, fields[5]);
+  if (*fields[6] != '\0')
+    gftp_set_directory (request, fields[6]);
+
+  if (gftp_protocols[protonum].init (request) < 0)
+    {
+      gftp_request_destroy (request, 1);
+      return (NULL);
+    }
+
+  return (request);
+}
+
+
+static gftp_file *
+_gftp_journal_lookup_file (GHashTable * entries, char **fields)
+{
+  gftp_journal_entry * entry;
+  unsigned long index;
+
+  entry = g_hash_table_lookup (entries,
+                     GUINT_TO_POINTER (strtoul (fields[1], NULL, 10)));
+  if (entry == NULL || entry->tdata == NULL)
+    return (NULL);
+
+  index = strtoul (fields[2], NULL, 10);
+  if (index >= entry->files->len)
+    return (NULL);
+
+  return (g_ptr_array_index (entry->files, index));
+}
+
+
+static void
+_gftp_journal_parse_line (GHashTable * entries, GList ** order, char *line,
+                          gftp_logging_func logging_function)
+{
+  char *fields[GFTP_JOURNAL_MAX_FIELDS];
+  gftp_journal_entry * entry;
+  int num_fields;
+  gftp_file * fle;
+
+  num_fields = _gftp_journal_split_line (line, fields);
+
+  if (*fields[0] == 'T' && num_fields == 16)
+    {
+      entry = g_malloc0 (sizeof (*entry));
+      entry->files = g_ptr_array_new ();
+      g_hash_table_insert (entries,
+                           GUINT_TO_POINTER (strtoul (fields[1], NULL, 10)),
+                           entry);
+      *order = g_list_prepend (*order, entry);
+
+      entry->tdata = gftp_tdata_new ();
+      entry->tdata->fromreq = _gftp_journal_new_request (fields + 2,
+                                                         logging_function);
+      entry->tdata->toreq = _gftp_journal_new_request (fields + 9,
+                                                       logging_function);
+      if (entry->tdata->fromreq == NULL || entry->tdata->toreq == NULL)
+        {
+          free_tdata (entry->tdata);
+          entry->tdata = NULL;
+        }
+    }
+  else if (*fields[0] == 'F' && num_fields == 10)
+    {
+      entry = g_hash_table_lookup (entries,
+                         GUINT_TO_POINTER (strtoul (fields[1], NULL, 10)));
+      if (entry == NULL || entry->tdata == NULL ||
+          strtoul (fields[2], NULL, 10) != entry->files->len)
+        return;
+
+      _gftp_journal_unescape (fields[8]);
+      _gftp_journal_unescape (fields[9]);
+
+      fle = g_malloc0 (sizeof (*fle));
+      fle->size = gftp_parse_file_size (fields[3]);
+      fle->startsize = gftp_parse_file_size (fields[4]);
+      fle->st_mode = strtoul (fields[5], NULL, 10);
+      fle->datetime = strtol (fields[6], NULL, 10);
+      fle->transfer_action = strtol (fields[7], NULL, 10);
+      fle->file = g_strdup (fields[8]);
+      fle->destfile = g_strdup (fields[9]);
+      g_ptr_array_add (entry->files, fle);
+    }
+  else if (*fields[0] == 'P' && num_fields == 4)
+    {
+      if ((fle = _gftp_journal_lookup_file (entries, fields)) != NULL &&
+          fle->transfer_action != GFTP_TRANS_ACTION_SKIP)
+        {
+          fle->startsize = gftp_parse_file_size (fields[3]);
+          fle->transfer_action = GFTP_TRANS_ACTION_RESUME;
+        }
+    }
+  else if (*fields[0] == 'S' && num_fields == 3)
+    {
+      if ((fle = _gftp_journal_lookup_file (entries, fields)) != NULL)
+        fle->list_pending = 1;
+    }
+  else if (*fields[0] == 'L' && num_fields == 3)
+    {
+      if ((fle = _gftp_journal_lookup_file (entries, fields)) != NULL)
+        fle->list_pending = 0;
+    }
+  else if (*fields[0] == 'B' && num_fields == 3)
+    {
+      if ((fle = _gftp_journal_lookup_file (entries, fields)) != NULL)
+        fle->bulk_transfer = 1;
+    }
+  else if (*fields[0] == 'D' && num_fields == 3)
+    {
+      if ((fle = _gftp_journal_lookup_file (entries, fields)) != NULL)
+        fle->transfer_done = 1;
+    }
+  else if (*fields[0] == 'X' && num_fields == 2)
+    {
+      entry = g_hash_table_lookup (entries,
+                         GUINT_TO_POINTER (strtoul (fields[1], NULL, 10)));
+      if (entry != NULL)
+        entry->removed = 1;
+    }
+}
+
+
+static gftp_transfer *
+_gftp_journal_finish_entry (gftp_journal_entry * entry)
+{
+  gftp_transfer * tdata;
+  gftp_file * fle;
+  GList * files;
+  guint i;
+
+  tdata = entry->tdata;
+  files = NULL;
+  for (i = entry->files->len; i > 0; i--)
+    {
+      fle = g_ptr_array_index (entry->files, i - 1);
+
+      /* A directory that was already made but not listed yet is kept
+         around so that its contents are still added to the transfer */
+      if (fle->transfer_done && fle->list_pending)
+        {
+          fle->transfer_done = 0;
+          fle->transfer_action = GFTP_TRANS_ACTION_SKIP;
+        }
+
+      if (tdata == NULL || entry->removed || fle->transfer_done)
+        {
+          gftp_file_destroy (fle, 1);
+          continue;
+        }
+
+      files = g_list_prepend (files, fle);
+      if (S_ISDIR (fle->st_mode))
+        tdata->numdirs++;
+      else
+        tdata->numfiles++;
+
+      if (fle->transfer_action != GFTP_TRANS_ACTION_SKIP)
+        tdata->total_bytes += fle->size;
+    }
+
+  g_ptr_array_free (entry->files, TRUE);
+  g_free (entry);
+
+  if (tdata != NULL && files == NULL)
+    {
+      free_tdata (tdata);
+      return (NULL);
+    }
+
+  if (tdata != NULL)
+    tdata->files = tdata->curfle = files;
+
+  return (tdata);
+}
+
+
+/* Reads in the transfers that were still in the queue when gFTP last
+   exited. The journal is rewritten with just these transfers. This must
+   be called before anything else is added to the journal. */
+
+GList *
+gftp_journal_load (gftp_logging_func logging_function)
+{
+  char *filename, *newfilename, buf[PATH_MAX * 2 + 256];
+  GList * order, * templist, * transfers;
+  gftp_getline_buffer * rbuf;
+  gftp_transfer * tdata;
+  GHashTable * entries;
+  int fd, newfd;
+
+  if (g_thread_supported ())
+    g_static_mutex_lock (&journal_mutex);
+
+  if (journal_fd >= 0 || !_gftp_journal_enabled ())
+    {
+      if (g_thread_supported ())
+        g_static_mutex_unlock (&journal_mutex);
+      return (NULL);
+    }
+
+  filename = gftp_expand_path (NULL, TRANSFER_QUEUE_FILE);
+  newfilename = g_strconcat (filename, ".new", NULL);
+
+  /* The lock is held on the old journal while it is read so that another
+     copy of gFTP that is starting up doesn't load it at the same time */
+  if ((fd = gftp_fd_open (NULL, filename, O_RDWR | O_CREAT,
+                          S_IRUSR | S_IWUSR)) < 0 ||
+      _gftp_journal_lock (fd) == -1 ||
+      (newfd = gftp_fd_open (NULL, newfilename,
+                             O_WRONLY | O_APPEND | O_CREAT | O_TRUNC,
+                             S_IRUSR | S_IWUSR)) < 0)
+    {
+      if (fd >= 0)
+        close (fd);
+
+      journal_disabled = 1;
+      g_free (filename);
+      g_free (newfilename);
+
+      if (g_thread_supported ())
+        g_static_mutex_unlock (&journal_mutex);
+      return (NULL);
+    }
+
+  entries = g_hash_table_new (uint_hash_function, uint_hash_compare);
+  order = NULL;
+
+  rbuf = NULL;
+  while (gftp_get_line (NULL, &rbuf, buf, sizeof (buf), fd) > 0)
+    _gftp_journal_parse_line (entries, &order, buf, logging_function);
+
+  gftp_free_getline_buffer (&rbuf);
+  g_hash_table_destroy (entries);
+
+  _gftp_journal_lock (newfd);
+  journal_fd = newfd;
+  journal_clean = 1;
+
+  transfers = NULL;
+  order = g_list_reverse (order);
+  for (templist = order; templist != NULL; templist = templist->next)
+    {
+      if ((tdata = _gftp_journal_finish_entry (templist->data)) == NULL)
+        continue;
+
+      _gftp_journal_add_files (tdata, tdata->files);
+      transfers = g_list_append (transfers, tdata);
+    }
+
+  g_list_free (order);
+  _gftp_journal_flush ();
+
+  if (journal_fd >= 0 && rename (newfilename, filename) == -1)
+    {
+      close (journal_fd);
+      journal_fd = -1;
+      journal_disabled = 1;
+      unlink (newfilename);
+    }
+
+  close (fd);
+  g_free (filename);
+  g_free (newfilename);
+
+  if (g_thread_supported ())
+    g_static_mutex_unlock (&journal_mutex);
+
+  if (transfers != NULL)
+    logging_function (gftp_logging_misc, NULL,
+                      _("Loaded %d file transfers from the transfer queue\n"),
+                      g_list_length (transfers));
+
+  return (transfers);
+}
@@ -1759,6 +1759,8 @@ main (int argc, char **argv)
   _setup_window1 ();
   _setup_window2 (argc, argv);
 
+  gftpui_common_restore_transfers ();
+
   gtk_main ();
   GDK_THREADS_LEAVE ();
 
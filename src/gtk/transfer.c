@@ -534,6 +534,7 @@ show_transfer (gftp_transfer * tdata)
   gtk_ctree_node_set_row_data (GTK_CTREE (dlwdw), tdata->user_data, transdata);
   tdata->show = 0;
   tdata->curfle = tdata->updfle = tdata->files;
+  tdata->walkfle = NULL;
 
   tdata->total_bytes = 0;
   for (templist = tdata->files; templist != NULL; templist = templist->next)
@@ -870,6 +871,8 @@ update_downloads (gpointer data)
   if (gftpui_common_child_process_done)
     check_done_process ();
 
+  gftp_session_pool_expire ();
+
   for (templist = gftp_file_transfers; templist != NULL;)
     {
       tdata = templist->data;
@@ -877,6 +880,14 @@ update_downloads (gpointer data)
         {
           g_static_mutex_lock (&tdata->structmutex);
 
+          /* Files that the walker added since the last update */
+          if (!tdata->show)
+            {
+              for (; tdata->walkfle != NULL;
+                   tdata->walkfle = tdata->walkfle->next)
+                gftpui_add_file_to_transfer (tdata, tdata->walkfle);
+            }
+
 	  if (tdata->next_file)
 	    on_next_transfer (tdata);
      	  else if (tdata->show) 
@@ -1103,22 +1103,43 @@ gftpui_common_process_command (void *locui, gftp_request * locreq,
 }
 
 
+static void
+_gftpui_common_journal_files (gftp_transfer * tdata, GList * files)
+{
+  gftp_file * tempfle;
+
+  if (files == NULL)
+    return;
+
+  /* Files that are only downloaded to be viewed or edited are not kept
+     across a restart */
+  tempfle = files->data;
+  if (tempfle->done_view || tempfle->done_edit || tempfle->done_rm)
+    return;
+
+  gftp_journal_add_files (tdata, files);
+}
+
+
 gftp_transfer *
 gftpui_common_add_file_transfer (gftp_request * fromreq, gftp_request * toreq,
                                  void *fromuidata, void *touidata,
                                  GList * files)
 {
-  intptr_t append_transfers, one_transfer, overwrite_default;
+  intptr_t append_transfers, one_transfer, overwrite_default, mirror_transfers;
   GList * templist, *curfle;
   gftp_transfer * tdata;
   gftp_file * tempfle;
-  int show_dialog;
+  int show_dialog, list_pending;
   
   gftp_lookup_request_option (fromreq, "overwrite_default", &overwrite_default);
   gftp_lookup_request_option (fromreq, "append_transfers", &append_transfers);
   gftp_lookup_request_option (fromreq, "one_transfer", &one_transfer);
+  gftp_lookup_request_option (fromreq, "mirror_transfers", &mirror_transfers);
 
-  if (!overwrite_default)
+  /* When mirroring, gftp_get_all_subdirs() already decided what to do
+     with the files that exist on the other side */
+  if (!overwrite_default && !mirror_transfers)
     {
       for (templist = files; templist != NULL; templist = templist->next)
         { 
@@ -1132,8 +1153,21 @@ gftpui_common_add_file_transfer (gftp_request * fromreq, gftp_request * toreq,
   else
     show_dialog = 0;
 
+  /* Directories that still have to be walked need a transfer of their own
+     that starts a walker */
+  list_pending = 0;
+  for (templist = files; templist != NULL; templist = templist->next)
+    {
+      tempfle = templist->data;
+      if (tempfle->list_pending)
+        {
+          list_pending = 1;
+          break;
+        }
+    }
+
   tdata = NULL;
-  if (append_transfers && one_transfer && !show_dialog)
+  if (append_transfers && one_transfer && !show_dialog && !list_pending)
     {
       if (g_thread_supported ())
         g_static_mutex_lock (&gftpui_common_transfer_mutex);
@@ -1174,6 +1208,10 @@ gftpui_common_add_file_transfer (gftp_request * fromreq, gftp_request * toreq,
               gftpui_add_file_to_transfer (tdata, curfle);
             }
 
+          /* Otherwise they are journaled when the transfer is started */
+          if (tdata->journal_id != 0)
+            _gftpui_common_journal_files (tdata, files);
+
           if (g_thread_supported ())
             g_static_mutex_unlock (&tdata->structmutex);
 
@@ -1221,6 +1259,8 @@ gftpui_common_add_file_transfer (gftp_request * fromreq, gftp_request * toreq,
 
       if (show_dialog)
         gftpui_ask_transfer (tdata);
+      else
+        _gftpui_common_journal_files (tdata, files);
     }
 
   gftpui_start_transfer (tdata);
@@ -1228,6 +1268,37 @@ gftpui_common_add_file_transfer (gftp_request * fromreq, gftp_request * toreq,
 }
 
 
+/* Puts the transfers that were still queued when gFTP last exited back in
+   the transfer queue */
+
+void
+gftpui_common_restore_transfers (void)
+{
+  gftp_transfer * tdata;
+  GList * transfers, * templist;
+
+  transfers = gftp_journal_load (gftpui_common_logfunc);
+  for (templist = transfers; templist != NULL; templist = templist->next)
+    {
+      tdata = templist->data;
+      tdata->show = 1;
+      tdata->ready = 1;
+
+      if (g_thread_supported ())
+        g_static_mutex_lock (&gftpui_common_transfer_mutex);
+
+      gftp_file_transfers = g_list_append (gftp_file_transfers, tdata);
+
+      if (g_thread_supported ())
+        g_static_mutex_unlock (&gftpui_common_transfer_mutex);
+
+      gftpui_start_transfer (tdata);
+    }
+
+  g_list_free (transfers);
+}
+
+
 static ssize_t
 _do_transfer_block (gftp_transfer * tdata, gftp_file * curfle, char *buf,
                     size_t trans_blksize)
@@ -1255,27 +1326,243 @@ _do_transfer_block (gftp_transfer * tdata, gftp_file * curfle, char *buf,
 }
 
 
+/* The reader thread fills up to GFTPUI_COMMON_PIPELINE_DEPTH buffers from
+   the source while the transfer thread writes the oldest one out to the
+   destination. This lets both connections work at the same time. */
+
+typedef struct _gftpui_common_pipeline
+{
+  gftp_transfer * tdata;
+  GThread * reader;
+  GMutex * mutex;
+  GCond * cond;
+  char *bufs[GFTPUI_COMMON_PIPELINE_DEPTH];
+  size_t bufsizes[GFTPUI_COMMON_PIPELINE_DEPTH];
+  ssize_t lens[GFTPUI_COMMON_PIPELINE_DEPTH];
+  int head,			/* Next buffer to write to the destination */
+      count;			/* Number of buffers filled by the reader */
+  ssize_t read_ret;		/* Last return value from the reader. 0 on
+                                   EOF or < 0 on error */
+  unsigned int reader_done : 1,
+               stop : 1;
+} gftpui_common_pipeline;
+
+
+static void *
+_gftpui_common_pipeline_reader (void *data)
+{
+  gftpui_common_pipeline * pipeline;
+  size_t trans_blksize;
+  ssize_t num_read;
+  int slot;
+
+  pipeline = data;
+
+  g_mutex_lock (pipeline->mutex);
+  while (1)
+    {
+      while (pipeline->count == GFTPUI_COMMON_PIPELINE_DEPTH &&
+             !pipeline->stop)
+        g_cond_wait (pipeline->cond, pipeline->mutex);
+
+      if (pipeline->stop || pipeline->tdata->cancel)
+        break;
+
+      slot = (pipeline->head + pipeline->count) % GFTPUI_COMMON_PIPELINE_DEPTH;
+      g_mutex_unlock (pipeline->mutex);
+
+      /* The writer does not touch this slot until count is increased */
+      trans_blksize = gftp_get_trans_blksize (pipeline->tdata);
+      if (trans_blksize > pipeline->bufsizes[slot])
+        {
+          pipeline->bufs[slot] = g_realloc (pipeline->bufs[slot],
+                                            trans_blksize);
+          pipeline->bufsizes[slot] = trans_blksize;
+        }
+
+      num_read = gftp_get_next_file_chunk (pipeline->tdata->fromreq,
+                                           pipeline->bufs[slot],
+                                           trans_blksize);
+
+      g_mutex_lock (pipeline->mutex);
+      if (num_read <= 0)
+        {
+          pipeline->read_ret = num_read;
+          break;
+        }
+
+      pipeline->lens[slot] = num_read;
+      pipeline->count++;
+      g_cond_broadcast (pipeline->cond);
+    }
+
+  pipeline->reader_done = 1;
+  g_cond_broadcast (pipeline->cond);
+  g_mutex_unlock (pipeline->mutex);
+
+  return (NULL);
+}
+
+
+static gftpui_common_pipeline *
+_gftpui_common_pipeline_new (gftp_transfer * tdata)
+{
+  gftpui_common_pipeline * pipeline;
+
+  /* The buffers are allocated by the reader as they are needed */
+  pipeline = g_malloc0 (sizeof (*pipeline));
+  pipeline->tdata = tdata;
+  pipeline->mutex = g_mutex_new ();
+  pipeline->cond = g_cond_new ();
+
+  pipeline->reader = g_thread_create (_gftpui_common_pipeline_reader,
+                                      pipeline, TRUE, NULL);
+  if (pipeline->reader == NULL)
+    {
+      g_cond_free (pipeline->cond);
+      g_mutex_free (pipeline->mutex);
+      g_free (pipeline);
+      return (NULL);
+    }
+
+  return (pipeline);
+}
+
+
+static void
+_gftpui_common_pipeline_free (gftpui_common_pipeline * pipeline)
+{
+  int i;
+
+  g_mutex_lock (pipeline->mutex);
+  pipeline->stop = 1;
+  g_cond_broadcast (pipeline->cond);
+  g_mutex_unlock (pipeline->mutex);
+
+  g_thread_join (pipeline->reader);
+
+  for (i = 0; i < GFTPUI_COMMON_PIPELINE_DEPTH; i++)
+    g_free (pipeline->bufs[i]);
+
+  g_cond_free (pipeline->cond);
+  g_mutex_free (pipeline->mutex);
+  g_free (pipeline);
+}
+
+
+static ssize_t
+_gftpui_common_pipeline_write_block (gftpui_common_pipeline * pipeline)
+{
+  ssize_t num_read, num_wrote, ret;
+  char *bufpos;
+  int slot;
+
+  g_mutex_lock (pipeline->mutex);
+  while (pipeline->count == 0 && !pipeline->reader_done)
+    g_cond_wait (pipeline->cond, pipeline->mutex);
+
+  if (pipeline->count == 0)
+    {
+      num_read = pipeline->read_ret;
+      g_mutex_unlock (pipeline->mutex);
+      return (num_read);
+    }
+
+  slot = pipeline->head;
+  num_read = pipeline->lens[slot];
+  g_mutex_unlock (pipeline->mutex);
+
+  bufpos = pipeline->bufs[slot];
+  num_wrote = 0;
+  while (num_wrote < num_read)
+    {
+      if ((ret = gftp_put_next_file_chunk (pipeline->tdata->toreq, bufpos,
+                                           num_read - num_wrote)) <= 0)
+        return (ret);
+
+      num_wrote += ret;
+      bufpos += ret;
+    }
+
+  g_mutex_lock (pipeline->mutex);
+  pipeline->head = (pipeline->head + 1) % GFTPUI_COMMON_PIPELINE_DEPTH;
+  pipeline->count--;
+  g_cond_broadcast (pipeline->cond);
+  g_mutex_unlock (pipeline->mutex);
+
+  return (num_read);
+}
+
+
 int
 _gftpui_common_do_transfer_file (gftp_transfer * tdata, gftp_file * curfle)
 {
+  gftpui_common_pipeline * pipeline;
+  size_t trans_blksize, bufsize;
   struct timeval updatetime;
-  intptr_t trans_blksize;
   ssize_t num_trans;
+  int ret, use_splice;
   char *buf;
-  int ret;
 
-  gftp_lookup_request_option (tdata->fromreq, "trans_blksize", &trans_blksize);
-  buf = g_malloc0 (trans_blksize);
+  trans_blksize = gftp_get_trans_blksize (tdata);
+  gftp_tune_trans_blksize (tdata, 0);
+
+  /* When the data goes through unmodified between a local file and a socket,
+     let the kernel move it instead of copying it through our buffers */
+  use_splice = gftp_can_splice_transfer (tdata);
+
+  if (!use_splice && g_thread_supported ())
+    pipeline = _gftpui_common_pipeline_new (tdata);
+  else
+    pipeline = NULL;
+
+  if (pipeline == NULL && !use_splice)
+    {
+      buf = g_malloc0 (trans_blksize);
+      bufsize = trans_blksize;
+    }
+  else
+    {
+      buf = NULL;
+      bufsize = 0;
+    }
 
   memset (&updatetime, 0, sizeof (updatetime));
   gftpui_start_current_file_in_transfer (tdata);
 
   num_trans = 0;
-  while (!tdata->cancel &&
-         (num_trans = _do_transfer_block (tdata, curfle, buf,
-                                          trans_blksize)) > 0)
+  while (!tdata->cancel)
     {
+      trans_blksize = gftp_get_trans_blksize (tdata);
+
+      if (use_splice)
+        {
+          num_trans = gftp_splice_file_chunk (tdata, trans_blksize);
+          if (num_trans == GFTP_ENOTRANS)
+            {
+              /* Nothing was moved, so carry on with a normal buffer */
+              use_splice = 0;
+              continue;
+            }
+        }
+      else if (pipeline != NULL)
+        num_trans = _gftpui_common_pipeline_write_block (pipeline);
+      else
+        {
+          if (trans_blksize > bufsize)
+            {
+              buf = g_realloc (buf, trans_blksize);
+              bufsize = trans_blksize;
+            }
+
+          num_trans = _do_transfer_block (tdata, curfle, buf, trans_blksize);
+        }
+
+      if (num_trans <= 0)
+        break;
+
       gftp_calc_kbs (tdata, num_trans);
+      gftp_tune_trans_blksize (tdata, num_trans);
 
       if (tdata->lasttime.tv_sec - updatetime.tv_sec >= 1 ||
           tdata->curtrans >= tdata->tot_file_trans)
@@ -1283,6 +1570,9 @@ _gftpui_common_do_transfer_file (gftp_transfer * tdata, gftp_file * curfle)
           gftpui_update_current_file_in_transfer (tdata);
           memcpy (&updatetime, &tdata->lasttime, sizeof (updatetime));
 
+          gftp_journal_file_progress (tdata, curfle,
+                                      tdata->curresumed + tdata->curtrans);
+
           if (tdata->current_file_retries > 0)
             tdata->current_file_retries = 0;
         }
@@ -1291,7 +1581,11 @@ _gftpui_common_do_transfer_file (gftp_transfer * tdata, gftp_file * curfle)
   if (num_trans == GFTP_ENOTRANS)
     num_trans = 0;
 
-  g_free (buf);
+  if (pipeline != NULL)
+    _gftpui_common_pipeline_free (pipeline);
+  else
+    g_free (buf);
+
   gftpui_finish_current_file_in_transfer (tdata);
 
   if ((int) num_trans == 0)
@@ -1317,12 +1611,34 @@ _gftpui_common_do_transfer_file (gftp_transfer * tdata, gftp_file * curfle)
 void
 gftpui_common_skip_file_transfer (gftp_transfer * tdata, gftp_file * curfle)
 {
+  gftp_transfer * worker;
+  GList * templist;
+
   g_static_mutex_lock (&tdata->structmutex);
 
   if (tdata->started && !(curfle->transfer_action & GFTP_TRANS_ACTION_SKIP))
     {
       curfle->transfer_action = GFTP_TRANS_ACTION_SKIP;
-      if (tdata->curfle != NULL && curfle == tdata->curfle->data)
+      if (tdata->workers != NULL)
+        {
+          for (templist = tdata->workers;
+               templist != NULL;
+               templist = templist->next)
+            {
+              worker = templist->data;
+              if (worker->curfle != NULL && curfle == worker->curfle->data)
+                break;
+            }
+
+          if (templist != NULL)
+            {
+              gftpui_cancel_file_transfer (worker);
+              worker->skip_file = 1;
+            }
+          else if (!curfle->transfer_done)
+            tdata->total_bytes -= curfle->size;
+        }
+      else if (tdata->curfle != NULL && curfle == tdata->curfle->data)
         {
           gftpui_cancel_file_transfer (tdata);
           tdata->skip_file = 1;
@@ -1331,6 +1647,9 @@ gftpui_common_skip_file_transfer (gftp_transfer * tdata, gftp_file * curfle)
         tdata->total_bytes -= curfle->size;
     }
 
+  if (tdata->walkcond != NULL)
+    g_cond_broadcast (tdata->walkcond);
+
   g_static_mutex_unlock (&tdata->structmutex);
 
   if (curfle != NULL)
@@ -1343,16 +1662,32 @@ gftpui_common_skip_file_transfer (gftp_transfer * tdata, gftp_file * curfle)
 void
 gftpui_common_cancel_file_transfer (gftp_transfer * tdata)
 {
+  gftp_transfer * worker;
+  GList * templist;
+
   g_static_mutex_lock (&tdata->structmutex);
 
   if (tdata->started)
     {
       gftpui_cancel_file_transfer (tdata);
       tdata->skip_file = 0;
+
+      for (templist = tdata->workers; templist != NULL; templist = templist->next)
+        {
+          worker = templist->data;
+          gftpui_cancel_file_transfer (worker);
+          worker->skip_file = 0;
+        }
+
+      if (tdata->walker != NULL)
+        gftpui_cancel_file_transfer (tdata->walker);
     }
   else
     tdata->done = 1;
 
+  if (tdata->walkcond != NULL)
+    g_cond_broadcast (tdata->walkcond);
+
   tdata->fromreq->stopable = 0;
   tdata->toreq->stopable = 0;
 
@@ -1364,6 +1699,19 @@ gftpui_common_cancel_file_transfer (gftp_transfer * tdata)
 }
 
 
+/* Called with the structmutex held. While the walker is still adding
+   files, reaching the end of the list is not the end of the transfer */
+
+static void
+_gftpui_common_wait_for_walker (gftp_transfer * tdata, GList * lastfle)
+{
+  while (lastfle->next == NULL && tdata->walking &&
+         (!tdata->cancel || tdata->skip_file))
+    g_cond_wait (tdata->walkcond,
+                 g_static_mutex_get_mutex (&tdata->structmutex));
+}
+
+
 static void
 _gftpui_common_next_file_in_trans (gftp_transfer * tdata)
 {
@@ -1377,10 +1725,13 @@ _gftpui_common_next_file_in_trans (gftp_transfer * tdata)
 
   curfle = tdata->curfle->data;
   curfle->transfer_done = 1;
+  _gftpui_common_wait_for_walker (tdata, tdata->curfle);
   tdata->curfle = tdata->curfle->next;
 
   if (g_thread_supported ())
     g_static_mutex_unlock (&tdata->structmutex);
+
+  gftp_journal_file_done (tdata, curfle);
 }
 
 
@@ -1421,110 +1772,487 @@ _gftpui_common_preserve_perm_time (gftp_transfer * tdata, gftp_file * curfle)
 }
 
 
-static int
-_gftpui_common_trans_file_or_dir (gftp_transfer * tdata)
+typedef struct _gftpui_common_segment_data
 {
+  gftp_transfer * tdata;
+  gftp_request * fromreq;
   gftp_file * curfle;
+  GThread * thread;
+  off_t curpos,
+        endpos;
   int ret;
+} gftpui_common_segment_data;
+
+
+static int
+_gftpui_common_use_segments (gftp_transfer * tdata, gftp_file * curfle)
+{
+  intptr_t transfer_segments;
+  off_t num_segments;
+
+  if (!g_thread_supported () || !tdata->fromreq->ranged_get ||
+      tdata->toreq->protonum != GFTP_LOCAL_NUM ||
+      tdata->fromreq->protonum == GFTP_LOCAL_NUM ||
+      curfle->retry_transfer ||
+      curfle->transfer_action == GFTP_TRANS_ACTION_RESUME)
+    return (0);
+
+  gftp_lookup_request_option (tdata->fromreq, "transfer_segments",
+                              &transfer_segments);
+  if (transfer_segments < 2)
+    return (0);
+
+  /* The REST offsets do not line up with the local file in ASCII mode */
+  if ((tdata->fromreq->protonum == GFTP_FTP_NUM ||
+       tdata->fromreq->protonum == GFTP_FTPS_NUM) &&
+      rfc959_is_ascii_transfer (tdata->fromreq, curfle->file))
+    return (0);
+
+  num_segments = curfle->size / GFTPUI_COMMON_MIN_SEGMENT_SIZE;
+  if (num_segments > transfer_segments)
+    num_segments = transfer_segments;
+
+  return (num_segments < 2 ? 0 : (int) num_segments);
+}
+
+
+/* Tells the protocol which files are going to be downloaded after the current
+   one, so that it can ask the server for them before the current one is
+   done. This is only done for serial transfers, since the worker connections
+   take the files in whatever order they get to them. */
+
+static void
+_gftpui_common_prefetch_files (gftp_transfer * tdata)
+{
+  char *files[GFTPUI_COMMON_MAX_PREFETCH];
+  int need_size[GFTPUI_COMMON_MAX_PREFETCH];
+  gftp_file * tempfle;
+  GList * templist;
+  int i, num, ret;
+
+  if (tdata->fromreq->prefetch_file == NULL || tdata->parent != NULL)
+    return;
 
   if (g_thread_supported ())
     g_static_mutex_lock (&tdata->structmutex);
 
-  curfle = tdata->curfle->data;
-  tdata->current_file_number++;
+  num = 0;
+  for (templist = tdata->curfle, i = 0;
+       templist != NULL && i < GFTPUI_COMMON_MAX_PREFETCH;
+       templist = templist->next, i++)
+    {
+      tempfle = templist->data;
+      if (S_ISDIR (tempfle->st_mode) || tempfle->retry_transfer ||
+          tempfle->transfer_action == GFTP_TRANS_ACTION_SKIP ||
+          tempfle->transfer_action == GFTP_TRANS_ACTION_RESUME ||
+          tempfle->transfer_action == GFTP_TRANS_ACTION_DELETE ||
+          _gftpui_common_use_segments (tdata, tempfle) > 0)
+        continue;
+
+      files[num] = g_strdup (tempfle->file);
+      need_size[num] = tempfle->size == 0 && !tempfle->exact_size;
+      num++;
+    }
 
   if (g_thread_supported ())
     g_static_mutex_unlock (&tdata->structmutex);
 
-  if (curfle->transfer_action == GFTP_TRANS_ACTION_SKIP)
+  ret = 1;
+  for (i = 0; i < num; i++)
     {
-      tdata->tot_file_trans = 0;
-      return (0);
+      if (ret > 0)
+        ret = gftp_prefetch_file (tdata->fromreq, files[i], need_size[i]);
+
+      g_free (files[i]);
     }
+}
 
-  if ((ret = gftp_connect (tdata->fromreq)) < 0)
-    return (ret);
 
-  if ((ret = gftp_connect (tdata->toreq)) < 0)
-    return (ret);
+static void *
+_gftpui_common_get_segment (void *data)
+{
+  gftpui_common_segment_data * seg;
+  size_t trans_blksize, toread;
+  ssize_t num_read;
+  off_t size;
+  char *buf;
+  int fd;
 
-  if (S_ISDIR (curfle->st_mode))
-    {
-      tdata->tot_file_trans = 0;
-      if (curfle->startsize > 0)
-        ret = 1;
-      else
-        ret = gftp_make_directory (tdata->toreq, curfle->destfile);
-    }
-  else
+  seg = data;
+  fd = seg->tdata->toreq->datafd;
+
+  trans_blksize = gftp_get_trans_blksize (seg->tdata);
+  buf = g_malloc0 (trans_blksize);
+
+  if ((seg->ret = gftp_connect (seg->fromreq)) == 0 &&
+      (size = gftp_get_file (seg->fromreq, seg->curfle->file,
+                             seg->curpos)) < 0)
+    seg->ret = (int) size;
+
+  while (seg->ret == 0 && seg->curpos < seg->endpos && !seg->tdata->cancel)
     {
-      if (curfle->size == 0)
+      toread = trans_blksize;
+      if (seg->endpos - seg->curpos < (off_t) toread)
+        toread = seg->endpos - seg->curpos;
+
+      num_read = gftp_get_next_file_chunk (seg->fromreq, buf, toread);
+      if (num_read < 0)
+        seg->ret = num_read;
+      else if (num_read == 0)
         {
-          curfle->size = gftp_get_file_size (tdata->fromreq, curfle->file);
-          if (curfle->size < 0)
-            return ((int) curfle->size);
-
-          tdata->total_bytes += curfle->size;
+          seg->fromreq->logging_function (gftp_logging_error, seg->fromreq,
+                         _("Error: The remote server closed the connection before the end of the segment\n"));
+          seg->ret = GFTP_ERETRYABLE;
         }
-
-      if (curfle->retry_transfer)
+      else if (pwrite (fd, buf, num_read, seg->curpos) != num_read)
         {
-          curfle->transfer_action = GFTP_TRANS_ACTION_RESUME;
-          curfle->startsize = gftp_get_file_size (tdata->toreq, curfle->destfile);
-          if (curfle->startsize < 0)
-            return ((int) curfle->startsize);
+          seg->fromreq->logging_function (gftp_logging_error, seg->fromreq,
+                         _("Error: Cannot write to local file %s: %s\n"),
+                         seg->curfle->destfile, g_strerror (errno));
+          seg->ret = GFTP_EFATAL;
         }
-
-      tdata->tot_file_trans = gftp_transfer_file (tdata->fromreq, curfle->file,
-                                                  curfle->transfer_action == GFTP_TRANS_ACTION_RESUME ?
-                                                          curfle->startsize : 0,
-                                                  tdata->toreq, curfle->destfile,
-                                                  curfle->transfer_action == GFTP_TRANS_ACTION_RESUME ?
-                                                          curfle->startsize : 0);
-      if (tdata->tot_file_trans < 0)
-        ret = tdata->tot_file_trans;
       else
         {
-          if (g_thread_supported ())
-            g_static_mutex_lock (&tdata->structmutex);
-
-          tdata->curtrans = 0;
-          tdata->curresumed = curfle->transfer_action == GFTP_TRANS_ACTION_RESUME ? curfle->startsize : 0;
-          tdata->resumed_bytes += tdata->curresumed;
-
-          if (g_thread_supported ())
-            g_static_mutex_unlock (&tdata->structmutex);
-
-          ret = _gftpui_common_do_transfer_file (tdata, curfle);
+          seg->curpos += num_read;
+          gftp_calc_kbs (seg->tdata, num_read);
         }
     }
 
-  if (ret == 0)
-    ret = _gftpui_common_preserve_perm_time (tdata, curfle);
-  else
-    {
-      curfle->retry_transfer = 1;
-      tdata->fromreq->logging_function (gftp_logging_error, tdata->fromreq,
-                                        _("Could not download %s from %s\n"),
-                                        curfle->file, tdata->fromreq->hostname);
-    }
+  g_free (buf);
 
-  return (ret);
+  if (seg->ret == 0 && seg->tdata->cancel)
+    seg->ret = GFTP_ERETRYABLE;
+
+  if (seg->ret < 0)
+    gftp_disconnect (seg->fromreq);
+  else if (seg->endpos == seg->curfle->size)
+    seg->ret = gftp_end_transfer (seg->fromreq);
+  else if (gftp_abort_transfer (seg->fromreq) != 0)
+    gftp_disconnect (seg->fromreq);
+
+  return (NULL);
 }
 
 
-int
-gftpui_common_transfer_files (gftp_transfer * tdata)
+static int
+_gftpui_common_do_segmented_transfer (gftp_transfer * tdata,
+                                      gftp_file * curfle, int num_segments)
 {
-  int ret, skipped_files;
+  gftpui_common_segment_data * seg;
+  off_t seglen, complete;
+  char *partname;
+  int i, ret;
+
+  /* The segments are written into a file of their own, so that a file full
+     of holes is never left under the real name if gFTP is killed. The size
+     of that would make it look like it was downloaded already. */
+  partname = g_strconcat (curfle->destfile, GFTPUI_COMMON_PART_SUFFIX, NULL);
+  if ((ret = gftp_put_file (tdata->toreq, partname, 0, curfle->size)) < 0)
+    {
+      g_free (partname);
+      return (ret);
+    }
 
-  tdata->curfle = tdata->files;
-  gftpui_common_num_child_threads++;
+  /* Allocate the whole file up front so that each segment can be written
+     in place */
+  if (ftruncate (tdata->toreq->datafd, curfle->size) == -1)
+    {
+      tdata->toreq->logging_function (gftp_logging_error, tdata->toreq,
+                               _("Error: Cannot truncate local file %s: %s\n"),
+                               partname, g_strerror (errno));
+      gftp_disconnect (tdata->toreq);
+      gftp_remove_file (tdata->toreq, partname);
+      g_free (partname);
+      return (GFTP_ERETRYABLE);
+    }
 
-  gettimeofday (&tdata->starttime, NULL);
-  memcpy (&tdata->lasttime, &tdata->starttime, sizeof (tdata->lasttime));
+  tdata->fromreq->logging_function (gftp_logging_misc, tdata->fromreq,
+                                    _("Downloading %s in %d segments\n"),
+                                    curfle->file, num_segments);
 
-  skipped_files = 0;
+  if (g_thread_supported ())
+    g_static_mutex_lock (&tdata->structmutex);
+
+  tdata->curtrans = 0;
+  tdata->curresumed = 0;
+  tdata->tot_file_trans = curfle->size;
+
+  if (g_thread_supported ())
+    g_static_mutex_unlock (&tdata->structmutex);
+
+  gftpui_start_current_file_in_transfer (tdata);
+
+  seg = g_malloc0 (sizeof (*seg) * num_segments);
+  seglen = curfle->size / num_segments;
+  for (i = 0; i < num_segments; i++)
+    {
+      seg[i].tdata = tdata;
+      seg[i].curfle = curfle;
+      seg[i].curpos = seglen * i;
+      seg[i].endpos = i == num_segments - 1 ? curfle->size : seglen * (i + 1);
+
+      /* The first segment uses the connection that is already logged in */
+      if (i == 0)
+        seg[i].fromreq = tdata->fromreq;
+      else if ((seg[i].fromreq = gftp_copy_request (tdata->fromreq)) == NULL)
+        {
+          seg[i].ret = GFTP_EFATAL;
+          continue;
+        }
+
+      seg[i].thread = g_thread_create (_gftpui_common_get_segment, &seg[i],
+                                       TRUE, NULL);
+      if (seg[i].thread == NULL)
+        seg[i].ret = GFTP_ERETRYABLE;
+    }
+
+  ret = 0;
+  for (i = 0; i < num_segments; i++)
+    {
+      if (seg[i].thread != NULL)
+        g_thread_join (seg[i].thread);
+
+      if (seg[i].ret < 0 && (ret == 0 || seg[i].ret == GFTP_EFATAL))
+        ret = seg[i].ret;
+
+      if (i > 0 && seg[i].fromreq != NULL)
+        gftp_request_destroy (seg[i].fromreq, 1);
+    }
+
+  gftpui_finish_current_file_in_transfer (tdata);
+
+  if (ret < 0)
+    {
+      /* Only keep the part of the file that was downloaded without any
+         holes, under the real name, so that it can be resumed later with a
+         single connection */
+      for (i = 0, complete = 0; i < num_segments; i++)
+        {
+          complete = seg[i].curpos;
+          if (seg[i].curpos < seg[i].endpos)
+            break;
+        }
+
+      if (ftruncate (tdata->toreq->datafd, complete) == -1)
+        {
+          tdata->toreq->logging_function (gftp_logging_error, tdata->toreq,
+                               _("Error: Cannot truncate local file %s: %s\n"),
+                               partname, g_strerror (errno));
+          complete = 0;
+        }
+
+      gftp_disconnect (tdata->toreq);
+
+      if (complete > 0)
+        gftp_rename_file (tdata->toreq, partname, curfle->destfile);
+      else
+        gftp_remove_file (tdata->toreq, partname);
+    }
+  else if ((ret = gftp_end_transfer (tdata->toreq)) < 0)
+    gftp_remove_file (tdata->toreq, partname);
+  else if ((ret = gftp_rename_file (tdata->toreq, partname,
+                                    curfle->destfile)) < 0)
+    gftp_remove_file (tdata->toreq, partname);
+  else
+    tdata->fromreq->logging_function (gftp_logging_misc,
+                     tdata->fromreq,
+                     _("Successfully transferred %s at %.2f KB/s\n"),
+                     curfle->file, tdata->kbs);
+
+  g_free (partname);
+  g_free (seg);
+  return (ret);
+}
+
+
+/* Copies a directory that gftp_get_all_subdirs() did not list. Its size
+   is only the estimate from du, so the grand total is fixed up afterwards */
+
+static int
+_gftpui_common_do_bulk_transfer (gftp_transfer * tdata, gftp_file * curfle)
+{
+  gftp_transfer * stats;
+  int ret;
+
+  stats = tdata->parent != NULL ? tdata->parent : tdata;
+
+  if (g_thread_supported ())
+    g_static_mutex_lock (&tdata->structmutex);
+
+  tdata->curtrans = 0;
+  tdata->curresumed = 0;
+  tdata->tot_file_trans = curfle->size;
+
+  if (g_thread_supported ())
+    g_static_mutex_unlock (&tdata->structmutex);
+
+  gftpui_start_current_file_in_transfer (tdata);
+  ret = gftp_bulk_transfer_dir (tdata, curfle,
+                                gftpui_update_current_file_in_transfer);
+  gftpui_finish_current_file_in_transfer (tdata);
+
+  if (ret < 0)
+    return (ret);
+
+  if (g_thread_supported ())
+    g_static_mutex_lock (&stats->statmutex);
+
+  stats->total_bytes += tdata->curtrans - curfle->size;
+
+  if (g_thread_supported ())
+    g_static_mutex_unlock (&stats->statmutex);
+
+  curfle->size = tdata->curtrans;
+
+  tdata->fromreq->logging_function (gftp_logging_misc, tdata->fromreq,
+                                    _("Successfully transferred %s at %.2f KB/s\n"),
+                                    curfle->file, tdata->kbs);
+  return (0);
+}
+
+
+static int
+_gftpui_common_trans_file_or_dir (gftp_transfer * tdata)
+{
+  gftp_transfer * stats;
+  int ret, num_segments;
+  gftp_file * curfle;
+
+  if (g_thread_supported ())
+    g_static_mutex_lock (&tdata->structmutex);
+
+  curfle = tdata->curfle->data;
+  tdata->current_file_number++;
+
+  if (g_thread_supported ())
+    g_static_mutex_unlock (&tdata->structmutex);
+
+  if (curfle->transfer_action == GFTP_TRANS_ACTION_SKIP)
+    {
+      tdata->tot_file_trans = 0;
+      return (0);
+    }
+
+  if ((ret = gftp_connect (tdata->fromreq)) < 0)
+    return (ret);
+
+  if ((ret = gftp_connect (tdata->toreq)) < 0)
+    return (ret);
+
+  if (curfle->transfer_action == GFTP_TRANS_ACTION_DELETE)
+    {
+      tdata->tot_file_trans = 0;
+      ret = gftp_remove_tree (tdata->toreq, curfle->destfile, curfle->st_mode);
+      if (ret < 0)
+        tdata->toreq->logging_function (gftp_logging_error, tdata->toreq,
+                                        _("Could not remove %s from %s\n"),
+                                        curfle->destfile,
+                                        tdata->toreq->hostname);
+      return (ret);
+    }
+
+  /* The grand totals for a worker connection are kept in the transfer that
+     it is working for */
+  stats = tdata->parent != NULL ? tdata->parent : tdata;
+
+  if (S_ISDIR (curfle->st_mode))
+    {
+      tdata->tot_file_trans = 0;
+      if (curfle->bulk_transfer)
+        ret = _gftpui_common_do_bulk_transfer (tdata, curfle);
+      else if (curfle->startsize > 0)
+        ret = 1;
+      else
+        ret = gftp_make_directory (tdata->toreq, curfle->destfile);
+    }
+  else
+    {
+      _gftpui_common_prefetch_files (tdata);
+
+      if (curfle->size == 0 && !curfle->exact_size)
+        {
+          curfle->size = gftp_get_file_size (tdata->fromreq, curfle->file);
+          if (curfle->size < 0)
+            return ((int) curfle->size);
+
+          if (g_thread_supported ())
+            g_static_mutex_lock (&stats->statmutex);
+
+          stats->total_bytes += curfle->size;
+
+          if (g_thread_supported ())
+            g_static_mutex_unlock (&stats->statmutex);
+        }
+
+      if ((num_segments = _gftpui_common_use_segments (tdata, curfle)) > 0)
+        ret = _gftpui_common_do_segmented_transfer (tdata, curfle,
+                                                    num_segments);
+      else
+        {
+          if (curfle->retry_transfer)
+            {
+              curfle->transfer_action = GFTP_TRANS_ACTION_RESUME;
+              curfle->startsize = gftp_get_file_size (tdata->toreq, curfle->destfile);
+              if (curfle->startsize < 0)
+                return ((int) curfle->startsize);
+            }
+
+          tdata->tot_file_trans = gftp_transfer_file (tdata->fromreq, curfle->file,
+                                                      curfle->transfer_action == GFTP_TRANS_ACTION_RESUME ?
+                                                              curfle->startsize : 0,
+                                                      tdata->toreq, curfle->destfile,
+                                                      curfle->transfer_action == GFTP_TRANS_ACTION_RESUME ?
+                                                              curfle->startsize : 0);
+          if (tdata->tot_file_trans < 0)
+            ret = tdata->tot_file_trans;
+          else
+            {
+              if (g_thread_supported ())
+                g_static_mutex_lock (&tdata->structmutex);
+
+              tdata->curtrans = 0;
+              tdata->curresumed = curfle->transfer_action == GFTP_TRANS_ACTION_RESUME ? curfle->startsize : 0;
+              tdata->resumed_bytes += tdata->curresumed;
+
+              if (g_thread_supported ())
+                g_static_mutex_unlock (&tdata->structmutex);
+
+              if (stats != tdata)
+                {
+                  if (g_thread_supported ())
+                    g_static_mutex_lock (&stats->statmutex);
+
+                  stats->resumed_bytes += tdata->curresumed;
+
+                  if (g_thread_supported ())
+                    g_static_mutex_unlock (&stats->statmutex);
+                }
+
+              ret = _gftpui_common_do_transfer_file (tdata, curfle);
+            }
+        }
+    }
+
+  if (ret == 0)
+    ret = _gftpui_common_preserve_perm_time (tdata, curfle);
+  else
+    {
+      curfle->retry_transfer = 1;
+      tdata->fromreq->logging_function (gftp_logging_error, tdata->fromreq,
+                                        _("Could not download %s from %s\n"),
+                                        curfle->file, tdata->fromreq->hostname);
+    }
+
+  return (ret);
+}
+
+
+static int
+_gftpui_common_transfer_files_serial (gftp_transfer * tdata)
+{
+  int ret, skipped_files;
+
+  skipped_files = 0;
   while (tdata->curfle != NULL)
     {
       ret = _gftpui_common_trans_file_or_dir (tdata);
@@ -1559,6 +2287,488 @@ gftpui_common_transfer_files (gftp_transfer * tdata)
         }
     }
 
+  return (skipped_files);
+}
+
+
+typedef struct _gftpui_common_worker_data
+{
+  gftp_transfer * worker;
+  GThread * thread;
+  int dirs_only,
+      skipped_files,
+      failed;			/* The worker gave up on the transfer */
+} gftpui_common_worker_data;
+
+
+/* Called with the structmutex held. Returns 1 if one of the other
+   connections is making a directory */
+
+static int
+_gftpui_common_making_dirs (gftp_transfer * tdata, gftp_transfer * worker)
+{
+  gftp_transfer * otherworker;
+  gftp_file * tempfle;
+  GList * templist;
+
+  for (templist = tdata->workers; templist != NULL; templist = templist->next)
+    {
+      otherworker = templist->data;
+      if (otherworker == worker || otherworker->curfle == NULL)
+        continue;
+
+      tempfle = otherworker->curfle->data;
+      if (S_ISDIR (tempfle->st_mode) &&
+          tempfle->transfer_action != GFTP_TRANS_ACTION_SKIP &&
+          tempfle->transfer_action != GFTP_TRANS_ACTION_DELETE)
+        return (1);
+    }
+
+  return (0);
+}
+
+
+static GList *
+_gftpui_common_worker_next_file (gftp_transfer * tdata, gftp_transfer * worker,
+                                 int dirs_only)
+{
+  gftp_file * tempfle;
+  GList * curfle;
+
+  if (g_thread_supported ())
+    g_static_mutex_lock (&tdata->structmutex);
+
+  while (1)
+    {
+      for (curfle = tdata->nextfle; curfle != NULL; curfle = curfle->next)
+        {
+          tempfle = curfle->data;
+          if (!tempfle->transfer_done &&
+              (!dirs_only || S_ISDIR (tempfle->st_mode)))
+            break;
+        }
+
+      if (tdata->cancel || tdata->walker == NULL)
+        break;
+
+      /* The walker sets nextfle again when it adds more files. The
+         directories are walked in the order that they are in the list, so a
+         file can only be waiting on a directory that is being made right
+         now */
+      if (curfle == NULL && tdata->walking)
+        tdata->nextfle = NULL;
+      else if (curfle != NULL && !S_ISDIR (tempfle->st_mode) &&
+               _gftpui_common_making_dirs (tdata, worker))
+        tdata->nextfle = curfle;
+      else
+        break;
+
+      g_cond_wait (tdata->walkcond,
+                   g_static_mutex_get_mutex (&tdata->structmutex));
+    }
+
+  if (tdata->cancel)
+    curfle = NULL;
+
+  if (curfle != NULL)
+    {
+      tdata->nextfle = curfle->next;
+      tdata->current_file_number++;
+    }
+  else
+    tdata->nextfle = NULL;
+
+  worker->curfle = curfle;
+
+  if (g_thread_supported ())
+    g_static_mutex_unlock (&tdata->structmutex);
+
+  return (curfle);
+}
+
+
+static void
+_gftpui_common_worker_file_done (gftp_transfer * tdata, gftp_transfer * worker)
+{
+  gftp_file * tempfle;
+
+  if (g_thread_supported ())
+    g_static_mutex_lock (&tdata->structmutex);
+
+  worker->curtrans = 0;
+
+  tempfle = worker->curfle->data;
+  tempfle->transfer_done = 1;
+  worker->curfle = NULL;
+
+  /* The other connections may be waiting for this directory to be made */
+  if (tdata->walkcond != NULL)
+    g_cond_broadcast (tdata->walkcond);
+
+  /* tdata->curfle always points to the oldest file that is not finished yet.
+     The UIs mark everything before it as finished */
+  while (tdata->curfle != NULL &&
+         ((gftp_file *) tdata->curfle->data)->transfer_done)
+    {
+      tdata->curfle = tdata->curfle->next;
+      tdata->curtrans = 0;
+      tdata->next_file = 1;
+    }
+
+  if (g_thread_supported ())
+    g_static_mutex_unlock (&tdata->structmutex);
+
+  gftp_journal_file_done (tdata, tempfle);
+}
+
+
+static void *
+_gftpui_common_run_worker (void *data)
+{
+  gftpui_common_worker_data * wdata;
+  gftp_transfer * tdata, * worker;
+  GList * curfle;
+  int ret;
+
+  wdata = data;
+  worker = wdata->worker;
+  tdata = worker->parent;
+
+  curfle = _gftpui_common_worker_next_file (tdata, worker, wdata->dirs_only);
+  while (curfle != NULL)
+    {
+      ret = _gftpui_common_trans_file_or_dir (worker);
+      if (worker->cancel)
+        {
+          if (gftp_abort_transfer (worker->toreq) != 0)
+            gftp_disconnect (worker->toreq);
+
+          if (gftp_abort_transfer (worker->fromreq) != 0)
+            gftp_disconnect (worker->fromreq);
+        }
+      else if ((ret == GFTP_EFATAL && !wdata->dirs_only) ||
+               ret == GFTP_ECANIGNORE)
+        wdata->skipped_files++;
+      else if (ret < 0)
+        {
+          /* The files cannot be sent without their directories, so a fatal
+             error while they are being created ends the transfer */
+          if (ret == GFTP_EFATAL)
+            wdata->skipped_files++;
+          else if (gftp_get_transfer_status (worker, ret) == GFTP_ERETRYABLE)
+            continue;
+
+          wdata->failed = 1;
+
+          /* Stop handing out files to the other connections, the same as
+             the single connection case gives up on the whole transfer */
+          if (g_thread_supported ())
+            g_static_mutex_lock (&tdata->structmutex);
+
+          tdata->nextfle = NULL;
+          tdata->walking = 0;
+          worker->curfle = NULL;
+
+          if (g_thread_supported ())
+            g_static_mutex_unlock (&tdata->structmutex);
+
+          break;
+        }
+
+      _gftpui_common_worker_file_done (tdata, worker);
+
+      if (worker->cancel)
+        {
+          if (!worker->skip_file)
+            break;
+
+          worker->cancel = 0;
+          worker->skip_file = 0;
+          worker->fromreq->cancel = 0;
+          worker->toreq->cancel = 0;
+        }
+
+      curfle = _gftpui_common_worker_next_file (tdata, worker,
+                                                wdata->dirs_only);
+    }
+
+  gftp_disconnect (worker->fromreq);
+  gftp_disconnect (worker->toreq);
+
+  return (NULL);
+}
+
+
+static gftp_transfer *
+_gftpui_common_new_worker (gftp_transfer * tdata)
+{
+  gftp_transfer * worker;
+
+  worker = gftp_tdata_new ();
+  worker->parent = tdata;
+  worker->fromwdata = tdata->fromwdata;
+  worker->towdata = tdata->towdata;
+  worker->ready = worker->started = 1;
+  memcpy (&worker->starttime, &tdata->starttime, sizeof (worker->starttime));
+  memcpy (&worker->lasttime, &tdata->lasttime, sizeof (worker->lasttime));
+
+  if ((worker->fromreq = gftp_copy_request (tdata->fromreq)) == NULL ||
+      (worker->toreq = gftp_copy_request (tdata->toreq)) == NULL)
+    {
+      free_tdata (worker);
+      return (NULL);
+    }
+
+  return (worker);
+}
+
+
+static int
+_gftpui_common_transfer_files_parallel (gftp_transfer * tdata,
+                                        int num_connections)
+{
+  gftpui_common_worker_data * wdata;
+  int i, num_workers, skipped_files;
+  gftp_transfer * worker;
+  GList * templist;
+
+  wdata = g_malloc0 (sizeof (*wdata) * num_connections);
+  num_workers = 0;
+  for (i = 0; i < num_connections; i++)
+    {
+      if ((worker = _gftpui_common_new_worker (tdata)) == NULL)
+        break;
+
+      wdata[num_workers++].worker = worker;
+    }
+
+  if (num_workers == 0)
+    {
+      g_free (wdata);
+      return (_gftpui_common_transfer_files_serial (tdata));
+    }
+
+  if (g_thread_supported ())
+    g_static_mutex_lock (&tdata->structmutex);
+
+  for (i = 0; i < num_workers; i++)
+    tdata->workers = g_list_append (tdata->workers, wdata[i].worker);
+
+  if (g_thread_supported ())
+    g_static_mutex_unlock (&tdata->structmutex);
+
+  tdata->fromreq->logging_function (gftp_logging_misc, tdata->fromreq,
+                                    _("Transferring files over %d connections\n"),
+                                    num_workers);
+
+  /* The directories are created first over a single connection so that
+     they are always there before any of the files inside them are sent.
+     When the walker is still adding directories, the files wait for them
+     in _gftpui_common_worker_next_file() instead */
+  if (tdata->walker == NULL)
+    {
+      tdata->nextfle = tdata->files;
+      wdata[0].dirs_only = 1;
+      _gftpui_common_run_worker (&wdata[0]);
+      wdata[0].dirs_only = 0;
+    }
+
+  if (wdata[0].failed)
+    tdata->fromreq->logging_function (gftp_logging_error, tdata->fromreq,
+                                      _("Error: Could not create the directories on %s, the files will not be transferred\n"),
+                                      tdata->toreq->hostname != NULL ?
+                                        tdata->toreq->hostname :
+                                        tdata->fromreq->hostname);
+  else if (!tdata->cancel)
+    {
+      tdata->nextfle = tdata->files;
+
+      for (i = 0; i < num_workers; i++)
+        wdata[i].thread = g_thread_create (_gftpui_common_run_worker, &wdata[i],
+                                           TRUE, NULL);
+
+      for (i = 0; i < num_workers; i++)
+        {
+          if (wdata[i].thread != NULL)
+            g_thread_join (wdata[i].thread);
+        }
+    }
+
+  if (g_thread_supported ())
+    g_static_mutex_lock (&tdata->structmutex);
+
+  templist = tdata->workers;
+  tdata->workers = NULL;
+
+  if (g_thread_supported ())
+    g_static_mutex_unlock (&tdata->structmutex);
+
+  g_list_free (templist);
+
+  skipped_files = 0;
+  for (i = 0; i < num_workers; i++)
+    {
+      skipped_files += wdata[i].skipped_files;
+      free_tdata (wdata[i].worker);
+    }
+
+  g_free (wdata);
+  return (skipped_files);
+}
+
+
+static void *
+_gftpui_common_run_walker (void *data)
+{
+  gftp_transfer * tdata, * walker;
+  int ret;
+
+  walker = data;
+  tdata = walker->parent;
+
+  ret = gftp_walk_subdirs (walker);
+  if (ret < 0 && !walker->cancel)
+    walker->fromreq->logging_function (gftp_logging_error, walker->fromreq,
+                                       _("Could not get the contents of all of the subdirectories on %s\n"),
+                                       walker->fromreq->hostname);
+
+  if (g_thread_supported ())
+    g_static_mutex_lock (&tdata->structmutex);
+
+  tdata->walking = 0;
+  if (tdata->walkcond != NULL)
+    g_cond_broadcast (tdata->walkcond);
+
+  if (g_thread_supported ())
+    g_static_mutex_unlock (&tdata->structmutex);
+
+  gftp_disconnect (walker->fromreq);
+  gftp_disconnect (walker->toreq);
+
+  return (NULL);
+}
+
+
+/* Starts listing the directories that gftp_get_all_subdirs() left for the
+   transfer to do. Without threads the walk is done before any files are
+   transferred, the same as before */
+
+static GThread *
+_gftpui_common_start_walker (gftp_transfer * tdata)
+{
+  gftp_transfer * walker;
+  GList * templist;
+
+  for (templist = tdata->files; templist != NULL; templist = templist->next)
+    {
+      if (((gftp_file *) templist->data)->list_pending)
+        break;
+    }
+
+  if (templist == NULL || (walker = _gftpui_common_new_worker (tdata)) == NULL)
+    return (NULL);
+
+  if (g_thread_supported ())
+    g_static_mutex_lock (&tdata->structmutex);
+
+  tdata->walker = walker;
+  tdata->walking = 1;
+  if (g_thread_supported ())
+    tdata->walkcond = g_cond_new ();
+
+  if (g_thread_supported ())
+    g_static_mutex_unlock (&tdata->structmutex);
+
+  if (g_thread_supported ())
+    return (g_thread_create (_gftpui_common_run_walker, walker, TRUE, NULL));
+
+  _gftpui_common_run_walker (walker);
+  return (NULL);
+}
+
+
+static void
+_gftpui_common_stop_walker (gftp_transfer * tdata, GThread * walker_thread)
+{
+  gftp_transfer * walker;
+
+  if (tdata->walker == NULL)
+    return;
+
+  if (g_thread_supported ())
+    g_static_mutex_lock (&tdata->structmutex);
+
+  if (tdata->walking)
+    {
+      tdata->walking = 0;
+      gftpui_cancel_file_transfer (tdata->walker);
+      if (tdata->walkcond != NULL)
+        g_cond_broadcast (tdata->walkcond);
+    }
+
+  if (g_thread_supported ())
+    g_static_mutex_unlock (&tdata->structmutex);
+
+  if (walker_thread != NULL)
+    g_thread_join (walker_thread);
+
+  if (g_thread_supported ())
+    g_static_mutex_lock (&tdata->structmutex);
+
+  walker = tdata->walker;
+  tdata->walker = NULL;
+
+  if (tdata->walkcond != NULL)
+    {
+      g_cond_free (tdata->walkcond);
+      tdata->walkcond = NULL;
+    }
+
+  if (g_thread_supported ())
+    g_static_mutex_unlock (&tdata->structmutex);
+
+  free_tdata (walker);
+}
+
+
+int
+gftpui_common_transfer_files (gftp_transfer * tdata)
+{
+  intptr_t transfer_connections;
+  GThread * walker_thread;
+  int skipped_files;
+
+  tdata->curfle = tdata->files;
+  gftpui_common_num_child_threads++;
+
+  gettimeofday (&tdata->starttime, NULL);
+  memcpy (&tdata->lasttime, &tdata->starttime, sizeof (tdata->lasttime));
+
+  if (tdata->journal_id == 0)
+    {
+      if (g_thread_supported ())
+        g_static_mutex_lock (&tdata->structmutex);
+
+      _gftpui_common_journal_files (tdata, tdata->files);
+
+      if (g_thread_supported ())
+        g_static_mutex_unlock (&tdata->structmutex);
+    }
+
+  walker_thread = _gftpui_common_start_walker (tdata);
+
+  gftp_lookup_request_option (tdata->fromreq, "transfer_connections",
+                              &transfer_connections);
+
+  if (transfer_connections > 1 && g_thread_supported () &&
+      tdata->files != NULL && (tdata->files->next != NULL || tdata->walking))
+    skipped_files = _gftpui_common_transfer_files_parallel (tdata,
+                                                          transfer_connections);
+  else
+    skipped_files = _gftpui_common_transfer_files_serial (tdata);
+
+  _gftpui_common_stop_walker (tdata, walker_thread);
+
   if (skipped_files)
     tdata->fromreq->logging_function (gftp_logging_error, tdata->fromreq,
                                       _("There were %d files or directories that could not be transferred. Check the log for which items were not properly transferred."),
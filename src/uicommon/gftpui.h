@@ -73,6 +73,21 @@ typedef struct _gftpui_common_curtrans_data
 
 #define gftpui_common_use_threads(request)	(gftp_protocols[(request)->protonum].use_threads)
 
+/* Files are only split into segments if each segment is at least this big */
+#define GFTPUI_COMMON_MIN_SEGMENT_SIZE	(4 * 1024 * 1024)
+
+/* A file that is being downloaded in segments is written under its name
+   with this added, and only renamed once it has no holes in it */
+#define GFTPUI_COMMON_PART_SUFFIX	".gftp-part"
+
+/* Number of trans_blksize buffers that the reader can get ahead of the
+   writer during a file transfer */
+#define GFTPUI_COMMON_PIPELINE_DEPTH	4
+
+/* Number of entries after the current one in a transfer that are looked at
+   for files that the protocol can ask the server for ahead of time */
+#define GFTPUI_COMMON_MAX_PREFETCH	32
+
 #define GFTPUI_COMMON_COLOR_BLACK     "\033[30m"
 #define GFTPUI_COMMON_COLOR_RED       "\033[31m"
 #define GFTPUI_COMMON_COLOR_GREEN     "\033[32m"
@@ -133,6 +148,8 @@ gftp_transfer * gftpui_common_add_file_transfer ( gftp_request * fromreq,
 						  void *touidata,
 						  GList * files );
 
+void gftpui_common_restore_transfers	( void );
+
 void gftpui_cancel_file_transfer 	( gftp_transfer * tdata );
 
 void gftpui_common_skip_file_transfer	( gftp_transfer * tdata,